@@ -24,6 +24,7 @@
 #include "A2dpAudioInterface.h"
 #include "audio/liba2dp.h"
 #include <hardware_legacy/power.h>
+#include <hardware_legacy/AudioParameterView.h>
 
 
 namespace android_audio_legacy {
@@ -132,32 +133,41 @@ status_t A2dpAudioInterface::getMicMute(bool* state)
 
 status_t A2dpAudioInterface::setParameters(const String8& keyValuePairs)
 {
-    AudioParameter param = AudioParameter(keyValuePairs);
-    String8 value;
-    String8 key;
+    AudioParameterView param = AudioParameterView(keyValuePairs.string());
+    size_t handled = 0;
     status_t status = NO_ERROR;
 
     ALOGV("setParameters() %s", keyValuePairs.string());
 
-    key = "bluetooth_enabled";
-    if (param.get(key, value) == NO_ERROR) {
-        mBluetoothEnabled = (value == "true");
+    if (param.has(AudioParameterView::KEY_BLUETOOTH_ENABLED)) {
+        mBluetoothEnabled = param.equals(AudioParameterView::KEY_BLUETOOTH_ENABLED, "true");
         if (mOutput) {
             mOutput->setBluetoothEnabled(mBluetoothEnabled);
         }
-        param.remove(key);
+        handled++;
     }
-    key = String8("A2dpSuspended");
-    if (param.get(key, value) == NO_ERROR) {
-        mSuspended = (value == "true");
+    if (param.has(AudioParameterView::KEY_A2DP_SUSPENDED)) {
+        mSuspended = param.equals(AudioParameterView::KEY_A2DP_SUSPENDED, "true");
         if (mOutput) {
             mOutput->setSuspended(mSuspended);
         }
-        param.remove(key);
+        handled++;
     }
 
-    if (param.size()) {
-        status_t hwStatus = mHardwareInterface->setParameters(param.toString());
+    // the other pairs are for the hardware interface. Strings without A2DP keys, the most
+    // frequent, are passed on as is.
+    if (param.size() != handled) {
+        status_t hwStatus;
+        if (handled == 0) {
+            hwStatus = mHardwareInterface->setParameters(keyValuePairs);
+        } else {
+            AudioParameter hwParam = AudioParameter(keyValuePairs);
+            hwParam.remove(String8(AudioParameterView::keyName(
+                    AudioParameterView::KEY_BLUETOOTH_ENABLED)));
+            hwParam.remove(String8(AudioParameterView::keyName(
+                    AudioParameterView::KEY_A2DP_SUSPENDED)));
+            hwStatus = mHardwareInterface->setParameters(hwParam.toString());
+        }
         if (status == NO_ERROR) {
             status = hwStatus;
         }
@@ -373,41 +383,40 @@ status_t A2dpAudioInterface::A2dpAudioStreamOut::standby_l()
 
 status_t A2dpAudioInterface::A2dpAudioStreamOut::setParameters(const String8& keyValuePairs)
 {
-    AudioParameter param = AudioParameter(keyValuePairs);
-    String8 value;
-    String8 key = String8("a2dp_sink_address");
+    AudioParameterView param = AudioParameterView(keyValuePairs.string());
+    char address[sizeof("00:00:00:00:00:00")];
+    size_t handled = 0;
     status_t status = NO_ERROR;
     int device;
     ALOGV("A2dpAudioStreamOut::setParameters() %s", keyValuePairs.string());
 
-    if (param.get(key, value) == NO_ERROR) {
-        if (value.length() != strlen("00:00:00:00:00:00")) {
+    if (param.has(AudioParameterView::KEY_A2DP_SINK_ADDRESS)) {
+        if ((param.get(AudioParameterView::KEY_A2DP_SINK_ADDRESS, address, sizeof(address)) !=
+                NO_ERROR) || (strlen(address) != strlen("00:00:00:00:00:00"))) {
             status = BAD_VALUE;
         } else {
-            setAddress(value.string());
+            setAddress(address);
         }
-        param.remove(key);
+        handled++;
     }
-    key = String8("closing");
-    if (param.get(key, value) == NO_ERROR) {
-        mClosing = (value == "true");
+    if (param.has(AudioParameterView::KEY_CLOSING)) {
+        mClosing = param.equals(AudioParameterView::KEY_CLOSING, "true");
         if (mClosing) {
             standby();
         }
-        param.remove(key);
+        handled++;
     }
-    key = AudioParameter::keyRouting;
-    if (param.getInt(key, device) == NO_ERROR) {
+    if (param.getInt(AudioParameterView::KEY_ROUTING, &device) == NO_ERROR) {
         if (audio_is_a2dp_device(device)) {
             mDevice = device;
             status = NO_ERROR;
         } else {
             status = BAD_VALUE;
         }
-        param.remove(key);
+        handled++;
     }
 
-    if (param.size()) {
+    if (param.size() != handled) {
         status = BAD_VALUE;
     }
     return status;
@@ -8,14 +8,53 @@ include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
     AudioHardwareInterface.cpp \
+    AudioParameterView.cpp \
     audio_hw_hal.cpp
 
+# The resampler and format converter kernels use SSE2 on x86. On ARM they are scalar until
+# a board has run legacy_audio_kernel_bench on its target, which checks the NEON kernels
+# against the scalar ones, and sets BOARD_LEGACY_AUDIO_NEON_KERNELS := true
+ifeq ($(ARCH_ARM_HAVE_NEON)$(BOARD_LEGACY_AUDIO_NEON_KERNELS),truetrue)
+LOCAL_SRC_FILES += LegacyResampler.cpp.neon LegacyFormatConverter.cpp.neon
+else
+LOCAL_SRC_FILES += LegacyResampler.cpp LegacyFormatConverter.cpp
+ifeq ($(TARGET_ARCH),arm)
+  LOCAL_CFLAGS += -DLEGACY_AUDIO_SCALAR_KERNELS
+endif
+endif
+
+# set when the platform audio.h defines AUDIO_FORMAT_PCM_FLOAT and AUDIO_FORMAT_PCM_24_BIT_PACKED
+ifeq ($(BOARD_LEGACY_AUDIO_FLOAT_FORMATS),true)
+  LOCAL_CFLAGS += -DLEGACY_AUDIO_FLOAT_FORMATS
+endif
+
 LOCAL_MODULE := libaudiohw_legacy
 LOCAL_MODULE_TAGS := optional
 LOCAL_STATIC_LIBRARIES := libmedia_helper
 
 include $(BUILD_STATIC_LIBRARY)
 
+# Throughput of the resampler and format converter kernels, and check of the SIMD kernels
+# against the scalar ones: legacy_audio_kernel_bench [seconds per kernel]
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+    tests/legacy_audio_kernel_bench.cpp \
+    tests/LegacyResamplerScalar.cpp \
+    tests/LegacyFormatConverterScalar.cpp
+
+ifeq ($(ARCH_ARM_HAVE_NEON),true)
+LOCAL_SRC_FILES += LegacyResampler.cpp.neon LegacyFormatConverter.cpp.neon
+else
+LOCAL_SRC_FILES += LegacyResampler.cpp LegacyFormatConverter.cpp
+endif
+
+LOCAL_SHARED_LIBRARIES := liblog
+LOCAL_MODULE := legacy_audio_kernel_bench
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
+
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
@@ -63,6 +102,27 @@ LOCAL_MODULE_TAGS := optional
 
 include $(BUILD_STATIC_LIBRARY)
 
+# Contention on the policy manager locks under N concurrent callers:
+# audio_policy_lock_bench [seconds per run] [max callers]
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+    tests/audio_policy_lock_bench.cpp
+
+LOCAL_SHARED_LIBRARIES := \
+    libcutils \
+    libutils \
+    liblog
+
+LOCAL_STATIC_LIBRARIES := \
+    libaudiopolicy_legacy \
+    libmedia_helper
+
+LOCAL_MODULE := audio_policy_lock_bench
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
+
 # The default audio policy, for now still implemented on top of legacy
 # policy code
 include $(CLEAR_VARS)
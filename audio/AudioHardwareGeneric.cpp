@@ -18,13 +18,23 @@
 #include <stdint.h>
 #include <sys/types.h>
 
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <sched.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
 
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define MIXER_USE_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define MIXER_USE_SSE2
+#endif
+
 #define LOG_TAG "AudioHardware"
 #include <utils/Log.h>
 #include <utils/String8.h>
@@ -32,6 +42,7 @@
 #include "AudioHardwareGeneric.h"
 #include <media/AudioRecord.h>
 
+#include <hardware_legacy/AudioParameterView.h>
 #include <hardware_legacy/AudioSystemLegacy.h>
 
 namespace android_audio_legacy {
@@ -40,18 +51,36 @@ namespace android_audio_legacy {
 
 static char const * const kAudioDeviceName = "/dev/eac";
 
+// device period: one AudioStreamOutGeneric buffer of 16 bit stereo at 44100 Hz
+static const size_t kMixerPeriodSize = 4096;
+static const uint32_t kMixerSampleRate = 44100;
+static const size_t kMixerFrameSize = 2 * sizeof(int16_t);
+
 // ----------------------------------------------------------------------------
 
 AudioHardwareGeneric::AudioHardwareGeneric()
-    : mOutput(0), mInput(0),  mFd(-1), mMicMute(false)
+    : mInput(0),  mFd(-1), mMicMute(false)
 {
     mFd = ::open(kAudioDeviceName, O_RDWR);
+    if (mFd >= 0) {
+        mMixer = new AudioMixerGeneric(mFd, kMixerPeriodSize, kMixerSampleRate);
+        if (mMixer->run("AudioMixerGeneric", ANDROID_PRIORITY_URGENT_AUDIO) != NO_ERROR) {
+            ALOGE("cannot start the mixer thread");
+            mMixer.clear();
+        }
+    }
 }
 
 AudioHardwareGeneric::~AudioHardwareGeneric()
 {
+    while (mOutputs.size() != 0) {
+        closeOutputStream((AudioStreamOut *)mOutputs[0]);
+    }
+    if (mMixer != 0) {
+        mMixer->exit();
+        mMixer.clear();
+    }
     if (mFd >= 0) ::close(mFd);
-    closeOutputStream((AudioStreamOut *)mOutput);
     closeInputStream((AudioStreamIn *)mInput);
 }
 
@@ -69,33 +98,37 @@ AudioStreamOut* AudioHardwareGeneric::openOutputStream(
 {
     AutoMutex lock(mLock);
 
-    // only one output stream allowed
-    if (mOutput) {
+    // output streams are mixed in software, one mixer track each
+    if (mMixer == 0 || mOutputs.size() >= AudioMixerGeneric::MAX_TRACKS) {
         if (status) {
-            *status = INVALID_OPERATION;
+            *status = (mMixer == 0) ? NO_INIT : INVALID_OPERATION;
         }
         return 0;
     }
 
     // create new output stream
     AudioStreamOutGeneric* out = new AudioStreamOutGeneric();
-    status_t lStatus = out->set(this, mFd, devices, format, channels, sampleRate);
+    status_t lStatus = out->set(this, mMixer, mFd, devices, format, channels, sampleRate);
     if (status) {
         *status = lStatus;
     }
-    if (lStatus == NO_ERROR) {
-        mOutput = out;
-    } else {
+    if (lStatus != NO_ERROR) {
         delete out;
+        return 0;
     }
-    return mOutput;
+    mOutputs.add(out);
+    return out;
 }
 
 void AudioHardwareGeneric::closeOutputStream(AudioStreamOut* out) {
-    if (mOutput && out == mOutput) {
-        delete mOutput;
-        mOutput = 0;
+    AutoMutex lock(mLock);
+    AudioStreamOutGeneric *genericOut = (AudioStreamOutGeneric *)out;
+
+    if (mOutputs.indexOf(genericOut) < 0) {
+        return;
     }
+    mOutputs.remove(genericOut);
+    delete genericOut;
 }
 
 AudioStreamIn* AudioHardwareGeneric::openInputStream(
@@ -181,16 +214,257 @@ status_t AudioHardwareGeneric::dump(int fd, const Vector<String16>& args)
     if (mInput) {
         mInput->dump(fd, args);
     }
-    if (mOutput) {
-        mOutput->dump(fd, args);
+    for (size_t i = 0; i < mOutputs.size(); i++) {
+        mOutputs[i]->dump(fd, args);
+    }
+    if (mMixer != 0) {
+        mMixer->dump(fd);
     }
     return NO_ERROR;
 }
 
 // ----------------------------------------------------------------------------
 
+// dst = dst + src on count samples, saturated to 16 bit
+static void mixSaturate(int16_t *dst, const int16_t *src, size_t count)
+{
+    size_t i = 0;
+#if defined(MIXER_USE_NEON)
+    for (; i + 8 <= count; i += 8) {
+        vst1q_s16(dst + i, vqaddq_s16(vld1q_s16(dst + i), vld1q_s16(src + i)));
+    }
+#elif defined(MIXER_USE_SSE2)
+    for (; i + 8 <= count; i += 8) {
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_adds_epi16(d, s));
+    }
+#endif
+    for (; i < count; i++) {
+        int32_t sum = (int32_t)dst[i] + src[i];
+        if (sum > 32767) {
+            sum = 32767;
+        } else if (sum < -32768) {
+            sum = -32768;
+        }
+        dst[i] = (int16_t)sum;
+    }
+}
+
+AudioMixerGeneric::AudioMixerGeneric(int fd, size_t periodSize, uint32_t sampleRate)
+    : Thread(false), mFd(fd), mPeriodSize(periodSize),
+      mPeriodUs((uint32_t)((uint64_t)periodSize / kMixerFrameSize * 1000000 / sampleRate)),
+      mRingSize(MIXER_RING_PERIODS * periodSize), mWriteErrors(0)
+{
+    mMixBuffer = new int16_t[mPeriodSize / sizeof(int16_t)];
+    memset(mTracks, 0, sizeof(mTracks));
+}
+
+AudioMixerGeneric::~AudioMixerGeneric()
+{
+    for (int i = 0; i < MAX_TRACKS; i++) {
+        free(mTracks[i].ring);
+    }
+    delete[] mMixBuffer;
+}
+
+int AudioMixerGeneric::addTrack()
+{
+    AutoMutex lock(mLock);
+
+    for (int i = 0; i < MAX_TRACKS; i++) {
+        Track& t = mTracks[i];
+        if (t.used) {
+            continue;
+        }
+        t.ring = (uint8_t *)malloc(mRingSize);
+        if (t.ring == NULL) {
+            return -1;
+        }
+        t.used = true;
+        t.draining = false;
+        t.front = 0;
+        t.count = 0;
+        t.periods = 0;
+        t.underruns = 0;
+        return i;
+    }
+    return -1;
+}
+
+void AudioMixerGeneric::removeTrack(int track)
+{
+    AutoMutex lock(mLock);
+    Track& t = mTracks[track];
+
+    free(t.ring);
+    t.ring = NULL;
+    t.used = false;
+    mSpaceCond.broadcast();
+}
+
+ssize_t AudioMixerGeneric::write(int track, const void *buffer, size_t bytes)
+{
+    AutoMutex lock(mLock);
+    Track& t = mTracks[track];
+    const uint8_t *src = (const uint8_t *)buffer;
+    size_t done = 0;
+
+    // the ring only holds whole frames
+    bytes -= bytes % kMixerFrameSize;
+    t.draining = false;
+    while (done < bytes) {
+        while (t.count == mRingSize && !exitPending()) {
+            mSpaceCond.wait(mLock);
+        }
+        if (exitPending()) {
+            return done != 0 ? (ssize_t)done : (ssize_t)DEAD_OBJECT;
+        }
+        size_t rear = (t.front + t.count) % mRingSize;
+        size_t chunk = bytes - done;
+        if (chunk > mRingSize - t.count) {
+            chunk = mRingSize - t.count;
+        }
+        if (chunk > mRingSize - rear) {
+            chunk = mRingSize - rear;
+        }
+        memcpy(t.ring + rear, src + done, chunk);
+        t.count += chunk;
+        done += chunk;
+        if (t.count >= mPeriodSize) {
+            mWorkCond.signal();
+        }
+    }
+    return done;
+}
+
+void AudioMixerGeneric::drain(int track)
+{
+    AutoMutex lock(mLock);
+    Track& t = mTracks[track];
+
+    t.draining = true;
+    if (t.count != 0) {
+        mWorkCond.signal();
+    }
+}
+
+void AudioMixerGeneric::exit()
+{
+    requestExit();
+    {
+        AutoMutex lock(mLock);
+        mWorkCond.signal();
+        mSpaceCond.broadcast();
+    }
+    requestExitAndWait();
+}
+
+bool AudioMixerGeneric::isReady(int track) const
+{
+    const Track& t = mTracks[track];
+    return t.used && (t.count >= mPeriodSize || (t.draining && t.count != 0));
+}
+
+void AudioMixerGeneric::mixTrack(int track, bool first)
+{
+    Track& t = mTracks[track];
+    uint8_t *dst = (uint8_t *)mMixBuffer;
+    size_t bytes = t.count < mPeriodSize ? t.count : mPeriodSize;
+    size_t done = 0;
+
+    while (done < bytes) {
+        size_t chunk = bytes - done;
+        if (chunk > mRingSize - t.front) {
+            chunk = mRingSize - t.front;
+        }
+        if (first) {
+            memcpy(dst + done, t.ring + t.front, chunk);
+        } else {
+            mixSaturate((int16_t *)(dst + done), (const int16_t *)(t.ring + t.front),
+                        chunk / sizeof(int16_t));
+        }
+        t.front = (t.front + chunk) % mRingSize;
+        done += chunk;
+    }
+    if (first && bytes < mPeriodSize) {
+        memset(dst + bytes, 0, mPeriodSize - bytes);
+    }
+    if (bytes < mPeriodSize) {
+        t.underruns++;
+    }
+    t.count -= bytes;
+    t.periods++;
+    if (t.count == 0) {
+        t.draining = false;
+    }
+}
+
+bool AudioMixerGeneric::threadLoop()
+{
+    {
+        AutoMutex lock(mLock);
+        bool first = true;
+
+        for (;;) {
+            if (exitPending()) {
+                return false;
+            }
+            for (int i = 0; i < MAX_TRACKS; i++) {
+                if (isReady(i)) {
+                    mixTrack(i, first);
+                    first = false;
+                }
+            }
+            if (!first) {
+                break;
+            }
+            mWorkCond.wait(mLock);
+        }
+        mSpaceCond.broadcast();
+    }
+
+    // the blocking device write paces the mix to the device period
+    ssize_t written = ::write(mFd, mMixBuffer, mPeriodSize);
+    if (written < 0) {
+        if (mWriteErrors++ == 0) {
+            ALOGW("threadLoop() write error %d", errno);
+        }
+        usleep(mPeriodUs);
+    }
+    return true;
+}
+
+status_t AudioMixerGeneric::dump(int fd)
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    String8 result;
+    AutoMutex lock(mLock);
+
+    snprintf(buffer, SIZE, "AudioMixerGeneric::dump\n");
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tperiod: %zu bytes, %u us, write errors: %u\n",
+             mPeriodSize, mPeriodUs, mWriteErrors);
+    result.append(buffer);
+    for (int i = 0; i < MAX_TRACKS; i++) {
+        const Track& t = mTracks[i];
+        if (!t.used) {
+            continue;
+        }
+        snprintf(buffer, SIZE, "\ttrack %d: queued %zu bytes, periods %u, underruns %u%s\n",
+                 i, t.count, t.periods, t.underruns, t.draining ? ", draining" : "");
+        result.append(buffer);
+    }
+    ::write(fd, result.string(), result.size());
+    return NO_ERROR;
+}
+
+// ----------------------------------------------------------------------------
+
 status_t AudioStreamOutGeneric::set(
         AudioHardwareGeneric *hw,
+        const sp<AudioMixerGeneric>& mixer,
         int fd,
         uint32_t devices,
         int *pFormat,
@@ -220,6 +494,11 @@ status_t AudioStreamOutGeneric::set(
     if (pChannels) *pChannels = lChannels;
     if (pRate) *pRate = lRate;
 
+    mTrack = mixer->addTrack();
+    if (mTrack < 0) {
+        return INVALID_OPERATION;
+    }
+    mMixer = mixer;
     mAudioHardware = hw;
     mFd = fd;
     mDevice = devices;
@@ -228,17 +507,28 @@ status_t AudioStreamOutGeneric::set(
 
 AudioStreamOutGeneric::~AudioStreamOutGeneric()
 {
+    if (mTrack >= 0) {
+        mMixer->removeTrack(mTrack);
+    }
+}
+
+uint32_t AudioStreamOutGeneric::latency() const
+{
+    // device latency plus the audio queued on the mixer track
+    return 20 + (uint32_t)((uint64_t)AudioMixerGeneric::MIXER_RING_PERIODS * bufferSize() /
+                           frameSize() * 1000 / sampleRate());
 }
 
 ssize_t AudioStreamOutGeneric::write(const void* buffer, size_t bytes)
 {
     Mutex::Autolock _l(mLock);
-    return ssize_t(::write(mFd, buffer, bytes));
+    return mMixer->write(mTrack, buffer, bytes);
 }
 
 status_t AudioStreamOutGeneric::standby()
 {
-    // Implement: audio hardware to standby mode
+    // let the mixer play the last partial period
+    mMixer->drain(mTrack);
     return NO_ERROR;
 }
 
@@ -263,27 +553,28 @@ status_t AudioStreamOutGeneric::dump(int fd, const Vector<String16>& args)
     result.append(buffer);
     snprintf(buffer, SIZE, "\tmFd: %d\n", mFd);
     result.append(buffer);
+    snprintf(buffer, SIZE, "\tmixer track: %d\n", mTrack);
+    result.append(buffer);
     ::write(fd, result.string(), result.size());
     return NO_ERROR;
 }
 
 status_t AudioStreamOutGeneric::setParameters(const String8& keyValuePairs)
 {
-    AudioParameter param = AudioParameter(keyValuePairs);
-    String8 key = String8(AudioParameter::keyRouting);
-    status_t status = NO_ERROR;
+    AudioParameterView param = AudioParameterView(keyValuePairs.string());
+    size_t handled = 0;
     int device;
     ALOGV("setParameters() %s", keyValuePairs.string());
 
-    if (param.getInt(key, device) == NO_ERROR) {
+    if (param.getInt(AudioParameterView::KEY_ROUTING, &device) == NO_ERROR) {
         mDevice = device;
-        param.remove(key);
+        handled++;
     }
 
-    if (param.size()) {
-        status = BAD_VALUE;
+    if (param.size() != handled) {
+        return BAD_VALUE;
     }
-    return status;
+    return NO_ERROR;
 }
 
 String8 AudioStreamOutGeneric::getParameters(const String8& keys)
@@ -377,21 +668,20 @@ status_t AudioStreamInGeneric::dump(int fd, const Vector<String16>& args)
 
 status_t AudioStreamInGeneric::setParameters(const String8& keyValuePairs)
 {
-    AudioParameter param = AudioParameter(keyValuePairs);
-    String8 key = String8(AudioParameter::keyRouting);
-    status_t status = NO_ERROR;
+    AudioParameterView param = AudioParameterView(keyValuePairs.string());
+    size_t handled = 0;
     int device;
     ALOGV("setParameters() %s", keyValuePairs.string());
 
-    if (param.getInt(key, device) == NO_ERROR) {
+    if (param.getInt(AudioParameterView::KEY_ROUTING, &device) == NO_ERROR) {
         mDevice = device;
-        param.remove(key);
+        handled++;
     }
 
-    if (param.size()) {
-        status = BAD_VALUE;
+    if (param.size() != handled) {
+        return BAD_VALUE;
     }
-    return status;
+    return NO_ERROR;
 }
 
 String8 AudioStreamInGeneric::getParameters(const String8& keys)
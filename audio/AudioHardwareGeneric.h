@@ -21,6 +21,7 @@
 #include <stdint.h>
 #include <sys/types.h>
 
+#include <utils/SortedVector.h>
 #include <utils/threads.h>
 
 #include <hardware_legacy/AudioSystemLegacy.h>
@@ -29,18 +30,79 @@
 namespace android_audio_legacy {
     using android::Mutex;
     using android::AutoMutex;
+    using android::Condition;
+    using android::Thread;
+    using android::sp;
+    using android::SortedVector;
 
 // ----------------------------------------------------------------------------
 
 class AudioHardwareGeneric;
 
+// Mixes the 16 bit stereo audio of several output streams into the device. Each stream
+// writes to its own track, a ring buffer of MIXER_RING_PERIODS device periods. The mixer
+// thread sums one period of every track holding a full period, saturating, and writes it to
+// the device: the blocking device write paces the mix to the device period.
+class AudioMixerGeneric : public Thread {
+public:
+    enum {
+        MAX_TRACKS = 4,
+        MIXER_RING_PERIODS = 2,
+    };
+
+                        AudioMixerGeneric(int fd, size_t periodSize, uint32_t sampleRate);
+    virtual             ~AudioMixerGeneric();
+
+    // returns a track index, or -1 if MAX_TRACKS are in use
+            int         addTrack();
+            void        removeTrack(int track);
+    // queues audio on a track, blocking while its ring buffer is full
+            ssize_t     write(int track, const void *buffer, size_t bytes);
+    // mixes what is left on a track even if it is less than a period, padded with silence
+            void        drain(int track);
+            void        exit();
+            status_t    dump(int fd);
+
+private:
+                        AudioMixerGeneric(const AudioMixerGeneric &);
+            AudioMixerGeneric& operator = (const AudioMixerGeneric&);
+
+    virtual bool        threadLoop();
+    // true if a track has a period to mix, or audio left to drain; called with mLock held
+            bool        isReady(int track) const;
+    // adds or copies one period of a track to mMixBuffer; called with mLock held
+            void        mixTrack(int track, bool first);
+
+    struct Track {
+        bool        used;
+        bool        draining;   // set by drain(), cleared by write()
+        uint8_t     *ring;      // MIXER_RING_PERIODS * mPeriodSize bytes
+        size_t      front;      // read offset
+        size_t      count;      // bytes queued
+        uint32_t    periods;    // periods mixed
+        uint32_t    underruns;  // partial periods mixed on drain
+    };
+
+    Mutex       mLock;
+    Condition   mWorkCond;      // signaled when a track becomes ready, or on exit
+    Condition   mSpaceCond;     // signaled when tracks are consumed or removed
+    int         mFd;
+    size_t      mPeriodSize;
+    uint32_t    mPeriodUs;
+    size_t      mRingSize;
+    int16_t     *mMixBuffer;    // one period
+    Track       mTracks[MAX_TRACKS];
+    uint32_t    mWriteErrors;
+};
+
 class AudioStreamOutGeneric : public AudioStreamOut {
 public:
-                        AudioStreamOutGeneric() : mAudioHardware(0), mFd(-1) {}
+                        AudioStreamOutGeneric() : mAudioHardware(0), mFd(-1), mTrack(-1) {}
     virtual             ~AudioStreamOutGeneric();
 
     virtual status_t    set(
             AudioHardwareGeneric *hw,
+            const sp<AudioMixerGeneric>& mixer,
             int mFd,
             uint32_t devices,
             int *pFormat,
@@ -51,7 +113,7 @@ public:
     virtual size_t      bufferSize() const { return 4096; }
     virtual uint32_t    channels() const { return AudioSystem::CHANNEL_OUT_STEREO; }
     virtual int         format() const { return AudioSystem::PCM_16_BIT; }
-    virtual uint32_t    latency() const { return 20; }
+    virtual uint32_t    latency() const;
     virtual status_t    setVolume(float left, float right) { return INVALID_OPERATION; }
     virtual ssize_t     write(const void* buffer, size_t bytes);
     virtual status_t    standby();
@@ -62,8 +124,10 @@ public:
 
 private:
     AudioHardwareGeneric *mAudioHardware;
+    sp<AudioMixerGeneric> mMixer;
     Mutex   mLock;
     int     mFd;
+    int     mTrack;
     uint32_t mDevice;
 };
 
@@ -143,7 +207,8 @@ private:
     status_t                dumpInternals(int fd, const Vector<String16>& args);
 
     Mutex                   mLock;
-    AudioStreamOutGeneric   *mOutput;
+    sp<AudioMixerGeneric>   mMixer;
+    SortedVector<AudioStreamOutGeneric *> mOutputs;
     AudioStreamInGeneric    *mInput;
     int                     mFd;
     bool                    mMicMute;
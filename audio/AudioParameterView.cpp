@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "AudioParameterView"
+//#define LOG_NDEBUG 0
+
+#include <stdio.h>
+#include <string.h>
+
+#include <utils/Log.h>
+
+#include <hardware_legacy/AudioParameterView.h>
+
+namespace android_audio_legacy {
+
+using android::NO_ERROR;
+using android::BAD_VALUE;
+using android::NAME_NOT_FOUND;
+using android::INVALID_OPERATION;
+
+// must be kept in sync with known_key and with the key strings of AudioParameter
+static const char * const sKnownKeys[AudioParameterView::NUM_KNOWN_KEYS] = {
+    "routing",
+    "a2dp_sink_address",
+    "A2dpSuspended",
+    "bluetooth_enabled",
+    "closing",
+    "telemetry",
+    "capture_position",
+};
+
+// large enough for any decimal int with sign and leading white space
+#define MAX_INT_VALUE_LENGTH 16
+
+AudioParameterView::AudioParameterView(const char *keyValuePairs)
+    : mKeyValuePairs(keyValuePairs), mSize(0)
+{
+    for (int i = 0; i < NUM_KNOWN_KEYS; i++) {
+        mValueOffset[i] = -1;
+        mValueLength[i] = 0;
+    }
+    if (keyValuePairs == NULL) {
+        return;
+    }
+
+    // Same splitting rules as AudioParameter: pairs are separated by ';', empty pairs are
+    // skipped, a pair without '=' has an empty value and the last occurrence of a key wins.
+    const char *pair = keyValuePairs;
+    while (*pair != '\0') {
+        const char *end = strchr(pair, ';');
+        if (end == NULL) {
+            end = pair + strlen(pair);
+        }
+        if (end != pair) {
+            const char *equal = (const char *)memchr(pair, '=', end - pair);
+            size_t keyLength = (equal != NULL ? equal : end) - pair;
+            const char *value = (equal != NULL) ? equal + 1 : end;
+
+            int key;
+            for (key = 0; key < NUM_KNOWN_KEYS; key++) {
+                if (strncmp(sKnownKeys[key], pair, keyLength) == 0 &&
+                        sKnownKeys[key][keyLength] == '\0') {
+                    break;
+                }
+            }
+            if (key < NUM_KNOWN_KEYS) {
+                if (mValueOffset[key] < 0) {
+                    mSize++;
+                }
+                mValueOffset[key] = value - keyValuePairs;
+                mValueLength[key] = end - value;
+            } else {
+                mSize++;
+            }
+        }
+        if (*end == '\0') {
+            break;
+        }
+        pair = end + 1;
+    }
+}
+
+status_t AudioParameterView::get(known_key key, const char **value, size_t *length) const
+{
+    if (!has(key)) {
+        return BAD_VALUE;
+    }
+    *value = mKeyValuePairs + mValueOffset[key];
+    *length = mValueLength[key];
+    return NO_ERROR;
+}
+
+status_t AudioParameterView::get(known_key key, char *value, size_t size) const
+{
+    const char *str;
+    size_t length;
+
+    if (get(key, &str, &length) != NO_ERROR) {
+        return BAD_VALUE;
+    }
+    if (length >= size) {
+        return NAME_NOT_FOUND;
+    }
+    memcpy(value, str, length);
+    value[length] = '\0';
+    return NO_ERROR;
+}
+
+status_t AudioParameterView::getInt(known_key key, int *value) const
+{
+    char str[MAX_INT_VALUE_LENGTH];
+    status_t status = get(key, str, sizeof(str));
+
+    *value = 0;
+    if (status == BAD_VALUE) {
+        return status;
+    }
+    // same conversion as AudioParameter::getInt()
+    int val;
+    if (status != NO_ERROR || sscanf(str, "%d", &val) != 1) {
+        return INVALID_OPERATION;
+    }
+    *value = val;
+    return NO_ERROR;
+}
+
+bool AudioParameterView::equals(known_key key, const char *value) const
+{
+    const char *str;
+    size_t length;
+
+    if (get(key, &str, &length) != NO_ERROR) {
+        return false;
+    }
+    return strncmp(str, value, length) == 0 && value[length] == '\0';
+}
+
+const char *AudioParameterView::keyName(known_key key)
+{
+    return sKnownKeys[key];
+}
+
+}; // namespace android_audio_legacy
@@ -19,6 +19,7 @@
 
 #include <stdint.h>
 
+#include <utils/Log.h>
 #include <hardware/hardware.h>
 #include <system/audio.h>
 #include <system/audio_policy.h>
@@ -118,6 +119,17 @@ void AudioPolicyCompatClient::setParameters(audio_io_handle_t ioHandle,
                            delayMs);
 }
 
+void AudioPolicyCompatClient::setRoutingParameters(audio_io_handle_t ioHandle,
+                                                   const String8& keyValuePairs,
+                                                   int delayMs,
+                                                   uint32_t eventId)
+{
+    ALOGV("setRoutingParameters() event %u io %d %s delayMs %d",
+          eventId, ioHandle, keyValuePairs.string(), delayMs);
+    mServiceOps->set_parameters(mService, ioHandle, keyValuePairs.string(),
+                           delayMs);
+}
+
 status_t AudioPolicyCompatClient::setStreamVolume(
                                              AudioSystem::stream_type stream,
                                              float volume,
@@ -65,6 +65,10 @@ public:
     virtual void setParameters(audio_io_handle_t ioHandle,
                                const String8& keyValuePairs,
                                int delayMs = 0);
+    virtual void setRoutingParameters(audio_io_handle_t ioHandle,
+                                      const String8& keyValuePairs,
+                                      int delayMs,
+                                      uint32_t eventId);
     virtual status_t setStreamVolume(AudioSystem::stream_type stream,
                                      float volume,
                                      audio_io_handle_t output,
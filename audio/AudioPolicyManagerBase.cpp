@@ -38,6 +38,14 @@
 #include <hardware/audio_effect.h>
 #include <hardware/audio.h>
 #include <math.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <poll.h>
 #include <hardware_legacy/audio_policy_conf.h>
 #include <cutils/properties.h>
 
@@ -52,7 +60,9 @@ status_t AudioPolicyManagerBase::setDeviceConnectionState(audio_devices_t device
                                                   AudioSystem::device_connection_state state,
                                                   const char *device_address)
 {
+    PolicyAutolock _l(this, LOCK_ALL);
     SortedVector <audio_io_handle_t> outputs;
+    RoutingEventScope routingEvent(this, ROUTING_EVENT_DEVICE_CONNECTION);
 
     ALOGV("setDeviceConnectionState() device: %x, state %d, address %s", device, state, device_address);
 
@@ -82,18 +92,21 @@ status_t AudioPolicyManagerBase::setDeviceConnectionState(audio_devices_t device
 
         // save a copy of the opened output descriptors before any output is opened or closed
         // by checkOutputsForDevice(). This will be needed by checkOutputForAllStrategies()
-        mPreviousOutputs = mOutputs;
+        // When a transaction is in progress, keep the copy made for its first output change.
+        if ((mConnectionTransactionDepth == 0) || !mTransactionOutputsChanged) {
+            mPreviousOutputs = mOutputs;
+        }
         switch (state)
         {
         // handle output device connection
-        case AudioSystem::DEVICE_STATE_AVAILABLE:
+        case AudioSystem::DEVICE_STATE_AVAILABLE: {
             if (mAvailableOutputDevices & device) {
                 ALOGW("setDeviceConnectionState() device already connected: %x", device);
                 return INVALID_OPERATION;
             }
             ALOGV("setDeviceConnectionState() connecting device %x", device);
 
-            if (checkOutputsForDevice(device, state, outputs) != NO_ERROR) {
+            if (checkOutputsForDevice(device, state, outputs, device_address) != NO_ERROR) {
                 return INVALID_OPERATION;
             }
             ALOGV("setDeviceConnectionState() checkOutputsForDevice() returned %d outputs",
@@ -101,32 +114,34 @@ status_t AudioPolicyManagerBase::setDeviceConnectionState(audio_devices_t device
             // register new device as available
             mAvailableOutputDevices = (audio_devices_t)(mAvailableOutputDevices | device);
 
-            if (!outputs.isEmpty()) {
-                String8 paramStr;
-                if (mHasA2dp && audio_is_a2dp_device(device)) {
-                    // handle A2DP device connection
-                    AudioParameter param;
-                    param.add(String8(AUDIO_PARAMETER_A2DP_SINK_ADDRESS), String8(device_address));
-                    paramStr = param.toString();
-                    mA2dpDeviceAddress = String8(device_address, MAX_DEVICE_ADDRESS_LEN);
-                    mA2dpSuspended = false;
-                } else if (audio_is_bluetooth_sco_device(device)) {
-                    // handle SCO device connection
-                    mScoDeviceAddress = String8(device_address, MAX_DEVICE_ADDRESS_LEN);
-                } else if (mHasUsb && audio_is_usb_device(device)) {
-                    // handle USB device connection
-                    mUsbCardAndDevice = String8(device_address, MAX_DEVICE_ADDRESS_LEN);
-                    paramStr = mUsbCardAndDevice;
-                }
-                // not currently handling multiple simultaneous submixes: ignoring remote submix
-                //   case and address
-                if (!paramStr.isEmpty()) {
-                    for (size_t i = 0; i < outputs.size(); i++) {
-                        mpClientInterface->setParameters(outputs[i], paramStr);
-                    }
+            // no output is returned when only direct outputs of a known USB device match:
+            // the device address must be recorded anyway
+            String8 paramStr;
+            if (mHasA2dp && audio_is_a2dp_device(device)) {
+                // handle A2DP device connection
+                AudioParameter param;
+                param.add(String8(AUDIO_PARAMETER_A2DP_SINK_ADDRESS), String8(device_address));
+                paramStr = param.toString();
+                mA2dpDeviceAddress = String8(device_address, MAX_DEVICE_ADDRESS_LEN);
+                mA2dpSuspended = false;
+                mA2dpSuspendCheckNeeded = true;
+            } else if (audio_is_bluetooth_sco_device(device)) {
+                // handle SCO device connection
+                mScoDeviceAddress = String8(device_address, MAX_DEVICE_ADDRESS_LEN);
+                mA2dpSuspendCheckNeeded = true;
+            } else if (mHasUsb && audio_is_usb_device(device)) {
+                // handle USB device connection
+                mUsbCardAndDevice = String8(device_address, MAX_DEVICE_ADDRESS_LEN);
+                paramStr = mUsbCardAndDevice;
+            }
+            // not currently handling multiple simultaneous submixes: ignoring remote submix
+            //   case and address
+            if (!paramStr.isEmpty()) {
+                for (size_t i = 0; i < outputs.size(); i++) {
+                    mpClientInterface->setParameters(outputs[i], paramStr);
                 }
             }
-            break;
+            } break;
         // handle output device disconnection
         case AudioSystem::DEVICE_STATE_UNAVAILABLE: {
             if (!(mAvailableOutputDevices & device)) {
@@ -143,9 +158,11 @@ status_t AudioPolicyManagerBase::setDeviceConnectionState(audio_devices_t device
                 // handle A2DP device disconnection
                 mA2dpDeviceAddress = "";
                 mA2dpSuspended = false;
+                mA2dpSuspendCheckNeeded = true;
             } else if (audio_is_bluetooth_sco_device(device)) {
                 // handle SCO device disconnection
                 mScoDeviceAddress = "";
+                mA2dpSuspendCheckNeeded = true;
             } else if (mHasUsb && audio_is_usb_device(device)) {
                 // handle USB device disconnection
                 mUsbCardAndDevice = "";
@@ -159,31 +176,13 @@ status_t AudioPolicyManagerBase::setDeviceConnectionState(audio_devices_t device
             return BAD_VALUE;
         }
 
-        checkA2dpSuspend();
-        checkOutputForAllStrategies();
-        // outputs must be closed after checkOutputForAllStrategies() is executed
-        if (!outputs.isEmpty()) {
+        if (mConnectionTransactionDepth != 0) {
             for (size_t i = 0; i < outputs.size(); i++) {
-                AudioOutputDescriptor *desc = mOutputs.valueFor(outputs[i]);
-                // close unused outputs after device disconnection or direct outputs that have been
-                // opened by checkOutputsForDevice() to query dynamic parameters
-                if ((state == AudioSystem::DEVICE_STATE_UNAVAILABLE) ||
-                        (((desc->mFlags & AUDIO_OUTPUT_FLAG_DIRECT) != 0) &&
-                         (desc->mDirectOpenCount == 0))) {
-                    closeOutput(outputs[i]);
-                }
+                mTransactionOutputs.add(outputs[i]);
             }
-        }
-
-        updateDevicesAndOutputs();
-        for (size_t i = 0; i < mOutputs.size(); i++) {
-            // do not force device change on duplicated output because if device is 0, it will
-            // also force a device 0 for the two outputs it is duplicated to which may override
-            // a valid device selection on those outputs.
-            setOutputDevice(mOutputs.keyAt(i),
-                            getNewDevice(mOutputs.keyAt(i), true /*fromCache*/),
-                            !mOutputs.valueAt(i)->isDuplicated(),
-                            0);
+            mTransactionOutputsChanged = true;
+        } else {
+            applyOutputDeviceConnection(outputs);
         }
 
         if (device == AUDIO_DEVICE_OUT_WIRED_HEADSET) {
@@ -193,6 +192,9 @@ status_t AudioPolicyManagerBase::setDeviceConnectionState(audio_devices_t device
                    device == AUDIO_DEVICE_OUT_BLUETOOTH_SCO_CARKIT) {
             device = AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET;
         } else {
+            if (mConnectionTransactionDepth == 0) {
+                saveStateSnapshot();
+            }
             return NO_ERROR;
         }
     }
@@ -225,20 +227,12 @@ status_t AudioPolicyManagerBase::setDeviceConnectionState(audio_devices_t device
             return BAD_VALUE;
         }
 
-        audio_io_handle_t activeInput = getActiveInput();
-        if (activeInput != 0) {
-            AudioInputDescriptor *inputDesc = mInputs.valueFor(activeInput);
-            audio_devices_t newDevice = getDeviceForInputSource(inputDesc->mInputSource);
-            if ((newDevice != AUDIO_DEVICE_NONE) && (newDevice != inputDesc->mDevice)) {
-                ALOGV("setDeviceConnectionState() changing device from %x to %x for input %d",
-                        inputDesc->mDevice, newDevice, activeInput);
-                inputDesc->mDevice = newDevice;
-                AudioParameter param = AudioParameter();
-                param.addInt(String8(AudioParameter::keyRouting), (int)newDevice);
-                mpClientInterface->setParameters(activeInput, param.toString());
-            }
+        if (mConnectionTransactionDepth != 0) {
+            mTransactionInputsChanged = true;
+            return NO_ERROR;
         }
-
+        applyInputDeviceConnection();
+        saveStateSnapshot();
         return NO_ERROR;
     }
 
@@ -249,6 +243,7 @@ status_t AudioPolicyManagerBase::setDeviceConnectionState(audio_devices_t device
 AudioSystem::device_connection_state AudioPolicyManagerBase::getDeviceConnectionState(audio_devices_t device,
                                                   const char *device_address)
 {
+    PolicyAutolock _l(this, LOCK_ROUTE);
     AudioSystem::device_connection_state state = AudioSystem::DEVICE_STATE_UNAVAILABLE;
     String8 address = String8(device_address);
     if (audio_is_output_device(device)) {
@@ -280,9 +275,89 @@ AudioSystem::device_connection_state AudioPolicyManagerBase::getDeviceConnection
     return state;
 }
 
+status_t AudioPolicyManagerBase::beginDeviceConnectionTransaction()
+{
+    PolicyAutolock _l(this, LOCK_ALL);
+
+    ALOGV("beginDeviceConnectionTransaction() depth %d", mConnectionTransactionDepth);
+    if (mConnectionTransactionDepth >= MAX_CONNECTION_TRANSACTION_DEPTH) {
+        ALOGW("beginDeviceConnectionTransaction() too many nested transactions, committing");
+        mConnectionTransactionDepth = 0;
+        applyConnectionTransaction();
+        return INVALID_OPERATION;
+    }
+    if (mConnectionTransactionDepth == 0) {
+        mConnectionTransactionStartTime = mClock->now();
+        if (mConnectionTransactionThread == 0) {
+            mConnectionTransactionThread = new PolicyTimerThread(this,
+                    &AudioPolicyManagerBase::checkConnectionTransactionTimeout);
+            mConnectionTransactionThread->run("AudioPolicyConnectionTransaction",
+                                              ANDROID_PRIORITY_BACKGROUND);
+        }
+        mConnectionTransactionThread->wake();
+    }
+    mConnectionTransactionDepth++;
+    return NO_ERROR;
+}
+
+status_t AudioPolicyManagerBase::commitDeviceConnectionTransaction()
+{
+    PolicyAutolock _l(this, LOCK_ALL);
+
+    if (mConnectionTransactionDepth == 0) {
+        ALOGW("commitDeviceConnectionTransaction() no transaction in progress");
+        return INVALID_OPERATION;
+    }
+    ALOGV("commitDeviceConnectionTransaction() depth %d outputs changed %d inputs changed %d",
+          mConnectionTransactionDepth, mTransactionOutputsChanged, mTransactionInputsChanged);
+    if (--mConnectionTransactionDepth == 0) {
+        applyConnectionTransaction();
+    }
+    return NO_ERROR;
+}
+
+void AudioPolicyManagerBase::applyConnectionTransaction()
+{
+    if (!mTransactionOutputsChanged && !mTransactionInputsChanged) {
+        return;
+    }
+
+    RoutingEventScope routingEvent(this, ROUTING_EVENT_DEVICE_CONNECTION);
+    if (mTransactionOutputsChanged) {
+        applyOutputDeviceConnection(mTransactionOutputs);
+        mTransactionOutputs.clear();
+        mTransactionOutputsChanged = false;
+    }
+    if (mTransactionInputsChanged) {
+        applyInputDeviceConnection();
+        mTransactionInputsChanged = false;
+    }
+    saveStateSnapshot();
+}
+
+nsecs_t AudioPolicyManagerBase::checkConnectionTransactionTimeout()
+{
+    PolicyAutolock _l(this, LOCK_ALL);
+
+    if (mConnectionTransactionDepth == 0) {
+        return -1;
+    }
+    nsecs_t elapsed = mClock->now() - mConnectionTransactionStartTime;
+    if (elapsed < milliseconds(CONNECTION_TRANSACTION_TIMEOUT_MS)) {
+        return milliseconds(CONNECTION_TRANSACTION_TIMEOUT_MS) - elapsed;
+    }
+    ALOGW("device connection transaction not committed after %d ms, committing",
+          CONNECTION_TRANSACTION_TIMEOUT_MS);
+    mConnectionTransactionDepth = 0;
+    applyConnectionTransaction();
+    return -1;
+}
+
 void AudioPolicyManagerBase::setPhoneState(int state)
 {
+    PolicyAutolock _l(this, LOCK_ALL);
     ALOGV("setPhoneState() state %d", state);
+    RoutingEventScope routingEvent(this, ROUTING_EVENT_PHONE_STATE);
     audio_devices_t newDevice = AUDIO_DEVICE_NONE;
     if (state < 0 || state >= AudioSystem::NUM_MODES) {
         ALOGW("setPhoneState() invalid state %d", state);
@@ -306,6 +381,7 @@ void AudioPolicyManagerBase::setPhoneState(int state)
     // store previous phone state for management of sonification strategy below
     int oldState = mPhoneState;
     mPhoneState = state;
+    mA2dpSuspendCheckNeeded = true;
     bool force = false;
 
     // are we entering or starting a call
@@ -334,9 +410,12 @@ void AudioPolicyManagerBase::setPhoneState(int state)
         force = true;
     }
 
-    // check for device and output changes triggered by new phone state
-    newDevice = getNewDevice(mPrimaryOutput, false /*fromCache*/);
+    // check for device and output changes triggered by new phone state. The devices selected
+    // for all strategies in the new state are computed once, after the A2DP suspend state
+    // they depend on is updated.
     checkA2dpSuspend();
+    beginPolicyRecompute();
+    newDevice = getNewDevice(mPrimaryOutput, false /*fromCache*/);
     checkOutputForAllStrategies();
     updateDevicesAndOutputs();
 
@@ -350,19 +429,22 @@ void AudioPolicyManagerBase::setPhoneState(int state)
 
     int delayMs = 0;
     if (isStateInCall(state)) {
-        nsecs_t sysTime = systemTime();
+        nsecs_t sysTime = mClock->now();
         for (size_t i = 0; i < mOutputs.size(); i++) {
             AudioOutputDescriptor *desc = mOutputs.valueAt(i);
             // mute media and sonification strategies and delay device switch by the largest
             // latency of any output where either strategy is active.
             // This avoid sending the ring tone or music tail into the earpiece or headset.
-            if ((desc->isStrategyActive(STRATEGY_MEDIA,
-                                     SONIFICATION_HEADSET_MUSIC_DELAY,
-                                     sysTime) ||
-                    desc->isStrategyActive(STRATEGY_SONIFICATION,
-                                         SONIFICATION_HEADSET_MUSIC_DELAY,
-                                         sysTime)) &&
-                    (delayMs < (int)desc->mLatency*2)) {
+            // Outputs where neither strategy was recently active have no tail to mute.
+            if (!desc->isStrategyActive(STRATEGY_MEDIA,
+                                        SONIFICATION_HEADSET_MUSIC_DELAY,
+                                        sysTime) &&
+                    !desc->isStrategyActive(STRATEGY_SONIFICATION,
+                                            SONIFICATION_HEADSET_MUSIC_DELAY,
+                                            sysTime)) {
+                continue;
+            }
+            if (delayMs < (int)desc->mLatency*2) {
                 delayMs = desc->mLatency*2;
             }
             setStrategyMute(STRATEGY_MEDIA, true, mOutputs.keyAt(i));
@@ -376,6 +458,7 @@ void AudioPolicyManagerBase::setPhoneState(int state)
 
     // change routing is necessary
     setOutputDevice(mPrimaryOutput, newDevice, force, delayMs);
+    endPolicyRecompute();
 
     // if entering in call state, handle special case of active streams
     // pertaining to sonification strategy see handleIncallSonification()
@@ -397,7 +480,9 @@ void AudioPolicyManagerBase::setPhoneState(int state)
 
 void AudioPolicyManagerBase::setForceUse(AudioSystem::force_use usage, AudioSystem::forced_config config)
 {
+    PolicyAutolock _l(this, LOCK_ALL);
     ALOGV("setForceUse() usage %d, config %d, mPhoneState %d", usage, config, mPhoneState);
+    RoutingEventScope routingEvent(this, ROUTING_EVENT_FORCE_USE);
 
     bool forceVolumeReeval = false;
     switch(usage) {
@@ -409,6 +494,7 @@ void AudioPolicyManagerBase::setForceUse(AudioSystem::force_use usage, AudioSyst
         }
         forceVolumeReeval = true;
         mForceUse[usage] = config;
+        mA2dpSuspendCheckNeeded = true;
         break;
     case AudioSystem::FOR_MEDIA:
         if (config != AudioSystem::FORCE_HEADPHONES && config != AudioSystem::FORCE_BT_A2DP &&
@@ -428,6 +514,7 @@ void AudioPolicyManagerBase::setForceUse(AudioSystem::force_use usage, AudioSyst
             return;
         }
         mForceUse[usage] = config;
+        mA2dpSuspendCheckNeeded = true;
         break;
     case AudioSystem::FOR_DOCK:
         if (config != AudioSystem::FORCE_NONE && config != AudioSystem::FORCE_BT_CAR_DOCK &&
@@ -455,6 +542,7 @@ void AudioPolicyManagerBase::setForceUse(AudioSystem::force_use usage, AudioSyst
 
     // check for device and output changes triggered by new force usage
     checkA2dpSuspend();
+    beginPolicyRecompute();
     checkOutputForAllStrategies();
     updateDevicesAndOutputs();
     for (size_t i = 0; i < mOutputs.size(); i++) {
@@ -465,6 +553,7 @@ void AudioPolicyManagerBase::setForceUse(AudioSystem::force_use usage, AudioSyst
             applyStreamVolumes(output, newDevice, 0, true);
         }
     }
+    endPolicyRecompute();
 
     audio_io_handle_t activeInput = getActiveInput();
     if (activeInput != 0) {
@@ -480,10 +569,12 @@ void AudioPolicyManagerBase::setForceUse(AudioSystem::force_use usage, AudioSyst
         }
     }
 
+    saveStateSnapshot();
 }
 
 AudioSystem::forced_config AudioPolicyManagerBase::getForceUse(AudioSystem::force_use usage)
 {
+    PolicyAutolock _l(this, LOCK_ROUTE);
     return mForceUse[usage];
 }
 
@@ -536,6 +627,7 @@ audio_io_handle_t AudioPolicyManagerBase::getOutput(AudioSystem::stream_type str
                                     AudioSystem::output_flags flags,
                                     const audio_offload_info_t *offloadInfo)
 {
+    PolicyAutolock _l(this, LOCK_ROUTE);
     audio_io_handle_t output = 0;
     uint32_t latency = 0;
     routing_strategy strategy = getStrategy((AudioSystem::stream_type)stream);
@@ -663,11 +755,10 @@ audio_io_handle_t AudioPolicyManagerBase::getOutput(AudioSystem::stream_type str
             delete outputDesc;
             return 0;
         }
-        audio_io_handle_t srcOutput = getOutputForEffect();
         addOutput(output, outputDesc);
         audio_io_handle_t dstOutput = getOutputForEffect();
         if (dstOutput == output) {
-            mpClientInterface->moveEffects(AUDIO_SESSION_OUTPUT_MIX, srcOutput, dstOutput);
+            moveGlobalEffects(dstOutput);
         }
         mPreviousOutputs = mOutputs;
         ALOGV("getOutput() returns new direct output %d", output);
@@ -678,6 +769,17 @@ audio_io_handle_t AudioPolicyManagerBase::getOutput(AudioSystem::stream_type str
 
     // open a non direct output
 
+    // while in media idle mode, music tracks that do not need a fast path are steered to the
+    // deep buffer output. See setMediaIdleMode()
+    if ((stream == AudioSystem::MUSIC) && (mMediaIdleThread != 0)) {
+        // the mode is not polled while no music plays
+        updateMediaIdleMode();
+    }
+    if (mMediaIdle && (stream == AudioSystem::MUSIC) &&
+            ((flags & AUDIO_OUTPUT_FLAG_FAST) == 0)) {
+        flags = (AudioSystem::output_flags)(flags | AUDIO_OUTPUT_FLAG_DEEP_BUFFER);
+    }
+
     // for non direct outputs, only PCM is supported
     if (audio_is_linear_pcm((audio_format_t)format)) {
         // get which output is suitable for the specified stream. The actual
@@ -744,6 +846,7 @@ status_t AudioPolicyManagerBase::startOutput(audio_io_handle_t output,
                                              AudioSystem::stream_type stream,
                                              int session)
 {
+    PolicyAutolock _l(this, LOCK_ROUTE | LOCK_VOLUME);
     ALOGD("startOutput() output %d, stream %d, session %d", output, stream, session);
     ssize_t index = mOutputs.indexOfKey(output);
     if (index < 0) {
@@ -753,6 +856,10 @@ status_t AudioPolicyManagerBase::startOutput(audio_io_handle_t output,
 
     AudioOutputDescriptor *outputDesc = mOutputs.valueAt(index);
 
+    if (outputDesc->mIdleSuspended) {
+        restoreIdleOutput(output, outputDesc);
+    }
+
     // increment usage count for this stream on the requested output:
     // NOTE that the usage count is the same for duplicated output and hardware output which is
     // necessary for a correct control of hardware output routing by startOutput() and stopOutput()
@@ -765,6 +872,7 @@ status_t AudioPolicyManagerBase::startOutput(audio_io_handle_t output,
                             (strategy == STRATEGY_SONIFICATION_RESPECTFUL);
         uint32_t waitMs = 0;
         bool force = false;
+        nsecs_t sysTime = mClock->now();
         for (size_t i = 0; i < mOutputs.size(); i++) {
             AudioOutputDescriptor *desc = mOutputs.valueAt(i);
             if (desc != outputDesc) {
@@ -779,7 +887,7 @@ status_t AudioPolicyManagerBase::startOutput(audio_io_handle_t output,
                 // wait for audio on other active outputs to be presented when starting
                 // a notification so that audio focus effect can propagate.
                 uint32_t latency = desc->latency();
-                if (shouldWait && desc->isActive(latency * 2) && (waitMs < latency)) {
+                if (shouldWait && desc->isActive(latency * 2, sysTime) && (waitMs < latency)) {
                     waitMs = latency;
                 }
             }
@@ -800,8 +908,17 @@ status_t AudioPolicyManagerBase::startOutput(audio_io_handle_t output,
         // update the outputs if starting an output with a stream that can affect notification
         // routing
         handleNotificationRoutingForStream(stream);
+
+        // global effects follow media activity
+        if (strategy == STRATEGY_MEDIA) {
+            checkOutputForEffects();
+        }
+        // poll the media idle mode while music plays
+        if ((stream == AudioSystem::MUSIC) && (mMediaIdleThread != 0)) {
+            mMediaIdleThread->wake();
+        }
         if (waitMs > muteWaitMs) {
-            usleep((waitMs - muteWaitMs) * 2 * 1000);
+            mClock->sleepUs((waitMs - muteWaitMs) * 2 * 1000);
         }
     }
     return NO_ERROR;
@@ -812,6 +929,7 @@ status_t AudioPolicyManagerBase::stopOutput(audio_io_handle_t output,
                                             AudioSystem::stream_type stream,
                                             int session)
 {
+    PolicyAutolock _l(this, LOCK_ROUTE | LOCK_VOLUME);
     ALOGV("stopOutput() output %d, stream %d, session %d", output, stream, session);
     ssize_t index = mOutputs.indexOfKey(output);
     if (index < 0) {
@@ -831,7 +949,7 @@ status_t AudioPolicyManagerBase::stopOutput(audio_io_handle_t output,
         outputDesc->changeRefCount(stream, -1);
         // store time at which the stream was stopped - see isStreamActive()
         if (outputDesc->mRefCount[stream] == 0) {
-            outputDesc->mStopTime[stream] = systemTime();
+            outputDesc->mStopTime[stream] = mClock->now();
             audio_devices_t newDevice = getNewDevice(output, false /*fromCache*/);
             // delay the device switch by twice the latency because stopOutput() is executed when
             // the track stop() command is received and at that time the audio track buffer can
@@ -857,6 +975,11 @@ status_t AudioPolicyManagerBase::stopOutput(audio_io_handle_t output,
             }
             // update the outputs if stopping one with a stream that can affect notification routing
             handleNotificationRoutingForStream(stream);
+
+            // schedule the standby of the output if it is now idle
+            if ((mIdleStandbyThread != 0) && !outputDesc->isActive()) {
+                mIdleStandbyThread->wake();
+            }
         }
         return NO_ERROR;
     } else {
@@ -867,6 +990,7 @@ status_t AudioPolicyManagerBase::stopOutput(audio_io_handle_t output,
 
 void AudioPolicyManagerBase::releaseOutput(audio_io_handle_t output)
 {
+    PolicyAutolock _l(this, LOCK_ROUTE);
     ALOGV("releaseOutput() %d", output);
     ssize_t index = mOutputs.indexOfKey(output);
     if (index < 0) {
@@ -881,7 +1005,8 @@ void AudioPolicyManagerBase::releaseOutput(audio_io_handle_t output)
         if (outputDesc->isActive()) {
             mpClientInterface->closeOutput(output);
             delete mOutputs.valueAt(index);
-            mOutputs.removeItem(output);
+            removeOutput(output);
+            invalidateA2dpOutput();
             mTestOutputs[testIndex] = 0;
         }
         return;
@@ -899,10 +1024,7 @@ void AudioPolicyManagerBase::releaseOutput(audio_io_handle_t output)
             closeOutput(output);
             // If effects where present on the output, audioflinger moved them to the primary
             // output by default: move them back to the appropriate output.
-            audio_io_handle_t dstOutput = getOutputForEffect();
-            if (dstOutput != mPrimaryOutput) {
-                mpClientInterface->moveEffects(AUDIO_SESSION_OUTPUT_MIX, mPrimaryOutput, dstOutput);
-            }
+            moveGlobalEffects(getOutputForEffect());
         }
     }
 }
@@ -914,6 +1036,8 @@ audio_io_handle_t AudioPolicyManagerBase::getInput(int inputSource,
                                     uint32_t channelMask,
                                     AudioSystem::audio_in_acoustics acoustics)
 {
+    // getDeviceForInputSource() reads the connected devices and forced usages
+    PolicyAutolock _l(this, LOCK_ROUTE | LOCK_INPUT);
     audio_io_handle_t input = 0;
     audio_devices_t device = getDeviceForInputSource(inputSource);
 
@@ -983,7 +1107,10 @@ audio_io_handle_t AudioPolicyManagerBase::getInput(int inputSource,
         delete inputDesc;
         return 0;
     }
-    mInputs.add(input, inputDesc);
+    {
+        PolicyAutolock _el(this, LOCK_EFFECT);
+        mInputs.add(input, inputDesc);
+    }
     ALOGD("getInput() returns input %d", input);
 
     return input;
@@ -991,6 +1118,7 @@ audio_io_handle_t AudioPolicyManagerBase::getInput(int inputSource,
 
 status_t AudioPolicyManagerBase::startInput(audio_io_handle_t input)
 {
+    PolicyAutolock _l(this, LOCK_ALL);
     ALOGV("startInput() input %d", input);
     ssize_t index = mInputs.indexOfKey(input);
     if (index < 0) {
@@ -1047,6 +1175,7 @@ status_t AudioPolicyManagerBase::startInput(audio_io_handle_t input)
 
 status_t AudioPolicyManagerBase::stopInput(audio_io_handle_t input)
 {
+    PolicyAutolock _l(this, LOCK_ALL);
     ALOGV("stopInput() input %d", input);
     ssize_t index = mInputs.indexOfKey(input);
     if (index < 0) {
@@ -1075,6 +1204,7 @@ status_t AudioPolicyManagerBase::stopInput(audio_io_handle_t input)
 
 void AudioPolicyManagerBase::releaseInput(audio_io_handle_t input)
 {
+    PolicyAutolock _l(this, LOCK_INPUT);
     ALOGV("releaseInput() %d", input);
     ssize_t index = mInputs.indexOfKey(input);
     if (index < 0) {
@@ -1083,7 +1213,10 @@ void AudioPolicyManagerBase::releaseInput(audio_io_handle_t input)
     }
     mpClientInterface->closeInput(input);
     delete mInputs.valueAt(index);
-    mInputs.removeItem(input);
+    {
+        PolicyAutolock _el(this, LOCK_EFFECT);
+        mInputs.removeItem(input);
+    }
     ALOGV("releaseInput() exit");
 }
 
@@ -1091,6 +1224,7 @@ void AudioPolicyManagerBase::initStreamVolume(AudioSystem::stream_type stream,
                                             int indexMin,
                                             int indexMax)
 {
+    PolicyAutolock _l(this, LOCK_VOLUME);
     ALOGV("initStreamVolume() stream %d, min %d, max %d", stream , indexMin, indexMax);
     if (indexMin < 0 || indexMin >= indexMax) {
         ALOGW("initStreamVolume() invalid index limits for stream %d, min %d, max %d", stream , indexMin, indexMax);
@@ -1104,6 +1238,7 @@ status_t AudioPolicyManagerBase::setStreamVolumeIndex(AudioSystem::stream_type s
                                                       int index,
                                                       audio_devices_t device)
 {
+    PolicyAutolock _l(this, LOCK_ROUTE | LOCK_VOLUME);
 
     if ((index < mStreams[stream].mIndexMin) || (index > mStreams[stream].mIndexMax)) {
         return BAD_VALUE;
@@ -1121,9 +1256,9 @@ status_t AudioPolicyManagerBase::setStreamVolumeIndex(AudioSystem::stream_type s
     // if device is AUDIO_DEVICE_OUT_DEFAULT set default value and
     // clear all device specific values
     if (device == AUDIO_DEVICE_OUT_DEFAULT) {
-        mStreams[stream].mIndexCur.clear();
+        mStreams[stream].clearVolumeIndexes();
     }
-    mStreams[stream].mIndexCur.add(device, index);
+    mStreams[stream].setVolumeIndex(device, index);
 
     // compute and apply stream volume on all outputs according to connected device
     status_t status = NO_ERROR;
@@ -1140,6 +1275,7 @@ status_t AudioPolicyManagerBase::setStreamVolumeIndex(AudioSystem::stream_type s
             }
         }
     }
+    saveStateSnapshot();
     return status;
 }
 
@@ -1147,6 +1283,7 @@ status_t AudioPolicyManagerBase::getStreamVolumeIndex(AudioSystem::stream_type s
                                                       int *index,
                                                       audio_devices_t device)
 {
+    PolicyAutolock _l(this, LOCK_VOLUME);
     if (index == NULL) {
         return BAD_VALUE;
     }
@@ -1163,7 +1300,8 @@ status_t AudioPolicyManagerBase::getStreamVolumeIndex(AudioSystem::stream_type s
 
     *index =  mStreams[stream].getVolumeIndex(device);
 #else
-    *index =  mStreams[stream].mIndexCur.valueAt(0);
+    // first volume index by device order
+    *index =  mStreams[stream].mIndexCur[__builtin_ctz(mStreams[stream].mIndexValid)];
 #endif
     ALOGV("getStreamVolumeIndex() stream %d device %08x index %d", stream, device, *index);
     return NO_ERROR;
@@ -1172,8 +1310,10 @@ status_t AudioPolicyManagerBase::getStreamVolumeIndex(AudioSystem::stream_type s
 audio_io_handle_t AudioPolicyManagerBase::selectOutputForEffects(
                                             const SortedVector<audio_io_handle_t>& outputs)
 {
-    // select one output among several suitable for global effects.
-    // The priority is as follows:
+    // select one output among several suitable for global effects, where they cost the least.
+    // Outputs where media is currently playing are preferred because effects attached to
+    // other outputs would not process any audio. Among those, the output with the lowest
+    // estimated cost is selected (see getGlobalEffectsCost()). Ties are broken as follows:
     // 1: An offloaded output. If the effect ends up not being offloadable,
     //    AudioFlinger will invalidate the track and the offloaded output
     //    will be closed causing the effect to be moved to a PCM output.
@@ -1184,34 +1324,130 @@ audio_io_handle_t AudioPolicyManagerBase::selectOutputForEffects(
         return 0;
     }
 
-    audio_io_handle_t outputOffloaded = 0;
-    audio_io_handle_t outputDeepBuffer = 0;
+    audio_io_handle_t output = 0;
+    uint32_t outputCost = 0;
+    bool outputActive = false;
+    int outputRank = 0;
 
     for (size_t i = 0; i < outputs.size(); i++) {
         AudioOutputDescriptor *desc = mOutputs.valueFor(outputs[i]);
-        ALOGV("selectOutputForEffects outputs[%d] flags %x", i, desc->mFlags);
+        uint32_t cost = getGlobalEffectsCost(desc);
+        bool active = desc->isStrategyActive(STRATEGY_MEDIA);
+        int rank = 0;
         if ((desc->mFlags & AUDIO_OUTPUT_FLAG_COMPRESS_OFFLOAD) != 0) {
-            outputOffloaded = outputs[i];
+            rank = 2;
+        } else if ((desc->mFlags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) != 0) {
+            rank = 1;
+        }
+        ALOGV("selectOutputForEffects outputs[%d] flags %x cost %u active %d",
+              i, desc->mFlags, cost, active);
+        if (cost == EFFECTS_COST_UNSUPPORTED) {
+            continue;
         }
-        if ((desc->mFlags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) != 0) {
-            outputDeepBuffer = outputs[i];
+        if ((output == 0) ||
+                (active && !outputActive) ||
+                ((active == outputActive) &&
+                        ((cost < outputCost) || ((cost == outputCost) && (rank > outputRank))))) {
+            output = outputs[i];
+            outputCost = cost;
+            outputActive = active;
+            outputRank = rank;
         }
     }
 
-    ALOGV("selectOutputForEffects outputOffloaded %d outputDeepBuffer %d",
-          outputOffloaded, outputDeepBuffer);
-    if (outputOffloaded != 0) {
-        return outputOffloaded;
-    }
-    if (outputDeepBuffer != 0) {
-        return outputDeepBuffer;
+    ALOGV("selectOutputForEffects selected output %d cost %u", output, outputCost);
+    if (output != 0) {
+        return output;
     }
 
     return outputs[0];
 }
 
+uint32_t AudioPolicyManagerBase::getGlobalEffectsCost(AudioOutputDescriptor *outputDesc)
+{
+    uint32_t cpuLoad = 0;
+    uint32_t numEffects = 0;
+    bool offloadable = true;
+
+    PolicyAutolock _l(this, LOCK_EFFECT);
+    for (size_t i = 0; i < mEffects.size(); i++) {
+        const EffectDescriptor *desc = mEffects.valueAt(i);
+        if (desc->mSession != AUDIO_SESSION_OUTPUT_MIX || !desc->mEnabled) {
+            continue;
+        }
+        cpuLoad += desc->mDesc.cpuLoad;
+        numEffects++;
+        if ((desc->mDesc.flags & EFFECT_FLAG_OFFLOAD_SUPPORTED) == 0) {
+            offloadable = false;
+        }
+    }
+
+    // offloadable effects are processed by the audio DSP and do not load the CPU, but a non
+    // offloadable effect cannot run on an offloaded output.
+    if ((outputDesc->mFlags & AUDIO_OUTPUT_FLAG_COMPRESS_OFFLOAD) != 0) {
+        if (!offloadable) {
+            return EFFECTS_COST_UNSUPPORTED;
+        }
+        return 0;
+    }
+
+    // the mixer runs the effect chain once per mix period: the processing load does not
+    // depend on the period but each wake up adds a fixed overhead per effect. The output
+    // latency is used as an estimate of the mix period.
+    uint32_t periodMs = outputDesc->latency();
+    if (periodMs == 0) {
+        periodMs = 1;
+    }
+    return cpuLoad + (numEffects * EFFECT_WAKEUP_CPU_LOAD) / periodMs;
+}
+
+void AudioPolicyManagerBase::moveGlobalEffects(audio_io_handle_t dstOutput)
+{
+    if (dstOutput == 0) {
+        return;
+    }
+    // the effects are reattached with LOCK_EFFECT held and moved by the client once it is
+    // released. All effects attached to the same source output are moved by a single
+    // moveEffects() call
+    SortedVector<audio_io_handle_t> srcOutputs;
+    {
+        PolicyAutolock _l(this, LOCK_EFFECT);
+        for (size_t i = 0; i < mEffects.size(); i++) {
+            EffectDescriptor *desc = mEffects.valueAt(i);
+            if (desc->mSession == AUDIO_SESSION_OUTPUT_MIX &&
+                    desc->mIo != dstOutput) {
+                ALOGV("moveGlobalEffects() moving effect %d from output %d to output %d",
+                      mEffects.keyAt(i), desc->mIo, dstOutput);
+                srcOutputs.add(desc->mIo);
+                desc->mIo = dstOutput;
+            }
+        }
+    }
+    for (size_t i = 0; i < srcOutputs.size(); i++) {
+        mpClientInterface->moveEffects(AUDIO_SESSION_OUTPUT_MIX, srcOutputs[i], dstOutput);
+    }
+}
+
+void AudioPolicyManagerBase::checkOutputForEffects()
+{
+    bool globalEffects = false;
+    {
+        PolicyAutolock _l(this, LOCK_EFFECT);
+        for (size_t i = 0; i < mEffects.size(); i++) {
+            if (mEffects.valueAt(i)->mSession == AUDIO_SESSION_OUTPUT_MIX) {
+                globalEffects = true;
+                break;
+            }
+        }
+    }
+    if (globalEffects) {
+        moveGlobalEffects(getOutputForEffect());
+    }
+}
+
 audio_io_handle_t AudioPolicyManagerBase::getOutputForEffect(const effect_descriptor_t *desc)
 {
+    PolicyAutolock _l(this, LOCK_ROUTE);
     // apply simple rule where global effects are attached to the same output as MUSIC streams
 
     routing_strategy strategy = getStrategy(AudioSystem::MUSIC);
@@ -1231,13 +1467,12 @@ status_t AudioPolicyManagerBase::registerEffect(const effect_descriptor_t *desc,
                                 int session,
                                 int id)
 {
-    ssize_t index = mOutputs.indexOfKey(io);
-    if (index < 0) {
-        index = mInputs.indexOfKey(io);
-        if (index < 0) {
-            ALOGW("registerEffect() unknown io %d", io);
-            return INVALID_OPERATION;
-        }
+    // mOutputs and mInputs are only modified with LOCK_EFFECT held: the io cannot be closed
+    // between the check and the registration
+    PolicyAutolock _l(this, LOCK_EFFECT);
+    if ((mOutputs.indexOfKey(io) < 0) && (mInputs.indexOfKey(io) < 0)) {
+        ALOGW("registerEffect() unknown io %d", io);
+        return INVALID_OPERATION;
     }
 
     if (mTotalEffectsMemory + desc->memoryUsage > getMaxEffectsMemory()) {
@@ -1264,6 +1499,7 @@ status_t AudioPolicyManagerBase::registerEffect(const effect_descriptor_t *desc,
 
 status_t AudioPolicyManagerBase::unregisterEffect(int id)
 {
+    PolicyAutolock _l(this, LOCK_EFFECT);
     ssize_t index = mEffects.indexOfKey(id);
     if (index < 0) {
         ALOGW("unregisterEffect() unknown effect ID %d", id);
@@ -1291,6 +1527,7 @@ status_t AudioPolicyManagerBase::unregisterEffect(int id)
 
 status_t AudioPolicyManagerBase::setEffectEnabled(int id, bool enabled)
 {
+    PolicyAutolock _l(this, LOCK_EFFECT);
     ssize_t index = mEffects.indexOfKey(id);
     if (index < 0) {
         ALOGW("unregisterEffect() unknown effect ID %d", id);
@@ -1329,8 +1566,55 @@ status_t AudioPolicyManagerBase::setEffectEnabled(EffectDescriptor *pDesc, bool
     return NO_ERROR;
 }
 
+audio_io_handle_t AudioPolicyManagerBase::getDeepBufferOutput(audio_devices_t device)
+{
+    SortedVector<audio_io_handle_t> outputs = getOutputsForDevice(device, mOutputs);
+    for (size_t i = 0; i < outputs.size(); i++) {
+        AudioOutputDescriptor *desc = mOutputs.valueFor(outputs[i]);
+        if (!desc->isDuplicated() && (desc->mProfile->mFlags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER)) {
+            return outputs[i];
+        }
+    }
+    return 0;
+}
+
+void AudioPolicyManagerBase::checkOutputForMediaIdle()
+{
+    audio_io_handle_t deepOutput =
+            getDeepBufferOutput(getDeviceForStrategy(STRATEGY_MEDIA, true /*fromCache*/));
+    if (deepOutput == 0) {
+        ALOGV("checkOutputForMediaIdle() no deep buffer output for media device");
+        return;
+    }
+
+    // Music tracks need to be invalidated when they play on a mixer output other than the
+    // deep buffer output while idle, or on the deep buffer output when leaving the idle mode.
+    // Direct and offloaded outputs are never moved. Tracks requesting a fast path are
+    // invalidated too but getOutput() selects the same output for them again.
+    bool moveMusic = false;
+    for (size_t i = 0; i < mOutputs.size(); i++) {
+        AudioOutputDescriptor *desc = mOutputs.valueAt(i);
+        if (desc->isDuplicated() || (desc->mFlags & AUDIO_OUTPUT_FLAG_DIRECT) ||
+                (desc->mRefCount[AudioSystem::MUSIC] == 0)) {
+            continue;
+        }
+        if ((mOutputs.keyAt(i) == deepOutput) != mMediaIdle) {
+            moveMusic = true;
+            break;
+        }
+    }
+    if (moveMusic) {
+        ALOGV("checkOutputForMediaIdle() moving music %s deep buffer output %d",
+              mMediaIdle ? "to" : "from", deepOutput);
+        // the output parameter is ignored by the client: tracks are invalidated and
+        // getOutput() is called again when they are restarted
+        mpClientInterface->setStreamOutput(AudioSystem::MUSIC, deepOutput);
+    }
+}
+
 bool AudioPolicyManagerBase::isNonOffloadableEffectEnabled()
 {
+    PolicyAutolock _l(this, LOCK_EFFECT);
     for (size_t i = 0; i < mEffects.size(); i++) {
         const EffectDescriptor * const pDesc = mEffects.valueAt(i);
         if (pDesc->mEnabled && (pDesc->mStrategy == STRATEGY_MEDIA) &&
@@ -1345,7 +1629,8 @@ bool AudioPolicyManagerBase::isNonOffloadableEffectEnabled()
 
 bool AudioPolicyManagerBase::isStreamActive(int stream, uint32_t inPastMs) const
 {
-    nsecs_t sysTime = systemTime();
+    PolicyAutolock _l(this, LOCK_ROUTE);
+    nsecs_t sysTime = mClock->now();
     for (size_t i = 0; i < mOutputs.size(); i++) {
         const AudioOutputDescriptor *outputDesc = mOutputs.valueAt(i);
         if (outputDesc->isStreamActive((AudioSystem::stream_type)stream, inPastMs, sysTime)) {
@@ -1357,7 +1642,8 @@ bool AudioPolicyManagerBase::isStreamActive(int stream, uint32_t inPastMs) const
 
 bool AudioPolicyManagerBase::isStreamActiveRemotely(int stream, uint32_t inPastMs) const
 {
-    nsecs_t sysTime = systemTime();
+    PolicyAutolock _l(this, LOCK_ROUTE);
+    nsecs_t sysTime = mClock->now();
     for (size_t i = 0; i < mOutputs.size(); i++) {
         const AudioOutputDescriptor *outputDesc = mOutputs.valueAt(i);
         if (((outputDesc->device() & APM_AUDIO_OUT_DEVICE_REMOTE_ALL) != 0) &&
@@ -1370,6 +1656,7 @@ bool AudioPolicyManagerBase::isStreamActiveRemotely(int stream, uint32_t inPastM
 
 bool AudioPolicyManagerBase::isSourceActive(audio_source_t source) const
 {
+    PolicyAutolock _l(this, LOCK_INPUT);
     for (size_t i = 0; i < mInputs.size(); i++) {
         const AudioInputDescriptor * inputDescriptor = mInputs.valueAt(i);
         if ((inputDescriptor->mInputSource == (int)source ||
@@ -1385,6 +1672,20 @@ bool AudioPolicyManagerBase::isSourceActive(audio_source_t source) const
 
 status_t AudioPolicyManagerBase::dump(int fd)
 {
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get(POLICY_DUMP_FORMAT_PROPERTY, value, "text");
+    return dumpFormatted(fd, (strcmp(value, "jsonl") == 0) ? DUMP_FORMAT_JSON_LINES :
+                                                              DUMP_FORMAT_TEXT);
+}
+
+status_t AudioPolicyManagerBase::dumpFormatted(int fd, policy_dump_format format)
+{
+    PolicyAutolock _l(this, LOCK_ALL | LOCK_EFFECT);
+    if (format == DUMP_FORMAT_JSON_LINES) {
+        return dumpJsonLines(fd);
+    }
+
     const size_t SIZE = 256;
     char buffer[SIZE];
     String8 result;
@@ -1416,6 +1717,8 @@ status_t AudioPolicyManagerBase::dump(int fd)
     result.append(buffer);
     snprintf(buffer, SIZE, " Force use for system %d\n", mForceUse[AudioSystem::FOR_SYSTEM]);
     result.append(buffer);
+    snprintf(buffer, SIZE, " Media idle mode: %d\n", mMediaIdle);
+    result.append(buffer);
     write(fd, result.string(), result.size());
 
 
@@ -1443,6 +1746,12 @@ status_t AudioPolicyManagerBase::dump(int fd)
         mInputs.valueAt(i)->dump(fd);
     }
 
+    snprintf(buffer, SIZE, "\nUSB capabilities dump:\n");
+    write(fd, buffer, strlen(buffer));
+    for (size_t i = 0; i < mUsbCapabilities.size(); i++) {
+        mUsbCapabilities.valueAt(i).dump(fd, mUsbCapabilities.keyAt(i).string());
+    }
+
     snprintf(buffer, SIZE, "\nStreams dump:\n");
     write(fd, buffer, strlen(buffer));
     snprintf(buffer, SIZE,
@@ -1466,15 +1775,76 @@ status_t AudioPolicyManagerBase::dump(int fd)
         mEffects.valueAt(i)->dump(fd);
     }
 
+    static const char * const routingEventNames[NUM_ROUTING_EVENT_TYPES] = {
+        "device connection",
+        "phone state",
+        "force use",
+    };
+    snprintf(buffer, SIZE, "\nRouting command latency (ms, event to command issued + delay):\n");
+    write(fd, buffer, strlen(buffer));
+    snprintf(buffer, SIZE, " Event              Count     p50     p99     Max\n");
+    write(fd, buffer, strlen(buffer));
+    for (size_t i = 0; i < NUM_ROUTING_EVENT_TYPES; i++) {
+        mRoutingLatency[i].dump(fd, routingEventNames[i]);
+    }
 
     return NO_ERROR;
 }
 
+status_t AudioPolicyManagerBase::dumpJsonLines(int fd)
+{
+    PolicyDumpBuffer out;
+
+    out.appendf("{\"type\":\"policy\",\"primary_output\":%d,\"a2dp_address\":", mPrimaryOutput);
+    out.appendString(mA2dpDeviceAddress.string());
+    out.appendf(",\"sco_address\":");
+    out.appendString(mScoDeviceAddress.string());
+    out.appendf(",\"usb_card_and_device\":");
+    out.appendString(mUsbCardAndDevice.string());
+    out.appendf(",\"output_devices\":%u,\"input_devices\":%u,\"phone_state\":%d,\"force_use\":[",
+                mAvailableOutputDevices, mAvailableInputDevices, mPhoneState);
+    for (int i = 0; i < AudioSystem::NUM_FORCE_USE; i++) {
+        out.appendf("%s%d", (i == 0) ? "" : ",", mForceUse[i]);
+    }
+    out.appendf("],\"media_idle\":%s,\"effects_cpu_load\":%u,\"effects_memory\":%u}\n",
+                mMediaIdle ? "true" : "false", mTotalEffectsCpuLoad, mTotalEffectsMemory);
+
+    for (size_t i = 0; i < mHwModules.size(); i++) {
+        mHwModules[i]->dumpJson(out);
+    }
+    for (size_t i = 0; i < mOutputs.size(); i++) {
+        mOutputs.valueAt(i)->dumpJson(out, mOutputs.keyAt(i));
+    }
+    for (size_t i = 0; i < mInputs.size(); i++) {
+        mInputs.valueAt(i)->dumpJson(out, mInputs.keyAt(i));
+    }
+    for (size_t i = 0; i < mUsbCapabilities.size(); i++) {
+        mUsbCapabilities.valueAt(i).dumpJson(out, mUsbCapabilities.keyAt(i).string());
+    }
+    for (int i = 0; i < AudioSystem::NUM_STREAM_TYPES; i++) {
+        mStreams[i].dumpJson(out, i);
+    }
+    for (size_t i = 0; i < mEffects.size(); i++) {
+        mEffects.valueAt(i)->dumpJson(out, mEffects.keyAt(i));
+    }
+    static const char * const routingEventNames[NUM_ROUTING_EVENT_TYPES] = {
+        "device_connection",
+        "phone_state",
+        "force_use",
+    };
+    for (size_t i = 0; i < NUM_ROUTING_EVENT_TYPES; i++) {
+        mRoutingLatency[i].dumpJson(out, routingEventNames[i]);
+    }
+
+    return out.flush(fd);
+}
+
 // This function checks for the parameters which can be offloaded.
 // This can be enhanced depending on the capability of the DSP and policy
 // of the system.
 bool AudioPolicyManagerBase::isOffloadSupported(const audio_offload_info_t& offloadInfo)
 {
+    PolicyAutolock _l(this, LOCK_ROUTE);
     ALOGV("isOffloadSupported: SR=%u, CM=0x%x, Format=0x%x, StreamType=%d,"
      " BitRate=%u, duration=%lld us, has_video=%d",
      offloadInfo.sample_rate, offloadInfo.channel_mask,
@@ -1555,6 +1925,39 @@ bool AudioPolicyManagerBase::isOffloadSupported(const audio_offload_info_t& offl
     return (profile != NULL);
 }
 
+void AudioPolicyManagerBase::setClock(AudioPolicyClock *clock)
+{
+    mClock = (clock != NULL) ? clock : &mSystemClock;
+}
+
+void AudioPolicyManagerBase::setMediaIdleMode(bool idle)
+{
+    PolicyAutolock _l(this, LOCK_ROUTE);
+    ALOGV("setMediaIdleMode() idle %d current %d", idle, mMediaIdle);
+    if (idle == mMediaIdle) {
+        return;
+    }
+    mMediaIdle = idle;
+    checkOutputForMediaIdle();
+}
+
+void AudioPolicyManagerBase::updateMediaIdleMode()
+{
+    char value[PROPERTY_VALUE_MAX];
+    property_get(MEDIA_IDLE_MODE_PROPERTY, value, "0");
+    setMediaIdleMode(stringToBool(value));
+}
+
+nsecs_t AudioPolicyManagerBase::checkMediaIdleMode()
+{
+    PolicyAutolock _l(this, LOCK_ROUTE);
+    updateMediaIdleMode();
+    if (!isStreamActive(AudioSystem::MUSIC)) {
+        return -1;
+    }
+    return milliseconds(MEDIA_IDLE_MODE_POLL_MS);
+}
+
 // ----------------------------------------------------------------------------
 // AudioPolicyManagerBase
 // ----------------------------------------------------------------------------
@@ -1569,11 +1972,31 @@ AudioPolicyManagerBase::AudioPolicyManagerBase(AudioPolicyClientInterface *clien
     mPhoneState(AudioSystem::MODE_NORMAL),
     mLimitRingtoneVolume(false), mLastVoiceVolume(-1.0f),
     mTotalEffectsCpuLoad(0), mTotalEffectsMemory(0),
-    mA2dpSuspended(false), mHasA2dp(false), mHasUsb(false), mHasRemoteSubmix(false),
-    mSpeakerDrcEnabled(false)
+    mA2dpSuspended(false),
+    mA2dpOutput(0), mA2dpOutputValid(false), mA2dpSuspendCheckNeeded(true),
+    mHasA2dp(false), mHasUsb(false), mHasRemoteSubmix(false),
+    mSpeakerDrcEnabled(false), mMediaIdle(false), mClock(&mSystemClock),
+    mNextRoutingEventId(1), mRoutingEventId(0), mRoutingEventType(ROUTING_EVENT_DEVICE_CONNECTION),
+    mRoutingEventStartTime(0), mRoutingEventLatencyMs(-1),
+    mConnectionTransactionDepth(0), mConnectionTransactionStartTime(0),
+    mTransactionOutputsChanged(false),
+    mTransactionInputsChanged(false),
+    mRecomputing(false)
 {
     mpClientInterface = clientInterface;
 
+    char value[PROPERTY_VALUE_MAX];
+    if ((property_get(PARALLEL_OUTPUT_COMMANDS_PROPERTY, value, "0") > 0) && (atoi(value) != 0)) {
+        for (int i = 0; i < MAX_PARALLEL_OUTPUT_COMMANDS; i++) {
+            android::sp<OutputCommandThread> thread = new OutputCommandThread(this);
+            if (thread->run("AudioPolicyOutputCommand", ANDROID_PRIORITY_AUDIO) != NO_ERROR) {
+                ALOGW("cannot start output command thread %d", i);
+                break;
+            }
+            mOutputCommandThreads.add(thread);
+        }
+    }
+
     for (int i = 0; i < AudioSystem::NUM_FORCE_USE; i++) {
         mForceUse[i] = AudioSystem::FORCE_NONE;
     }
@@ -1646,6 +2069,37 @@ AudioPolicyManagerBase::AudioPolicyManagerBase(AudioPolicyClientInterface *clien
 
     updateDevicesAndOutputs();
 
+    if (mPrimaryOutput != 0) {
+        restoreStateSnapshot();
+        if (!mBootId.isEmpty()) {
+            mStateSnapshotThread = new StateSnapshotThread();
+            mStateSnapshotThread->run("AudioPolicyStateSnapshot", ANDROID_PRIORITY_BACKGROUND);
+        }
+    }
+
+    startIdleStandbyIfNeeded();
+
+    if (!mConfigFile.isEmpty() &&
+            (property_get(WATCH_CONFIG_PROPERTY, value, "0") > 0) && (atoi(value) != 0)) {
+        mConfigWatcherThread = new ConfigWatcherThread(this);
+        if ((mConfigWatcherThread->watch(mConfigFile.string()) != NO_ERROR) ||
+                (mConfigWatcherThread->run("AudioPolicyConfigWatcher",
+                                           ANDROID_PRIORITY_BACKGROUND) != NO_ERROR)) {
+            ALOGW("cannot watch %s", mConfigFile.string());
+            mConfigWatcherThread.clear();
+        }
+    }
+
+    // the media idle mode moves music to a deep buffer output
+    for (size_t i = 0; i < mOutputs.size(); i++) {
+        if (mOutputs.valueAt(i)->mFlags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) {
+            mMediaIdleThread = new PolicyTimerThread(this,
+                    &AudioPolicyManagerBase::checkMediaIdleMode);
+            mMediaIdleThread->run("AudioPolicyMediaIdle", ANDROID_PRIORITY_BACKGROUND);
+            break;
+        }
+    }
+
 #ifdef AUDIO_POLICY_TEST
     if (mPrimaryOutput != 0) {
         AudioParameter outputCmd = AudioParameter();
@@ -1676,6 +2130,30 @@ AudioPolicyManagerBase::~AudioPolicyManagerBase()
 #ifdef AUDIO_POLICY_TEST
     exit();
 #endif //AUDIO_POLICY_TEST
+    if (mConfigWatcherThread != 0) {
+        mConfigWatcherThread->exit();
+        mConfigWatcherThread.clear();
+    }
+    if (mIdleStandbyThread != 0) {
+        mIdleStandbyThread->exit();
+        mIdleStandbyThread.clear();
+    }
+    if (mMediaIdleThread != 0) {
+        mMediaIdleThread->exit();
+        mMediaIdleThread.clear();
+    }
+    if (mConnectionTransactionThread != 0) {
+        mConnectionTransactionThread->exit();
+        mConnectionTransactionThread.clear();
+    }
+    if (mStateSnapshotThread != 0) {
+        mStateSnapshotThread->exit();
+        mStateSnapshotThread.clear();
+    }
+    for (size_t i = 0; i < mOutputCommandThreads.size(); i++) {
+        mOutputCommandThreads[i]->exit();
+    }
+    mOutputCommandThreads.clear();
    for (size_t i = 0; i < mOutputs.size(); i++) {
         mpClientInterface->closeOutput(mOutputs.keyAt(i));
         delete mOutputs.valueAt(i);
@@ -1691,6 +2169,7 @@ AudioPolicyManagerBase::~AudioPolicyManagerBase()
 
 status_t AudioPolicyManagerBase::initCheck()
 {
+    PolicyAutolock _l(this, LOCK_ROUTE);
     return (mPrimaryOutput == 0) ? NO_INIT : NO_ERROR;
 }
 
@@ -1706,6 +2185,7 @@ bool AudioPolicyManagerBase::threadLoop()
 
         Mutex::Autolock _l(mLock);
         mWaitWorkCV.waitRelative(mLock, milliseconds(50));
+        PolicyAutolock _pl(this, LOCK_ALL);
 
         command = mpClientInterface->getParameters(0, String8("test_cmd_policy"));
         AudioParameter param = AudioParameter(command);
@@ -1796,7 +2276,8 @@ bool AudioPolicyManagerBase::threadLoop()
                 audio_module_handle_t moduleHandle = outputDesc->mModule->mHandle;
 
                 delete mOutputs.valueFor(mPrimaryOutput);
-                mOutputs.removeItem(mPrimaryOutput);
+                removeOutput(mPrimaryOutput);
+                invalidateA2dpOutput();
 
                 AudioOutputDescriptor *outputDesc = new AudioOutputDescriptor(NULL);
                 outputDesc->mDevice = AUDIO_DEVICE_OUT_SPEAKER;
@@ -1849,13 +2330,24 @@ int AudioPolicyManagerBase::testOutputIndex(audio_io_handle_t output)
 void AudioPolicyManagerBase::addOutput(audio_io_handle_t id, AudioOutputDescriptor *outputDesc)
 {
     outputDesc->mId = id;
-    mOutputs.add(id, outputDesc);
+    {
+        PolicyAutolock _l(this, LOCK_EFFECT);
+        mOutputs.add(id, outputDesc);
+    }
+    invalidateA2dpOutput();
+}
+
+void AudioPolicyManagerBase::removeOutput(audio_io_handle_t id)
+{
+    PolicyAutolock _l(this, LOCK_EFFECT);
+    mOutputs.removeItem(id);
 }
 
 
 status_t AudioPolicyManagerBase::checkOutputsForDevice(audio_devices_t device,
                                                        AudioSystem::device_connection_state state,
-                                                       SortedVector<audio_io_handle_t>& outputs)
+                                                       SortedVector<audio_io_handle_t>& outputs,
+                                                       const char *address)
 {
     AudioOutputDescriptor *desc;
 
@@ -1891,7 +2383,9 @@ status_t AudioPolicyManagerBase::checkOutputsForDevice(audio_devices_t device,
 
         // open outputs for matching profiles if needed. Direct outputs are also opened to
         // query for dynamic parameters and will be closed later by setDeviceConnectionState()
-        for (ssize_t profile_index = 0; profile_index < (ssize_t)profiles.size(); profile_index++) {
+        Vector<OutputCommand> commands;
+        Vector<IOProfile *> commandProfiles;
+        for (size_t profile_index = 0; profile_index < profiles.size(); profile_index++) {
             IOProfile *profile = profiles[profile_index];
 
             // nothing to do if one output is already opened for this profile
@@ -1906,27 +2400,41 @@ status_t AudioPolicyManagerBase::checkOutputsForDevice(audio_devices_t device,
                 continue;
             }
 
+            // direct outputs are only opened here to read their dynamic parameters: no need to
+            // open them if this USB device was already connected
+            bool usbDirect = mHasUsb && audio_is_usb_device(device) &&
+                    (profile->mFlags & AUDIO_OUTPUT_FLAG_DIRECT);
+            if (usbDirect && loadUsbCapabilities(address, profile)) {
+                ALOGV("checkOutputsForDevice(): known USB device %s, not opening output", address);
+                continue;
+            }
+
             ALOGV("opening output for device %08x", device);
             desc = new AudioOutputDescriptor(profile);
             desc->mDevice = device;
-            audio_offload_info_t offloadInfo = AUDIO_INFO_INITIALIZER;
-            offloadInfo.sample_rate = desc->mSamplingRate;
-            offloadInfo.format = desc->mFormat;
-            offloadInfo.channel_mask = desc->mChannelMask;
-
-            audio_io_handle_t output = mpClientInterface->openOutput(profile->mModule->mHandle,
-                                                                       &desc->mDevice,
-                                                                       &desc->mSamplingRate,
-                                                                       &desc->mFormat,
-                                                                       &desc->mChannelMask,
-                                                                       &desc->mLatency,
-                                                                       desc->mFlags,
-                                                                       &offloadInfo);
+            OutputCommand command;
+            command.mType = OutputCommand::OPEN_OUTPUT;
+            command.mDesc = desc;
+            command.mOffloadInfo.sample_rate = desc->mSamplingRate;
+            command.mOffloadInfo.format = desc->mFormat;
+            command.mOffloadInfo.channel_mask = desc->mChannelMask;
+            commands.add(command);
+            commandProfiles.add(profile);
+        }
+        runOutputCommands(commands);
+
+        // outputs opened are then configured one at a time
+        for (size_t i = 0; i < commands.size(); i++) {
+            desc = commands[i].mDesc;
+            IOProfile *profile = commandProfiles[i];
+            audio_io_handle_t output = commands[i].mOutput;
+            bool usbDirect = mHasUsb && audio_is_usb_device(device) &&
+                    (profile->mFlags & AUDIO_OUTPUT_FLAG_DIRECT);
             if (output != 0) {
                 if (desc->mFlags & AUDIO_OUTPUT_FLAG_DIRECT) {
                     String8 reply;
                     char *value;
-                    if (profile->mSamplingRates[0] == 0) {
+                    if ((profile->mSamplingRates[0] == 0) && (profile->mSamplingRates.size() < 2)) {
                         reply = mpClientInterface->getParameters(output,
                                                 String8(AUDIO_PARAMETER_STREAM_SUP_SAMPLING_RATES));
                         ALOGV("checkOutputsForDevice() direct output sup sampling rates %s",
@@ -1936,7 +2444,7 @@ status_t AudioPolicyManagerBase::checkOutputsForDevice(audio_devices_t device,
                             loadSamplingRates(value + 1, profile);
                         }
                     }
-                    if (profile->mFormats[0] == 0) {
+                    if ((profile->mFormats[0] == 0) && (profile->mFormats.size() < 2)) {
                         reply = mpClientInterface->getParameters(output,
                                                        String8(AUDIO_PARAMETER_STREAM_SUP_FORMATS));
                         ALOGV("checkOutputsForDevice() direct output sup formats %s",
@@ -1946,7 +2454,7 @@ status_t AudioPolicyManagerBase::checkOutputsForDevice(audio_devices_t device,
                             loadFormats(value + 1, profile);
                         }
                     }
-                    if (profile->mChannelMasks[0] == 0) {
+                    if ((profile->mChannelMasks[0] == 0) && (profile->mChannelMasks.size() < 2)) {
                         reply = mpClientInterface->getParameters(output,
                                                       String8(AUDIO_PARAMETER_STREAM_SUP_CHANNELS));
                         ALOGV("checkOutputsForDevice() direct output sup channel masks %s",
@@ -1967,6 +2475,9 @@ status_t AudioPolicyManagerBase::checkOutputsForDevice(audio_devices_t device,
                         output = 0;
                     } else {
                         addOutput(output, desc);
+                        if (usbDirect) {
+                            storeUsbCapabilities(address, profile, desc->mLatency);
+                        }
                     }
                 } else {
                     audio_io_handle_t duplicatedOutput = 0;
@@ -1995,7 +2506,8 @@ status_t AudioPolicyManagerBase::checkOutputsForDevice(audio_devices_t device,
                         ALOGW("checkOutputsForDevice() could not open dup output for %d and %d",
                                 mPrimaryOutput, output);
                         mpClientInterface->closeOutput(output);
-                        mOutputs.removeItem(output);
+                        removeOutput(output);
+                        invalidateA2dpOutput();
                         output = 0;
                     }
                 }
@@ -2003,8 +2515,7 @@ status_t AudioPolicyManagerBase::checkOutputsForDevice(audio_devices_t device,
             if (output == 0) {
                 ALOGW("checkOutputsForDevice() could not open output for device %x", device);
                 delete desc;
-                profiles.removeAt(profile_index);
-                profile_index--;
+                profiles.remove(profile);
             } else {
                 outputs.add(output);
                 ALOGV("checkOutputsForDevice(): adding output %d", output);
@@ -2056,57 +2567,249 @@ status_t AudioPolicyManagerBase::checkOutputsForDevice(audio_devices_t device,
     return NO_ERROR;
 }
 
-void AudioPolicyManagerBase::closeOutput(audio_io_handle_t output)
+void AudioPolicyManagerBase::applyOutputDeviceConnection(
+                                                const SortedVector<audio_io_handle_t>& outputs)
 {
-    ALOGD("closeOutput(%d)", output);
-
-    AudioOutputDescriptor *outputDesc = mOutputs.valueFor(output);
-    if (outputDesc == NULL) {
-        ALOGW("closeOutput() unknown output %d", output);
-        return;
+    checkA2dpSuspend();
+    checkOutputForAllStrategies();
+    // outputs must be closed after checkOutputForAllStrategies() is executed
+    SortedVector<audio_io_handle_t> closedOutputs;
+    for (size_t i = 0; i < outputs.size(); i++) {
+        AudioOutputDescriptor *desc = mOutputs.valueFor(outputs[i]);
+        // the output may already have been closed by a previous change in the same transaction
+        if (desc == NULL) {
+            continue;
+        }
+        // close unused outputs after device disconnection or direct outputs that have been
+        // opened by checkOutputsForDevice() to query dynamic parameters
+        if (!(desc->mProfile->mSupportedDevices & mAvailableOutputDevices) ||
+                (((desc->mFlags & AUDIO_OUTPUT_FLAG_DIRECT) != 0) &&
+                 (desc->mDirectOpenCount == 0))) {
+            closedOutputs.add(outputs[i]);
+        }
     }
+    closeOutputs(closedOutputs);
 
-    // look for duplicated outputs connected to the output being removed.
+    updateDevicesAndOutputs();
     for (size_t i = 0; i < mOutputs.size(); i++) {
-        AudioOutputDescriptor *dupOutputDesc = mOutputs.valueAt(i);
-        if (dupOutputDesc->isDuplicated() &&
-                (dupOutputDesc->mOutput1 == outputDesc ||
-                dupOutputDesc->mOutput2 == outputDesc)) {
-            AudioOutputDescriptor *outputDesc2;
-            if (dupOutputDesc->mOutput1 == outputDesc) {
-                outputDesc2 = dupOutputDesc->mOutput2;
-            } else {
-                outputDesc2 = dupOutputDesc->mOutput1;
-            }
-            // As all active tracks on duplicated output will be deleted,
-            // and as they were also referenced on the other output, the reference
-            // count for their stream type must be adjusted accordingly on
-            // the other output.
-            for (int j = 0; j < (int)AudioSystem::NUM_STREAM_TYPES; j++) {
-                int refCount = dupOutputDesc->mRefCount[j];
-                outputDesc2->changeRefCount((AudioSystem::stream_type)j,-refCount);
-            }
-            audio_io_handle_t duplicatedOutput = mOutputs.keyAt(i);
-            ALOGV("closeOutput() closing also duplicated output %d", duplicatedOutput);
+        // do not force device change on duplicated output because if device is 0, it will
+        // also force a device 0 for the two outputs it is duplicated to which may override
+        // a valid device selection on those outputs.
+        setOutputDevice(mOutputs.keyAt(i),
+                        getNewDevice(mOutputs.keyAt(i), true /*fromCache*/),
+                        !mOutputs.valueAt(i)->isDuplicated(),
+                        0);
+    }
+}
 
-            mpClientInterface->closeOutput(duplicatedOutput);
-            delete mOutputs.valueFor(duplicatedOutput);
-            mOutputs.removeItem(duplicatedOutput);
+void AudioPolicyManagerBase::applyInputDeviceConnection()
+{
+    audio_io_handle_t activeInput = getActiveInput();
+    if (activeInput != 0) {
+        AudioInputDescriptor *inputDesc = mInputs.valueFor(activeInput);
+        audio_devices_t newDevice = getDeviceForInputSource(inputDesc->mInputSource);
+        if ((newDevice != AUDIO_DEVICE_NONE) && (newDevice != inputDesc->mDevice)) {
+            ALOGV("applyInputDeviceConnection() changing device from %x to %x for input %d",
+                    inputDesc->mDevice, newDevice, activeInput);
+            inputDesc->mDevice = newDevice;
+            AudioParameter param = AudioParameter();
+            param.addInt(String8(AudioParameter::keyRouting), (int)newDevice);
+            mpClientInterface->setParameters(activeInput, param.toString());
         }
     }
-
-    AudioParameter param;
-    param.add(String8("closing"), String8("true"));
-    mpClientInterface->setParameters(output, param.toString());
-
-    mpClientInterface->closeOutput(output);
-    delete outputDesc;
-    mOutputs.removeItem(output);
-    mPreviousOutputs = mOutputs;
 }
 
-SortedVector<audio_io_handle_t> AudioPolicyManagerBase::getOutputsForDevice(audio_devices_t device,
-                        DefaultKeyedVector<audio_io_handle_t, AudioOutputDescriptor *> openOutputs)
+nsecs_t AudioPolicyManagerBase::checkIdleOutputs()
+{
+    PolicyAutolock _l(this, LOCK_ROUTE);
+    nsecs_t sysTime = mClock->now();
+    nsecs_t nextCheck = -1;
+
+    for (size_t i = 0; i < mOutputs.size(); i++) {
+        AudioOutputDescriptor *desc = mOutputs.valueAt(i);
+        if (desc->isDuplicated() || desc->mIdleSuspended ||
+                (desc->mProfile->mIdleStandbyMs == 0) ||
+                ((desc->mFlags &
+                    (AUDIO_OUTPUT_FLAG_DIRECT | AUDIO_OUTPUT_FLAG_COMPRESS_OFFLOAD)) == 0) ||
+                desc->isActive()) {
+            continue;
+        }
+        nsecs_t stopTime = 0;
+        for (int j = 0; j < AudioSystem::NUM_STREAM_TYPES; j++) {
+            if (desc->mStopTime[j] > stopTime) {
+                stopTime = desc->mStopTime[j];
+            }
+        }
+        // outputs that never played are left to AudioFlinger standby
+        if (stopTime == 0) {
+            continue;
+        }
+        nsecs_t remaining = milliseconds(desc->mProfile->mIdleStandbyMs) - (sysTime - stopTime);
+        if (remaining <= 0) {
+            ALOGV("checkIdleOutputs() suspending output %d idle for %d ms",
+                  mOutputs.keyAt(i), (int)ns2ms(sysTime - stopTime));
+            mpClientInterface->suspendOutput(mOutputs.keyAt(i));
+            desc->mIdleSuspended = true;
+        } else if ((nextCheck < 0) || (remaining < nextCheck)) {
+            nextCheck = remaining;
+        }
+    }
+    return nextCheck;
+}
+
+void AudioPolicyManagerBase::startIdleStandbyIfNeeded()
+{
+    for (size_t i = 0; i < mHwModules.size() && mIdleStandbyThread == 0; i++) {
+        for (size_t j = 0; j < mHwModules[i]->mOutputProfiles.size(); j++) {
+            if (mHwModules[i]->mOutputProfiles[j]->mIdleStandbyMs != 0) {
+                mIdleStandbyThread = new PolicyTimerThread(this,
+                        &AudioPolicyManagerBase::checkIdleOutputs);
+                mIdleStandbyThread->run("AudioPolicyIdleStandby", ANDROID_PRIORITY_BACKGROUND);
+                break;
+            }
+        }
+    }
+}
+
+void AudioPolicyManagerBase::restoreIdleOutput(audio_io_handle_t output,
+                                               AudioOutputDescriptor *outputDesc)
+{
+    ALOGV("restoreIdleOutput() output %d", output);
+    mpClientInterface->restoreOutput(output);
+    outputDesc->mIdleSuspended = false;
+}
+
+void AudioPolicyManagerBase::closeOutput(audio_io_handle_t output)
+{
+    SortedVector<audio_io_handle_t> outputs;
+    outputs.add(output);
+    closeOutputs(outputs);
+}
+
+void AudioPolicyManagerBase::closeOutputs(const SortedVector<audio_io_handle_t>& outputs)
+{
+    Vector<OutputCommand> duplicatedCommands;
+    Vector<OutputCommand> commands;
+
+    for (size_t k = 0; k < outputs.size(); k++) {
+        audio_io_handle_t output = outputs[k];
+        ALOGD("closeOutput(%d)", output);
+
+        AudioOutputDescriptor *outputDesc = mOutputs.valueFor(output);
+        if (outputDesc == NULL) {
+            ALOGW("closeOutput() unknown output %d", output);
+            continue;
+        }
+
+        // look for duplicated outputs connected to the output being removed.
+        for (size_t i = 0; i < mOutputs.size(); i++) {
+            AudioOutputDescriptor *dupOutputDesc = mOutputs.valueAt(i);
+            if (dupOutputDesc->isDuplicated() &&
+                    (dupOutputDesc->mOutput1 == outputDesc ||
+                    dupOutputDesc->mOutput2 == outputDesc)) {
+                AudioOutputDescriptor *outputDesc2;
+                if (dupOutputDesc->mOutput1 == outputDesc) {
+                    outputDesc2 = dupOutputDesc->mOutput2;
+                } else {
+                    outputDesc2 = dupOutputDesc->mOutput1;
+                }
+                // As all active tracks on duplicated output will be deleted,
+                // and as they were also referenced on the other output, the reference
+                // count for their stream type must be adjusted accordingly on
+                // the other output.
+                for (int j = 0; j < (int)AudioSystem::NUM_STREAM_TYPES; j++) {
+                    int refCount = dupOutputDesc->mRefCount[j];
+                    outputDesc2->changeRefCount((AudioSystem::stream_type)j,-refCount);
+                }
+                audio_io_handle_t duplicatedOutput = mOutputs.keyAt(i);
+                ALOGV("closeOutput() closing also duplicated output %d", duplicatedOutput);
+
+                OutputCommand command;
+                command.mType = OutputCommand::CLOSE_OUTPUT;
+                command.mOutput = duplicatedOutput;
+                duplicatedCommands.add(command);
+                delete mOutputs.valueFor(duplicatedOutput);
+                removeOutput(duplicatedOutput);
+            }
+        }
+
+        OutputCommand command;
+        command.mType = OutputCommand::CLOSE_OUTPUT;
+        command.mOutput = output;
+        command.mNotifyClosing = true;
+        commands.add(command);
+        delete outputDesc;
+        removeOutput(output);
+
+        // audioflinger moves the effects attached to a closed output to the primary output
+        PolicyAutolock _l(this, LOCK_EFFECT);
+        for (size_t i = 0; i < mEffects.size(); i++) {
+            EffectDescriptor *desc = mEffects.valueAt(i);
+            if (desc->mSession == AUDIO_SESSION_OUTPUT_MIX && desc->mIo == output) {
+                desc->mIo = mPrimaryOutput;
+            }
+        }
+    }
+    mPreviousOutputs = mOutputs;
+    invalidateA2dpOutput();
+
+    // duplicating outputs are closed before the outputs they duplicate to
+    runOutputCommands(duplicatedCommands);
+    runOutputCommands(commands);
+}
+
+void AudioPolicyManagerBase::runOutputCommands(Vector<OutputCommand>& commands)
+{
+    size_t numThreads = mOutputCommandThreads.size();
+    if ((numThreads == 0) || (commands.size() < 2)) {
+        for (size_t i = 0; i < commands.size(); i++) {
+            executeOutputCommand(commands.editItemAt(i));
+        }
+        return;
+    }
+
+    for (size_t first = 0; first < commands.size(); first += numThreads) {
+        size_t last = first + numThreads;
+        if (last > commands.size()) {
+            last = commands.size();
+        }
+        for (size_t i = first; i < last; i++) {
+            mOutputCommandThreads[i - first]->execute(&commands.editItemAt(i));
+        }
+        // the policy state must not be updated before all client calls are complete
+        for (size_t i = first; i < last; i++) {
+            mOutputCommandThreads[i - first]->waitIdle();
+        }
+    }
+}
+
+void AudioPolicyManagerBase::executeOutputCommand(OutputCommand& command)
+{
+    switch (command.mType) {
+    case OutputCommand::OPEN_OUTPUT: {
+        AudioOutputDescriptor *desc = command.mDesc;
+        command.mOutput = mpClientInterface->openOutput(desc->mProfile->mModule->mHandle,
+                                                        &desc->mDevice,
+                                                        &desc->mSamplingRate,
+                                                        &desc->mFormat,
+                                                        &desc->mChannelMask,
+                                                        &desc->mLatency,
+                                                        desc->mFlags,
+                                                        &command.mOffloadInfo);
+        } break;
+    case OutputCommand::CLOSE_OUTPUT:
+        if (command.mNotifyClosing) {
+            AudioParameter param;
+            param.add(String8("closing"), String8("true"));
+            mpClientInterface->setParameters(command.mOutput, param.toString());
+        }
+        mpClientInterface->closeOutput(command.mOutput);
+        break;
+    }
+}
+
+SortedVector<audio_io_handle_t> AudioPolicyManagerBase::getOutputsForDevice(audio_devices_t device,
+                        DefaultKeyedVector<audio_io_handle_t, AudioOutputDescriptor *> openOutputs)
 {
     SortedVector<audio_io_handle_t> outputs;
 
@@ -2139,7 +2842,7 @@ bool AudioPolicyManagerBase::vectorsEqual(SortedVector<audio_io_handle_t>& outpu
 void AudioPolicyManagerBase::checkOutputForStrategy(routing_strategy strategy)
 {
     audio_devices_t oldDevice = getDeviceForStrategy(strategy, true /*fromCache*/);
-    audio_devices_t newDevice = getDeviceForStrategy(strategy, false /*fromCache*/);
+    audio_devices_t newDevice = getTargetDeviceForStrategy(strategy);
     SortedVector<audio_io_handle_t> srcOutputs = getOutputsForDevice(oldDevice, mPreviousOutputs);
     SortedVector<audio_io_handle_t> dstOutputs = getOutputsForDevice(newDevice, mOutputs);
 
@@ -2157,22 +2860,7 @@ void AudioPolicyManagerBase::checkOutputForStrategy(routing_strategy strategy)
 
         // Move effects associated to this strategy from previous output to new output
         if (strategy == STRATEGY_MEDIA) {
-            audio_io_handle_t fxOutput = selectOutputForEffects(dstOutputs);
-            SortedVector<audio_io_handle_t> moved;
-            for (size_t i = 0; i < mEffects.size(); i++) {
-                EffectDescriptor *desc = mEffects.valueAt(i);
-                if (desc->mSession == AUDIO_SESSION_OUTPUT_MIX &&
-                        desc->mIo != fxOutput) {
-                    if (moved.indexOf(desc->mIo) < 0) {
-                        ALOGV("checkOutputForStrategy() moving effect %d to output %d",
-                              mEffects.keyAt(i), fxOutput);
-                        mpClientInterface->moveEffects(AUDIO_SESSION_OUTPUT_MIX, desc->mIo,
-                                                       fxOutput);
-                        moved.add(desc->mIo);
-                    }
-                    desc->mIo = fxOutput;
-                }
-            }
+            moveGlobalEffects(selectOutputForEffects(dstOutputs));
         }
         // Move tracks associated to this strategy from previous output to new output
         for (int i = 0; i < (int)AudioSystem::NUM_STREAM_TYPES; i++) {
@@ -2200,22 +2888,36 @@ audio_io_handle_t AudioPolicyManagerBase::getA2dpOutput()
     if (!mHasA2dp) {
         return 0;
     }
+    if (mA2dpOutputValid) {
+        return mA2dpOutput;
+    }
 
+    mA2dpOutput = 0;
     for (size_t i = 0; i < mOutputs.size(); i++) {
         AudioOutputDescriptor *outputDesc = mOutputs.valueAt(i);
         if (!outputDesc->isDuplicated() && outputDesc->device() & AUDIO_DEVICE_OUT_ALL_A2DP) {
-            return mOutputs.keyAt(i);
+            mA2dpOutput = mOutputs.keyAt(i);
+            break;
         }
     }
+    mA2dpOutputValid = true;
 
-    return 0;
+    return mA2dpOutput;
+}
+
+void AudioPolicyManagerBase::invalidateA2dpOutput()
+{
+    mA2dpOutputValid = false;
+    mA2dpSuspendCheckNeeded = true;
 }
 
 void AudioPolicyManagerBase::checkA2dpSuspend()
 {
-    if (!mHasA2dp) {
+    if (!mHasA2dp || !mA2dpSuspendCheckNeeded) {
         return;
     }
+    // the A2DP output or one of the conditions below changed since last time
+    mA2dpSuspendCheckNeeded = false;
     audio_io_handle_t a2dpOutput = getA2dpOutput();
     if (a2dpOutput == 0) {
         return;
@@ -2274,19 +2976,24 @@ audio_devices_t AudioPolicyManagerBase::getNewDevice(audio_io_handle_t output, b
     //      use device for strategy media
     // 6: the strategy DTMF is active on the output:
     //      use device for strategy DTMF
+    routing_strategy strategy = NUM_STRATEGIES;
     if (outputDesc->isStrategyActive(STRATEGY_ENFORCED_AUDIBLE)) {
-        device = getDeviceForStrategy(STRATEGY_ENFORCED_AUDIBLE, fromCache);
+        strategy = STRATEGY_ENFORCED_AUDIBLE;
     } else if (isInCall() ||
                     outputDesc->isStrategyActive(STRATEGY_PHONE)) {
-        device = getDeviceForStrategy(STRATEGY_PHONE, fromCache);
+        strategy = STRATEGY_PHONE;
     } else if (outputDesc->isStrategyActive(STRATEGY_SONIFICATION)) {
-        device = getDeviceForStrategy(STRATEGY_SONIFICATION, fromCache);
+        strategy = STRATEGY_SONIFICATION;
     } else if (outputDesc->isStrategyActive(STRATEGY_SONIFICATION_RESPECTFUL)) {
-        device = getDeviceForStrategy(STRATEGY_SONIFICATION_RESPECTFUL, fromCache);
+        strategy = STRATEGY_SONIFICATION_RESPECTFUL;
     } else if (outputDesc->isStrategyActive(STRATEGY_MEDIA)) {
-        device = getDeviceForStrategy(STRATEGY_MEDIA, fromCache);
+        strategy = STRATEGY_MEDIA;
     } else if (outputDesc->isStrategyActive(STRATEGY_DTMF)) {
-        device = getDeviceForStrategy(STRATEGY_DTMF, fromCache);
+        strategy = STRATEGY_DTMF;
+    }
+    if (strategy != NUM_STRATEGIES) {
+        device = fromCache ? getDeviceForStrategy(strategy, true /*fromCache*/) :
+                             getTargetDeviceForStrategy(strategy);
     }
 
     ALOGV("getNewDevice() selected device %x", device);
@@ -2298,6 +3005,7 @@ uint32_t AudioPolicyManagerBase::getStrategyForStream(AudioSystem::stream_type s
 }
 
 audio_devices_t AudioPolicyManagerBase::getDevicesForStream(AudioSystem::stream_type stream) {
+    PolicyAutolock _l(this, LOCK_ROUTE);
     audio_devices_t devices;
     // By checking the range of stream before calling getStrategy, we avoid
     // getStrategy's behavior for invalid streams.  getStrategy would do a ALOGE
@@ -2568,9 +3276,32 @@ audio_devices_t AudioPolicyManagerBase::getDeviceForStrategy(routing_strategy st
 void AudioPolicyManagerBase::updateDevicesAndOutputs()
 {
     for (int i = 0; i < NUM_STRATEGIES; i++) {
-        mDeviceForStrategy[i] = getDeviceForStrategy((routing_strategy)i, false /*fromCache*/);
+        mDeviceForStrategy[i] = getTargetDeviceForStrategy((routing_strategy)i);
     }
     mPreviousOutputs = mOutputs;
+    checkOutputForEffects();
+}
+
+void AudioPolicyManagerBase::beginPolicyRecompute()
+{
+    for (int i = 0; i < NUM_STRATEGIES; i++) {
+        mTargetDeviceForStrategy[i] = getDeviceForStrategy((routing_strategy)i,
+                                                           false /*fromCache*/);
+    }
+    mRecomputing = true;
+}
+
+void AudioPolicyManagerBase::endPolicyRecompute()
+{
+    mRecomputing = false;
+}
+
+audio_devices_t AudioPolicyManagerBase::getTargetDeviceForStrategy(routing_strategy strategy)
+{
+    if (mRecomputing) {
+        return mTargetDeviceForStrategy[strategy];
+    }
+    return getDeviceForStrategy(strategy, false /*fromCache*/);
 }
 
 uint32_t AudioPolicyManagerBase::checkDeviceMuteStrategies(AudioOutputDescriptor *outputDesc,
@@ -2592,7 +3323,7 @@ uint32_t AudioPolicyManagerBase::checkDeviceMuteStrategies(AudioOutputDescriptor
     bool tempMute = outputDesc->isActive() && (device != prevDevice);
 
     for (size_t i = 0; i < NUM_STRATEGIES; i++) {
-        audio_devices_t curDevice = getDeviceForStrategy((routing_strategy)i, false /*fromCache*/);
+        audio_devices_t curDevice = getTargetDeviceForStrategy((routing_strategy)i);
         bool mute = shouldMute && (curDevice & device) && (curDevice != device);
         bool doMute = false;
 
@@ -2643,12 +3374,28 @@ uint32_t AudioPolicyManagerBase::checkDeviceMuteStrategies(AudioOutputDescriptor
         if(outputDesc->mDevice == AUDIO_DEVICE_OUT_ANLG_DOCK_HEADSET) {
            muteWaitMs = muteWaitMs+10;
         }
-        usleep(muteWaitMs * 1000);
+        ALOGV("checkDeviceMuteStrategies() routing event %u waiting %d ms",
+              mRoutingEventId, muteWaitMs);
+        mClock->sleepUs(muteWaitMs * 1000);
         return muteWaitMs;
     }
     return 0;
 }
 
+void AudioPolicyManagerBase::noteRoutingCommand(audio_io_handle_t output, int delayMs)
+{
+    if (mRoutingEventId == 0) {
+        return;
+    }
+    // the client applies the command after the requested delay at the earliest
+    int32_t latencyMs = (int32_t)ns2ms(mClock->now() - mRoutingEventStartTime) + delayMs;
+    ALOGV("noteRoutingCommand() routing event %u output %d latency %d ms",
+          mRoutingEventId, output, latencyMs);
+    if (latencyMs > mRoutingEventLatencyMs) {
+        mRoutingEventLatencyMs = latencyMs;
+    }
+}
+
 uint32_t AudioPolicyManagerBase::setOutputDevice(audio_io_handle_t output,
                                              audio_devices_t device,
                                              bool force,
@@ -2687,6 +3434,9 @@ uint32_t AudioPolicyManagerBase::setOutputDevice(audio_io_handle_t output,
         prevDevice == AUDIO_DEVICE_OUT_AUX_DIGITAL ||
         prevDevice == AUDIO_DEVICE_OUT_ANLG_DOCK_HEADSET) {
         outputDesc->mDevice = device;
+        if ((device ^ prevDevice) & AUDIO_DEVICE_OUT_ALL_A2DP) {
+            invalidateA2dpOutput();
+        }
     }
     muteWaitMs = checkDeviceMuteStrategies(outputDesc, prevDevice, delayMs);
 
@@ -2703,7 +3453,8 @@ uint32_t AudioPolicyManagerBase::setOutputDevice(audio_io_handle_t output,
         force (%d) delayMs (%d) on Output (%d)", prevDevice, device, force, delayMs, output);
     // do the routing
     param.addInt(String8(AudioParameter::keyRouting), (int)device);
-    mpClientInterface->setParameters(output, param.toString(), delayMs);
+    noteRoutingCommand(output, delayMs);
+    mpClientInterface->setRoutingParameters(output, param.toString(), delayMs, mRoutingEventId);
 
     // update stream volumes according to new device
     applyStreamVolumes(output, device, delayMs);
@@ -3303,131 +4054,1068 @@ uint32_t AudioPolicyManagerBase::getMaxEffectsMemory()
     return MAX_EFFECTS_MEMORY;
 }
 
-// --- AudioOutputDescriptor class implementation
+// --- Policy state snapshot
+
+// Layout of AUDIO_POLICY_STATE_SNAPSHOT_FILE: a policy_state_header followed by numVolumes
+// policy_state_volume entries and numUsbCapabilities policy_state_usb_capabilities entries,
+// each USB capabilities entry being followed by its sampling rates, formats and channel masks
+// as 32 bit values.
+// The snapshot is only meant to survive a media server restart, not a reboot: it is
+// tagged with the kernel boot ID and written in the native byte order.
+// Device connections are not part of the snapshot: the audio service reports the devices
+// still connected when it reconnects to the restarted policy manager.
+#define POLICY_STATE_MAGIC 0x53535041 // "APSS"
+#define POLICY_STATE_VERSION 3
+#define USB_CAPABILITIES_KEY_MAX_LEN 128
+#define BOOT_ID_FILE "/proc/sys/kernel/random/boot_id"
+#define BOOT_ID_MAX_LEN 40
+
+struct policy_state_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;                  // total snapshot size in bytes
+    char bootId[BOOT_ID_MAX_LEN];   // boot during which the snapshot was taken
+    uint32_t forceUse[AudioSystem::NUM_FORCE_USE];
+    uint32_t numVolumes;            // number of policy_state_volume entries
+    uint32_t numUsbCapabilities;    // number of policy_state_usb_capabilities entries
+};
 
-AudioPolicyManagerBase::AudioOutputDescriptor::AudioOutputDescriptor(
-        const IOProfile *profile)
-    : mId(0), mSamplingRate(0), mFormat((audio_format_t)0),
-      mChannelMask((audio_channel_mask_t)0), mLatency(0),
-    mFlags((audio_output_flags_t)0), mDevice(AUDIO_DEVICE_NONE),
-    mOutput1(0), mOutput2(0), mProfile(profile), mDirectOpenCount(0)
+struct policy_state_volume {
+    uint32_t stream;
+    uint32_t device;
+    int32_t index;
+};
+
+struct policy_state_usb_capabilities {
+    char key[USB_CAPABILITIES_KEY_MAX_LEN]; // see getUsbCapabilitiesKey()
+    uint32_t latency;
+    uint32_t numSamplingRates;
+    uint32_t numFormats;
+    uint32_t numChannelMasks;
+};
+
+static bool readBootId(char *bootId)
 {
-    // clear usage count for all stream types
-    for (int i = 0; i < AudioSystem::NUM_STREAM_TYPES; i++) {
-        mRefCount[i] = 0;
-        mCurVolume[i] = -1.0;
-        mMuteCount[i] = 0;
-        mStopTime[i] = 0;
+    memset(bootId, 0, BOOT_ID_MAX_LEN);
+    int fd = open(BOOT_ID_FILE, O_RDONLY);
+    if (fd < 0) {
+        return false;
     }
-    for (int i = 0; i < NUM_STRATEGIES; i++) {
-        mStrategyMutedByDevice[i] = false;
+    ssize_t size = read(fd, bootId, BOOT_ID_MAX_LEN - 1);
+    close(fd);
+    if (size <= 0) {
+        return false;
     }
-    if (profile != NULL) {
-        mSamplingRate = profile->mSamplingRates[0];
-        mFormat = profile->mFormats[0];
-        mChannelMask = profile->mChannelMasks[0];
-        mFlags = profile->mFlags;
+    bootId[size] = 0;
+    char *newLine = strchr(bootId, '\n');
+    if (newLine != NULL) {
+        *newLine = 0;
     }
+    return true;
 }
 
-audio_devices_t AudioPolicyManagerBase::AudioOutputDescriptor::device() const
+static void appendValues(Vector<uint8_t>& data, const void *values, size_t size)
 {
-    if (isDuplicated()) {
-        return (audio_devices_t)(mOutput1->mDevice | mOutput2->mDevice);
-    } else {
-        return mDevice;
-    }
+    data.appendArray((const uint8_t *)values, size);
 }
 
-uint32_t AudioPolicyManagerBase::AudioOutputDescriptor::latency()
+// reads size bytes at *offset from a snapshot of total length length
+static const void *readValues(const uint8_t *data, size_t length, size_t *offset, size_t size)
 {
-    if (isDuplicated()) {
-        return (mOutput1->mLatency > mOutput2->mLatency) ? mOutput1->mLatency : mOutput2->mLatency;
-    } else {
-        return mLatency;
+    if ((size > length) || (*offset > length - size)) {
+        return NULL;
     }
+    const void *values = data + *offset;
+    *offset += size;
+    return values;
 }
 
-bool AudioPolicyManagerBase::AudioOutputDescriptor::sharesHwModuleWith(
-        const AudioOutputDescriptor *outputDesc)
+void AudioPolicyManagerBase::saveStateSnapshot()
 {
-    if (isDuplicated()) {
-        return mOutput1->sharesHwModuleWith(outputDesc) || mOutput2->sharesHwModuleWith(outputDesc);
-    } else if (outputDesc->isDuplicated()){
-        return sharesHwModuleWith(outputDesc->mOutput1) || sharesHwModuleWith(outputDesc->mOutput2);
-    } else {
-        return (mProfile->mModule == outputDesc->mProfile->mModule);
+    if (mStateSnapshotThread == 0) {
+        return;
+    }
+
+    struct policy_state_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = POLICY_STATE_MAGIC;
+    header.version = POLICY_STATE_VERSION;
+    strlcpy(header.bootId, mBootId.string(), sizeof(header.bootId));
+    for (int i = 0; i < AudioSystem::NUM_FORCE_USE; i++) {
+        header.forceUse[i] = mForceUse[i];
+    }
+
+    Vector<uint8_t> entries;
+    for (int i = 0; i < AudioSystem::NUM_STREAM_TYPES; i++) {
+        for (uint32_t valid = mStreams[i].mIndexValid; valid != 0; valid &= valid - 1) {
+            uint32_t slot = __builtin_ctz(valid);
+            struct policy_state_volume volume;
+            volume.stream = i;
+            volume.device = 1u << slot;
+            volume.index = mStreams[i].mIndexCur[slot];
+            appendValues(entries, &volume, sizeof(volume));
+            header.numVolumes++;
+        }
+    }
+    for (size_t i = 0; i < mUsbCapabilities.size(); i++) {
+        const UsbCapabilities& capabilities = mUsbCapabilities.valueAt(i);
+        struct policy_state_usb_capabilities entry;
+        memset(&entry, 0, sizeof(entry));
+        if (strlcpy(entry.key, mUsbCapabilities.keyAt(i).string(), sizeof(entry.key)) >=
+                sizeof(entry.key)) {
+            continue;
+        }
+        entry.latency = capabilities.mLatency;
+        entry.numSamplingRates = capabilities.mSamplingRates.size();
+        entry.numFormats = capabilities.mFormats.size();
+        entry.numChannelMasks = capabilities.mChannelMasks.size();
+        appendValues(entries, &entry, sizeof(entry));
+        for (size_t k = 0; k < capabilities.mSamplingRates.size(); k++) {
+            uint32_t value = capabilities.mSamplingRates[k];
+            appendValues(entries, &value, sizeof(value));
+        }
+        for (size_t k = 0; k < capabilities.mFormats.size(); k++) {
+            uint32_t value = capabilities.mFormats[k];
+            appendValues(entries, &value, sizeof(value));
+        }
+        for (size_t k = 0; k < capabilities.mChannelMasks.size(); k++) {
+            uint32_t value = capabilities.mChannelMasks[k];
+            appendValues(entries, &value, sizeof(value));
+        }
+        header.numUsbCapabilities++;
     }
+    header.size = sizeof(header) + entries.size();
+
+    Vector<uint8_t> snapshot;
+    appendValues(snapshot, &header, sizeof(header));
+    snapshot.appendVector(entries);
+    mStateSnapshotThread->post(snapshot);
 }
 
-void AudioPolicyManagerBase::AudioOutputDescriptor::changeRefCount(AudioSystem::stream_type stream, int delta)
+// writes to a temporary file and renames it so that a crash never leaves a partial snapshot
+static void writeStateSnapshot(const Vector<uint8_t>& snapshot)
 {
-    // forward usage count change to attached outputs
-    if (isDuplicated()) {
-        mOutput1->changeRefCount(stream, delta);
-        mOutput2->changeRefCount(stream, delta);
-    }
-    if ((delta + (int)mRefCount[stream]) < 0) {
-        ALOGW("changeRefCount() invalid delta %d for stream %d, refCount %d", delta, stream, mRefCount[stream]);
-        mRefCount[stream] = 0;
+    String8 tmpPath = String8(AUDIO_POLICY_STATE_SNAPSHOT_FILE ".tmp");
+    int fd = open(tmpPath.string(), O_WRONLY | O_CREAT | O_TRUNC, 0660);
+    if (fd < 0) {
+        ALOGW("writeStateSnapshot() cannot create %s", tmpPath.string());
         return;
     }
-    mRefCount[stream] += delta;
-    ALOGV("changeRefCount() stream %d, count %d", stream, mRefCount[stream]);
+    bool written = (write(fd, snapshot.array(), snapshot.size()) == (ssize_t)snapshot.size());
+    close(fd);
+    if (!written || rename(tmpPath.string(), AUDIO_POLICY_STATE_SNAPSHOT_FILE) != 0) {
+        ALOGW("writeStateSnapshot() cannot write %s", AUDIO_POLICY_STATE_SNAPSHOT_FILE);
+        unlink(tmpPath.string());
+    }
 }
 
-audio_devices_t AudioPolicyManagerBase::AudioOutputDescriptor::supportedDevices()
+void AudioPolicyManagerBase::restoreStateSnapshot()
 {
-    if (isDuplicated()) {
-        return (audio_devices_t)(mOutput1->supportedDevices() | mOutput2->supportedDevices());
-    } else {
-        return mProfile->mSupportedDevices ;
+    char bootId[BOOT_ID_MAX_LEN];
+    if (!readBootId(bootId)) {
+        ALOGW("restoreStateSnapshot() cannot read boot ID, state snapshots disabled");
+        return;
+    }
+    mBootId = String8(bootId);
+
+    int fd = open(AUDIO_POLICY_STATE_SNAPSHOT_FILE, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(struct policy_state_header))) {
+        close(fd);
+        return;
+    }
+    size_t length = st.st_size;
+    void *map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        ALOGW("restoreStateSnapshot() cannot map %s", AUDIO_POLICY_STATE_SNAPSHOT_FILE);
+        return;
+    }
+    const uint8_t *data = (const uint8_t *)map;
+    size_t offset = 0;
+    const struct policy_state_header *header =
+            (const struct policy_state_header *)readValues(data, length, &offset, sizeof(*header));
+
+    if ((header->magic != POLICY_STATE_MAGIC) || (header->version != POLICY_STATE_VERSION) ||
+            (header->size != length) ||
+            (strncmp(bootId, header->bootId, BOOT_ID_MAX_LEN) != 0)) {
+        ALOGV("restoreStateSnapshot() ignoring stale or invalid snapshot");
+        munmap(map, length);
+        return;
+    }
+
+    for (int i = 0; i < AudioSystem::NUM_FORCE_USE; i++) {
+        if (header->forceUse[i] < AudioSystem::NUM_FORCE_CONFIG) {
+            mForceUse[i] = (AudioSystem::forced_config)header->forceUse[i];
+            mA2dpSuspendCheckNeeded = true;
+        }
+    }
+
+    for (uint32_t i = 0; i < header->numVolumes; i++) {
+        const struct policy_state_volume *volume = (const struct policy_state_volume *)
+                readValues(data, length, &offset, sizeof(*volume));
+        if (volume == NULL) {
+            break;
+        }
+        if ((volume->stream < AudioSystem::NUM_STREAM_TYPES) &&
+                audio_is_output_device((audio_devices_t)volume->device)) {
+            mStreams[volume->stream].setVolumeIndex((audio_devices_t)volume->device,
+                                                    volume->index);
+        }
+    }
+
+    // known USB devices are not probed again when the audio service reconnects them
+    for (uint32_t i = 0; i < header->numUsbCapabilities; i++) {
+        const struct policy_state_usb_capabilities *entry =
+                (const struct policy_state_usb_capabilities *)
+                        readValues(data, length, &offset, sizeof(*entry));
+        if (entry == NULL) {
+            break;
+        }
+        size_t count = entry->numSamplingRates + entry->numFormats + entry->numChannelMasks;
+        const uint32_t *values = (const uint32_t *)
+                readValues(data, length, &offset, count * sizeof(uint32_t));
+        if (values == NULL || entry->numSamplingRates == 0 || entry->numFormats == 0 ||
+                entry->numChannelMasks == 0) {
+            break;
+        }
+        if (mUsbCapabilities.size() >= MAX_USB_CAPABILITIES) {
+            break;
+        }
+        UsbCapabilities capabilities;
+        for (uint32_t k = 0; k < entry->numSamplingRates; k++) {
+            capabilities.mSamplingRates.add(values[k]);
+        }
+        values += entry->numSamplingRates;
+        for (uint32_t k = 0; k < entry->numFormats; k++) {
+            capabilities.mFormats.add((audio_format_t)values[k]);
+        }
+        values += entry->numFormats;
+        for (uint32_t k = 0; k < entry->numChannelMasks; k++) {
+            capabilities.mChannelMasks.add((audio_channel_mask_t)values[k]);
+        }
+        capabilities.mLatency = entry->latency;
+        char key[USB_CAPABILITIES_KEY_MAX_LEN];
+        strlcpy(key, entry->key, sizeof(key));
+        mUsbCapabilities.add(String8(key), capabilities);
+    }
+
+    munmap(map, length);
+
+    // apply the restored forced usages and volumes to the outputs already open
+    checkA2dpSuspend();
+    beginPolicyRecompute();
+    checkOutputForAllStrategies();
+    updateDevicesAndOutputs();
+    for (size_t i = 0; i < mOutputs.size(); i++) {
+        audio_io_handle_t output = mOutputs.keyAt(i);
+        audio_devices_t newDevice = getNewDevice(output, true /*fromCache*/);
+        setOutputDevice(output, newDevice, false);
+        if (newDevice != AUDIO_DEVICE_NONE) {
+            applyStreamVolumes(output, newDevice, 0, true);
+        }
     }
+    endPolicyRecompute();
 }
 
-bool AudioPolicyManagerBase::AudioOutputDescriptor::isActive(uint32_t inPastMs) const
+// --- USB audio device capabilities
+
+#define USB_CARD_ID_FILE "/proc/asound/card%d/id"
+#define USB_CARD_ID_MAX_LEN 32
+
+bool AudioPolicyManagerBase::hasDynamicParameters(const IOProfile *profile)
 {
-    return isStrategyActive(NUM_STRATEGIES, inPastMs);
+    return (profile->mSamplingRates[0] == 0) || (profile->mFormats[0] == 0) ||
+            (profile->mChannelMasks[0] == 0);
 }
 
-bool AudioPolicyManagerBase::AudioOutputDescriptor::isStrategyActive(routing_strategy strategy,
-                                                                       uint32_t inPastMs,
-                                                                       nsecs_t sysTime) const
+String8 AudioPolicyManagerBase::getUsbCapabilitiesKey(const char *address,
+                                                      const IOProfile *profile)
 {
-    if ((sysTime == 0) && (inPastMs != 0)) {
-        sysTime = systemTime();
-    }
-    for (int i = 0; i < AudioSystem::NUM_STREAM_TYPES; i++) {
-        if (((getStrategy((AudioSystem::stream_type)i) == strategy) ||
-                (NUM_STRATEGIES == strategy)) &&
-                isStreamActive((AudioSystem::stream_type)i, inPastMs, sysTime)) {
-            return true;
+    String8 key = String8(address);
+    // ALSA card numbers are reused when devices are unplugged: add the card ID so that
+    // another DAC enumerated with the same card number is not mistaken for a known one
+    const char *card = strstr(address, "card=");
+    int cardNumber;
+    if ((card != NULL) && (sscanf(card, "card=%d", &cardNumber) == 1)) {
+        char path[64];
+        char id[USB_CARD_ID_MAX_LEN];
+        snprintf(path, sizeof(path), USB_CARD_ID_FILE, cardNumber);
+        int fd = open(path, O_RDONLY);
+        if (fd >= 0) {
+            ssize_t size = read(fd, id, sizeof(id) - 1);
+            close(fd);
+            if (size > 0) {
+                id[size] = 0;
+                char *newLine = strchr(id, '\n');
+                if (newLine != NULL) {
+                    *newLine = 0;
+                }
+                key.appendFormat(";id=%s", id);
+            }
         }
     }
-    return false;
+    key.appendFormat(";profile=%s", profile->mName.string());
+    return key;
 }
 
-bool AudioPolicyManagerBase::AudioOutputDescriptor::isStreamActive(AudioSystem::stream_type stream,
-                                                                       uint32_t inPastMs,
-                                                                       nsecs_t sysTime) const
+bool AudioPolicyManagerBase::loadUsbCapabilities(const char *address, IOProfile *profile)
 {
-    if (mRefCount[stream] != 0) {
-        return true;
+    if (!hasDynamicParameters(profile)) {
+        return false;
     }
-    if (inPastMs == 0) {
+    ssize_t index = mUsbCapabilities.indexOfKey(getUsbCapabilitiesKey(address, profile));
+    if (index < 0) {
         return false;
     }
-    if (sysTime == 0) {
-        sysTime = systemTime();
+    const UsbCapabilities& capabilities = mUsbCapabilities.valueAt(index);
+    if (profile->mSamplingRates[0] == 0) {
+        profile->mSamplingRates = capabilities.mSamplingRates;
     }
-    if (ns2ms(sysTime - mStopTime[stream]) < inPastMs) {
-        return true;
+    if (profile->mFormats[0] == 0) {
+        profile->mFormats = capabilities.mFormats;
     }
-    return false;
+    if (profile->mChannelMasks[0] == 0) {
+        profile->mChannelMasks = capabilities.mChannelMasks;
+    }
+    return true;
+}
+
+void AudioPolicyManagerBase::storeUsbCapabilities(const char *address,
+                                                  const IOProfile *profile,
+                                                  uint32_t latency)
+{
+    if (!hasDynamicParameters(profile)) {
+        return;
+    }
+    String8 key = getUsbCapabilitiesKey(address, profile);
+    if ((mUsbCapabilities.indexOfKey(key) < 0) &&
+            (mUsbCapabilities.size() >= MAX_USB_CAPABILITIES)) {
+        // no usage history is kept: make room by forgetting one device
+        ALOGV("storeUsbCapabilities() forgetting %s", mUsbCapabilities.keyAt(0).string());
+        mUsbCapabilities.removeItemsAt(0);
+    }
+    UsbCapabilities capabilities;
+    capabilities.mSamplingRates = profile->mSamplingRates;
+    capabilities.mFormats = profile->mFormats;
+    capabilities.mChannelMasks = profile->mChannelMasks;
+    capabilities.mLatency = latency;
+    mUsbCapabilities.add(key, capabilities);
+    ALOGV("storeUsbCapabilities() %s latency %d", key.string(), latency);
 }
 
+// --- UsbCapabilities class implementation
 
-status_t AudioPolicyManagerBase::AudioOutputDescriptor::dump(int fd)
+AudioPolicyManagerBase::UsbCapabilities::UsbCapabilities()
+    : mLatency(0)
+{
+}
+
+void AudioPolicyManagerBase::UsbCapabilities::dump(int fd, const char *key) const
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    String8 result;
+
+    snprintf(buffer, SIZE, "- %s\n", key);
+    result.append(buffer);
+    result.append("   - sampling rates: ");
+    for (size_t i = 0; i < mSamplingRates.size(); i++) {
+        snprintf(buffer, SIZE, "%d", mSamplingRates[i]);
+        result.append(buffer);
+        result.append(i == (mSamplingRates.size() - 1) ? "\n" : ", ");
+    }
+    result.append("   - formats: ");
+    for (size_t i = 0; i < mFormats.size(); i++) {
+        snprintf(buffer, SIZE, "0x%08x", mFormats[i]);
+        result.append(buffer);
+        result.append(i == (mFormats.size() - 1) ? "\n" : ", ");
+    }
+    result.append("   - channel masks: ");
+    for (size_t i = 0; i < mChannelMasks.size(); i++) {
+        snprintf(buffer, SIZE, "0x%04x", mChannelMasks[i]);
+        result.append(buffer);
+        result.append(i == (mChannelMasks.size() - 1) ? "\n" : ", ");
+    }
+    snprintf(buffer, SIZE, "   - latency: %d\n", mLatency);
+    result.append(buffer);
+    write(fd, result.string(), result.size());
+}
+
+void AudioPolicyManagerBase::UsbCapabilities::dumpJson(PolicyDumpBuffer& out,
+                                                       const char *key) const
+{
+    out.appendf("{\"type\":\"usb_capabilities\",\"key\":");
+    out.appendString(key);
+    out.appendf(",\"sampling_rates\":[");
+    for (size_t i = 0; i < mSamplingRates.size(); i++) {
+        out.appendf("%s%u", (i == 0) ? "" : ",", mSamplingRates[i]);
+    }
+    out.appendf("],\"formats\":[");
+    for (size_t i = 0; i < mFormats.size(); i++) {
+        out.appendf("%s%u", (i == 0) ? "" : ",", mFormats[i]);
+    }
+    out.appendf("],\"channel_masks\":[");
+    for (size_t i = 0; i < mChannelMasks.size(); i++) {
+        out.appendf("%s%u", (i == 0) ? "" : ",", mChannelMasks[i]);
+    }
+    out.appendf("],\"latency\":%u}\n", mLatency);
+}
+
+// --- PolicyLock class implementation
+
+AudioPolicyManagerBase::PolicyLock::PolicyLock()
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&mMutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+AudioPolicyManagerBase::PolicyLock::~PolicyLock()
+{
+    pthread_mutex_destroy(&mMutex);
+}
+
+void AudioPolicyManagerBase::PolicyLock::lock()
+{
+    pthread_mutex_lock(&mMutex);
+}
+
+void AudioPolicyManagerBase::PolicyLock::unlock()
+{
+    pthread_mutex_unlock(&mMutex);
+}
+
+// --- PolicyAutolock class implementation
+
+AudioPolicyManagerBase::PolicyAutolock::PolicyAutolock(const AudioPolicyManagerBase *manager,
+                                                       uint32_t domains)
+    : mManager(manager), mDomains(domains)
+{
+    if (mDomains & LOCK_ROUTE) {
+        mManager->mRouteLock.lock();
+    }
+    if (mDomains & LOCK_INPUT) {
+        mManager->mInputLock.lock();
+    }
+    if (mDomains & LOCK_VOLUME) {
+        mManager->mVolumeLock.lock();
+    }
+    if (mDomains & LOCK_EFFECT) {
+        mManager->mEffectLock.lock();
+    }
+}
+
+AudioPolicyManagerBase::PolicyAutolock::~PolicyAutolock()
+{
+    if (mDomains & LOCK_EFFECT) {
+        mManager->mEffectLock.unlock();
+    }
+    if (mDomains & LOCK_VOLUME) {
+        mManager->mVolumeLock.unlock();
+    }
+    if (mDomains & LOCK_INPUT) {
+        mManager->mInputLock.unlock();
+    }
+    if (mDomains & LOCK_ROUTE) {
+        mManager->mRouteLock.unlock();
+    }
+}
+
+// --- PolicyDumpBuffer class implementation
+
+AudioPolicyManagerBase::PolicyDumpBuffer::PolicyDumpBuffer()
+    : mData(NULL), mSize(0), mCapacity(0), mOverflow(false)
+{
+    reserve(16 * 1024);
+}
+
+AudioPolicyManagerBase::PolicyDumpBuffer::~PolicyDumpBuffer()
+{
+    free(mData);
+}
+
+bool AudioPolicyManagerBase::PolicyDumpBuffer::reserve(size_t size)
+{
+    if (size <= mCapacity) {
+        return true;
+    }
+    if (mOverflow) {
+        return false;
+    }
+    size_t capacity = (mCapacity != 0) ? mCapacity : 1024;
+    while (capacity < size) {
+        capacity *= 2;
+    }
+    char *data = (char *)realloc(mData, capacity);
+    if (data == NULL) {
+        ALOGE("PolicyDumpBuffer cannot allocate %zu bytes, dump truncated", capacity);
+        mOverflow = true;
+        return false;
+    }
+    mData = data;
+    mCapacity = capacity;
+    return true;
+}
+
+void AudioPolicyManagerBase::PolicyDumpBuffer::appendf(const char *format, ...)
+{
+    va_list args;
+
+    if (!reserve(mSize + 256)) {
+        return;
+    }
+    va_start(args, format);
+    int len = vsnprintf(mData + mSize, mCapacity - mSize, format, args);
+    va_end(args);
+    if (len < 0) {
+        return;
+    }
+    if ((size_t)len >= mCapacity - mSize) {
+        if (!reserve(mSize + len + 1)) {
+            return;
+        }
+        va_start(args, format);
+        vsnprintf(mData + mSize, mCapacity - mSize, format, args);
+        va_end(args);
+    }
+    mSize += len;
+}
+
+void AudioPolicyManagerBase::PolicyDumpBuffer::appendString(const char *str)
+{
+    // worst case: every character escaped as \u00xx, plus the quotes
+    if (!reserve(mSize + strlen(str) * 6 + 3)) {
+        return;
+    }
+    mData[mSize++] = '"';
+    for (; *str != '\0'; str++) {
+        unsigned char c = (unsigned char)*str;
+        if (c == '"' || c == '\\') {
+            mData[mSize++] = '\\';
+            mData[mSize++] = c;
+        } else if (c < 0x20) {
+            mSize += snprintf(mData + mSize, mCapacity - mSize, "\\u%04x", c);
+        } else {
+            mData[mSize++] = c;
+        }
+    }
+    mData[mSize++] = '"';
+}
+
+status_t AudioPolicyManagerBase::PolicyDumpBuffer::flush(int fd)
+{
+    size_t offset = 0;
+
+    while (offset < mSize) {
+        ssize_t written = ::write(fd, mData + offset, mSize - offset);
+        if (written < 0) {
+            return -errno;
+        }
+        offset += written;
+    }
+    mSize = 0;
+    return mOverflow ? NO_MEMORY : NO_ERROR;
+}
+
+// --- VirtualAudioPolicyClock class implementation
+
+nsecs_t VirtualAudioPolicyClock::now() const
+{
+    android::Mutex::Autolock _l(mLock);
+    return mNow;
+}
+
+void VirtualAudioPolicyClock::advance(nsecs_t delta)
+{
+    android::Mutex::Autolock _l(mLock);
+    mNow += delta;
+}
+
+android::status_t VirtualAudioPolicyClock::waitRelative(android::Condition& cond,
+                                                        android::Mutex& lock,
+                                                        nsecs_t timeout)
+{
+    nsecs_t deadline = now() + timeout;
+    for (;;) {
+        android::status_t status = cond.waitRelative(lock, milliseconds(VIRTUAL_CLOCK_POLL_MS));
+        if (status != TIMED_OUT) {
+            return status;
+        }
+        if (now() >= deadline) {
+            return TIMED_OUT;
+        }
+    }
+}
+
+// --- PolicyTimerThread class implementation
+
+AudioPolicyManagerBase::PolicyTimerThread::PolicyTimerThread(AudioPolicyManagerBase *manager,
+                                                             check_function check)
+    : Thread(false), mManager(manager), mCheck(check), mWakePending(false)
+{
+}
+
+void AudioPolicyManagerBase::PolicyTimerThread::wake()
+{
+    android::Mutex::Autolock _l(mLock);
+    mWakePending = true;
+    mWaitWorkCV.signal();
+}
+
+void AudioPolicyManagerBase::PolicyTimerThread::exit()
+{
+    requestExit();
+    wake();
+    requestExitAndWait();
+}
+
+bool AudioPolicyManagerBase::PolicyTimerThread::threadLoop()
+{
+    nsecs_t waitTime = (mManager->*mCheck)();
+
+    android::Mutex::Autolock _l(mLock);
+    if (exitPending()) {
+        return false;
+    }
+    if (!mWakePending) {
+        if (waitTime < 0) {
+            mWaitWorkCV.wait(mLock);
+        } else {
+            // waitTime is measured on the policy clock
+            mManager->mClock->waitRelative(mWaitWorkCV, mLock, waitTime);
+        }
+    }
+    mWakePending = false;
+    return true;
+}
+
+// --- ConfigWatcherThread class implementation
+
+AudioPolicyManagerBase::ConfigWatcherThread::ConfigWatcherThread(AudioPolicyManagerBase *manager)
+    : Thread(false), mManager(manager), mInotifyFd(-1)
+{
+    mExitPipe[0] = -1;
+    mExitPipe[1] = -1;
+}
+
+AudioPolicyManagerBase::ConfigWatcherThread::~ConfigWatcherThread()
+{
+    if (mInotifyFd >= 0) {
+        close(mInotifyFd);
+    }
+    if (mExitPipe[0] >= 0) {
+        close(mExitPipe[0]);
+        close(mExitPipe[1]);
+    }
+}
+
+status_t AudioPolicyManagerBase::ConfigWatcherThread::watch(const char *path)
+{
+    // watch the directory: editors and installers often replace the file rather than
+    // rewriting it, which would end a watch on the file itself
+    String8 dir = String8(path).getPathDir();
+    mFileName = String8(path).getPathLeaf();
+    if (dir.isEmpty()) {
+        dir = String8(".");
+    }
+    if (pipe(mExitPipe) != 0) {
+        mExitPipe[0] = -1;
+        mExitPipe[1] = -1;
+        return -errno;
+    }
+    mInotifyFd = inotify_init();
+    if (mInotifyFd < 0) {
+        return -errno;
+    }
+    if (inotify_add_watch(mInotifyFd, dir.string(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        return -errno;
+    }
+    return NO_ERROR;
+}
+
+void AudioPolicyManagerBase::ConfigWatcherThread::exit()
+{
+    requestExit();
+    char c = 0;
+    write(mExitPipe[1], &c, 1);
+    requestExitAndWait();
+}
+
+bool AudioPolicyManagerBase::ConfigWatcherThread::threadLoop()
+{
+    struct pollfd fds[2];
+    fds[0].fd = mInotifyFd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    fds[1].fd = mExitPipe[0];
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+    if (poll(fds, 2, -1) < 0) {
+        return (errno == EINTR) && !exitPending();
+    }
+    if (exitPending() || (fds[1].revents != 0)) {
+        return false;
+    }
+
+    // events are variable length and aligned on the event structure
+    uint32_t buffer[1024];
+    ssize_t size = read(mInotifyFd, buffer, sizeof(buffer));
+    bool changed = false;
+    ssize_t offset = 0;
+    while (offset + (ssize_t)sizeof(struct inotify_event) <= size) {
+        const struct inotify_event *event =
+                (const struct inotify_event *)((const char *)buffer + offset);
+        if ((event->len != 0) && (mFileName == event->name)) {
+            changed = true;
+        }
+        offset += sizeof(struct inotify_event) + event->len;
+    }
+    if (changed) {
+        ALOGI("ConfigWatcherThread %s changed", mFileName.string());
+        mManager->reloadAudioPolicyConfig();
+    }
+    return true;
+}
+
+// --- StateSnapshotThread class implementation
+
+AudioPolicyManagerBase::StateSnapshotThread::StateSnapshotThread()
+    : Thread(false), mSnapshotPending(false)
+{
+}
+
+void AudioPolicyManagerBase::StateSnapshotThread::post(const Vector<uint8_t>& snapshot)
+{
+    android::Mutex::Autolock _l(mLock);
+    mSnapshot = snapshot;
+    mSnapshotPending = true;
+    mWaitWorkCV.signal();
+}
+
+void AudioPolicyManagerBase::StateSnapshotThread::exit()
+{
+    requestExit();
+    {
+        android::Mutex::Autolock _l(mLock);
+        mWaitWorkCV.signal();
+    }
+    requestExitAndWait();
+}
+
+bool AudioPolicyManagerBase::StateSnapshotThread::threadLoop()
+{
+    Vector<uint8_t> snapshot;
+    {
+        android::Mutex::Autolock _l(mLock);
+        if (!mSnapshotPending && !exitPending()) {
+            mWaitWorkCV.wait(mLock);
+        }
+        // wait until no new snapshot is posted for STATE_SNAPSHOT_WRITE_DELAY_MS
+        while (mSnapshotPending && !exitPending() &&
+                (mWaitWorkCV.waitRelative(mLock, milliseconds(STATE_SNAPSHOT_WRITE_DELAY_MS)) ==
+                        NO_ERROR)) {
+        }
+        if (!mSnapshotPending) {
+            return !exitPending();
+        }
+        snapshot = mSnapshot;
+        mSnapshotPending = false;
+    }
+    // the pending snapshot is still written when exiting
+    writeStateSnapshot(snapshot);
+    return !exitPending();
+}
+
+// --- OutputCommand class implementation
+
+AudioPolicyManagerBase::OutputCommand::OutputCommand()
+    : mType(CLOSE_OUTPUT), mOutput(0), mDesc(NULL), mOffloadInfo(AUDIO_INFO_INITIALIZER),
+      mNotifyClosing(false)
+{
+}
+
+// --- OutputCommandThread class implementation
+
+AudioPolicyManagerBase::OutputCommandThread::OutputCommandThread(
+                                                            AudioPolicyManagerBase *manager)
+    : Thread(false), mManager(manager), mCommand(NULL)
+{
+}
+
+void AudioPolicyManagerBase::OutputCommandThread::execute(OutputCommand *command)
+{
+    android::Mutex::Autolock _l(mLock);
+    mCommand = command;
+    mWaitWorkCV.signal();
+}
+
+void AudioPolicyManagerBase::OutputCommandThread::waitIdle()
+{
+    android::Mutex::Autolock _l(mLock);
+    while (mCommand != NULL) {
+        mIdleCV.wait(mLock);
+    }
+}
+
+void AudioPolicyManagerBase::OutputCommandThread::exit()
+{
+    requestExit();
+    {
+        android::Mutex::Autolock _l(mLock);
+        mWaitWorkCV.signal();
+    }
+    requestExitAndWait();
+}
+
+bool AudioPolicyManagerBase::OutputCommandThread::threadLoop()
+{
+    android::Mutex::Autolock _l(mLock);
+    while ((mCommand == NULL) && !exitPending()) {
+        mWaitWorkCV.wait(mLock);
+    }
+    if (mCommand == NULL) {
+        return false;
+    }
+    OutputCommand *command = mCommand;
+    mLock.unlock();
+    mManager->executeOutputCommand(*command);
+    mLock.lock();
+    mCommand = NULL;
+    mIdleCV.broadcast();
+    return true;
+}
+
+// --- RoutingLatencyStats class implementation
+
+AudioPolicyManagerBase::RoutingLatencyStats::RoutingLatencyStats()
+    : mCount(0), mMaxMs(0)
+{
+    memset(mSamples, 0, sizeof(mSamples));
+}
+
+void AudioPolicyManagerBase::RoutingLatencyStats::add(uint32_t latencyMs)
+{
+    mSamples[mCount % ROUTING_LATENCY_HISTORY_SIZE] = latencyMs;
+    mCount++;
+    if (latencyMs > mMaxMs) {
+        mMaxMs = latencyMs;
+    }
+}
+
+static int compareLatency(const void *l1, const void *l2)
+{
+    uint32_t v1 = *(const uint32_t *)l1;
+    uint32_t v2 = *(const uint32_t *)l2;
+    return (v1 < v2) ? -1 : ((v1 > v2) ? 1 : 0);
+}
+
+uint32_t AudioPolicyManagerBase::RoutingLatencyStats::percentile(uint32_t percent) const
+{
+    size_t count = (mCount < ROUTING_LATENCY_HISTORY_SIZE) ? mCount : ROUTING_LATENCY_HISTORY_SIZE;
+    if (count == 0) {
+        return 0;
+    }
+    uint32_t sorted[ROUTING_LATENCY_HISTORY_SIZE];
+    memcpy(sorted, mSamples, count * sizeof(uint32_t));
+    qsort(sorted, count, sizeof(uint32_t), compareLatency);
+    return sorted[((count - 1) * percent) / 100];
+}
+
+void AudioPolicyManagerBase::RoutingLatencyStats::dump(int fd, const char *name) const
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+
+    snprintf(buffer, SIZE, " %-18s %5u %7u %7u %7u\n",
+             name, mCount, percentile(50), percentile(99), mMaxMs);
+    write(fd, buffer, strlen(buffer));
+}
+
+void AudioPolicyManagerBase::RoutingLatencyStats::dumpJson(PolicyDumpBuffer& out,
+                                                           const char *name) const
+{
+    out.appendf("{\"type\":\"routing_command_latency\",\"event\":\"%s\",\"count\":%u,"
+                "\"p50_ms\":%u,\"p99_ms\":%u,\"max_ms\":%u}\n",
+                name, mCount, percentile(50), percentile(99), mMaxMs);
+}
+
+// --- RoutingEventScope class implementation
+
+AudioPolicyManagerBase::RoutingEventScope::RoutingEventScope(AudioPolicyManagerBase *manager,
+                                                             routing_event_type type)
+    : mManager(manager), mOwner(false)
+{
+    if (mManager->mRoutingEventId != 0) {
+        return;
+    }
+    mOwner = true;
+    mManager->mRoutingEventId = mManager->mNextRoutingEventId++;
+    if (mManager->mNextRoutingEventId == 0) {
+        mManager->mNextRoutingEventId = 1;
+    }
+    mManager->mRoutingEventType = type;
+    mManager->mRoutingEventStartTime = mManager->mClock->now();
+    mManager->mRoutingEventLatencyMs = -1;
+    ALOGV("RoutingEventScope() routing event %u type %d started",
+          mManager->mRoutingEventId, type);
+}
+
+AudioPolicyManagerBase::RoutingEventScope::~RoutingEventScope()
+{
+    if (!mOwner) {
+        return;
+    }
+    // events that did not change any route are not counted
+    if (mManager->mRoutingEventLatencyMs >= 0) {
+        ALOGV("~RoutingEventScope() routing event %u latency %d ms",
+              mManager->mRoutingEventId, mManager->mRoutingEventLatencyMs);
+        mManager->mRoutingLatency[mManager->mRoutingEventType].add(
+                (uint32_t)mManager->mRoutingEventLatencyMs);
+    }
+    mManager->mRoutingEventId = 0;
+}
+
+// --- AudioOutputDescriptor class implementation
+
+AudioPolicyManagerBase::AudioOutputDescriptor::AudioOutputDescriptor(
+        const IOProfile *profile)
+    : mId(0), mSamplingRate(0), mFormat((audio_format_t)0),
+      mChannelMask((audio_channel_mask_t)0), mLatency(0),
+    mFlags((audio_output_flags_t)0), mDevice(AUDIO_DEVICE_NONE),
+    mOutput1(0), mOutput2(0), mProfile(profile), mDirectOpenCount(0), mIdleSuspended(false)
+{
+    // clear usage count for all stream types
+    for (int i = 0; i < AudioSystem::NUM_STREAM_TYPES; i++) {
+        mRefCount[i] = 0;
+        mCurVolume[i] = -1.0;
+        mMuteCount[i] = 0;
+        mStopTime[i] = 0;
+    }
+    for (int i = 0; i < NUM_STRATEGIES; i++) {
+        mStrategyMutedByDevice[i] = false;
+    }
+    if (profile != NULL) {
+        mSamplingRate = profile->mSamplingRates[0];
+        mFormat = profile->mFormats[0];
+        mChannelMask = profile->mChannelMasks[0];
+        mFlags = profile->mFlags;
+    }
+}
+
+audio_devices_t AudioPolicyManagerBase::AudioOutputDescriptor::device() const
+{
+    if (isDuplicated()) {
+        return (audio_devices_t)(mOutput1->mDevice | mOutput2->mDevice);
+    } else {
+        return mDevice;
+    }
+}
+
+uint32_t AudioPolicyManagerBase::AudioOutputDescriptor::latency()
+{
+    if (isDuplicated()) {
+        return (mOutput1->mLatency > mOutput2->mLatency) ? mOutput1->mLatency : mOutput2->mLatency;
+    } else {
+        return mLatency;
+    }
+}
+
+bool AudioPolicyManagerBase::AudioOutputDescriptor::sharesHwModuleWith(
+        const AudioOutputDescriptor *outputDesc)
+{
+    if (isDuplicated()) {
+        return mOutput1->sharesHwModuleWith(outputDesc) || mOutput2->sharesHwModuleWith(outputDesc);
+    } else if (outputDesc->isDuplicated()){
+        return sharesHwModuleWith(outputDesc->mOutput1) || sharesHwModuleWith(outputDesc->mOutput2);
+    } else {
+        return (mProfile->mModule == outputDesc->mProfile->mModule);
+    }
+}
+
+void AudioPolicyManagerBase::AudioOutputDescriptor::changeRefCount(AudioSystem::stream_type stream, int delta)
+{
+    // forward usage count change to attached outputs
+    if (isDuplicated()) {
+        mOutput1->changeRefCount(stream, delta);
+        mOutput2->changeRefCount(stream, delta);
+    }
+    if ((delta + (int)mRefCount[stream]) < 0) {
+        ALOGW("changeRefCount() invalid delta %d for stream %d, refCount %d", delta, stream, mRefCount[stream]);
+        mRefCount[stream] = 0;
+        return;
+    }
+    mRefCount[stream] += delta;
+    ALOGV("changeRefCount() stream %d, count %d", stream, mRefCount[stream]);
+}
+
+uint32_t AudioPolicyManagerBase::AudioOutputDescriptor::refCount() const
+{
+    uint32_t refCount = 0;
+    for (int i = 0; i < AudioSystem::NUM_STREAM_TYPES; i++) {
+        refCount += mRefCount[i];
+    }
+    return refCount;
+}
+
+audio_devices_t AudioPolicyManagerBase::AudioOutputDescriptor::supportedDevices()
+{
+    if (isDuplicated()) {
+        return (audio_devices_t)(mOutput1->supportedDevices() | mOutput2->supportedDevices());
+    } else {
+        return mProfile->mSupportedDevices ;
+    }
+}
+
+bool AudioPolicyManagerBase::AudioOutputDescriptor::isActive(uint32_t inPastMs,
+                                                             nsecs_t sysTime) const
+{
+    return isStrategyActive(NUM_STRATEGIES, inPastMs, sysTime);
+}
+
+bool AudioPolicyManagerBase::AudioOutputDescriptor::isStrategyActive(routing_strategy strategy,
+                                                                       uint32_t inPastMs,
+                                                                       nsecs_t sysTime) const
+{
+    if ((sysTime == 0) && (inPastMs != 0)) {
+        sysTime = systemTime();
+    }
+    for (int i = 0; i < AudioSystem::NUM_STREAM_TYPES; i++) {
+        if (((getStrategy((AudioSystem::stream_type)i) == strategy) ||
+                (NUM_STRATEGIES == strategy)) &&
+                isStreamActive((AudioSystem::stream_type)i, inPastMs, sysTime)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool AudioPolicyManagerBase::AudioOutputDescriptor::isStreamActive(AudioSystem::stream_type stream,
+                                                                       uint32_t inPastMs,
+                                                                       nsecs_t sysTime) const
+{
+    if (mRefCount[stream] != 0) {
+        return true;
+    }
+    if (inPastMs == 0) {
+        return false;
+    }
+    if (sysTime == 0) {
+        sysTime = systemTime();
+    }
+    if (ns2ms(sysTime - mStopTime[stream]) < inPastMs) {
+        return true;
+    }
+    return false;
+}
+
+
+status_t AudioPolicyManagerBase::AudioOutputDescriptor::dump(int fd)
 {
     const size_t SIZE = 256;
     char buffer[SIZE];
@@ -3445,6 +5133,10 @@ status_t AudioPolicyManagerBase::AudioOutputDescriptor::dump(int fd)
     result.append(buffer);
     snprintf(buffer, SIZE, " Devices %08x\n", device());
     result.append(buffer);
+    if (mIdleSuspended) {
+        snprintf(buffer, SIZE, " Idle suspended\n");
+        result.append(buffer);
+    }
     snprintf(buffer, SIZE, " Stream volume refCount muteCount\n");
     result.append(buffer);
     for (int i = 0; i < AudioSystem::NUM_STREAM_TYPES; i++) {
@@ -3456,6 +5148,28 @@ status_t AudioPolicyManagerBase::AudioOutputDescriptor::dump(int fd)
     return NO_ERROR;
 }
 
+void AudioPolicyManagerBase::AudioOutputDescriptor::dumpJson(PolicyDumpBuffer& out,
+                                                             audio_io_handle_t id)
+{
+    out.appendf("{\"type\":\"output\",\"id\":%d,\"sampling_rate\":%u,\"format\":%u,"
+                "\"channel_mask\":%u,\"latency\":%u,\"flags\":%u,\"devices\":%u,"
+                "\"duplicated\":%s,\"idle_suspended\":%s,\"volume\":[",
+                id, mSamplingRate, mFormat, mChannelMask, mLatency, mFlags, device(),
+                isDuplicated() ? "true" : "false", mIdleSuspended ? "true" : "false");
+    for (int i = 0; i < AudioSystem::NUM_STREAM_TYPES; i++) {
+        out.appendf("%s%.3f", (i == 0) ? "" : ",", mCurVolume[i]);
+    }
+    out.appendf("],\"ref_count\":[");
+    for (int i = 0; i < AudioSystem::NUM_STREAM_TYPES; i++) {
+        out.appendf("%s%u", (i == 0) ? "" : ",", mRefCount[i]);
+    }
+    out.appendf("],\"mute_count\":[");
+    for (int i = 0; i < AudioSystem::NUM_STREAM_TYPES; i++) {
+        out.appendf("%s%d", (i == 0) ? "" : ",", mMuteCount[i]);
+    }
+    out.appendf("]}\n");
+}
+
 // --- AudioInputDescriptor class implementation
 
 AudioPolicyManagerBase::AudioInputDescriptor::AudioInputDescriptor(const IOProfile *profile)
@@ -3486,22 +5200,46 @@ status_t AudioPolicyManagerBase::AudioInputDescriptor::dump(int fd)
     return NO_ERROR;
 }
 
+void AudioPolicyManagerBase::AudioInputDescriptor::dumpJson(PolicyDumpBuffer& out,
+                                                            audio_io_handle_t id)
+{
+    out.appendf("{\"type\":\"input\",\"id\":%d,\"sampling_rate\":%u,\"format\":%u,"
+                "\"channel_mask\":%u,\"devices\":%u,\"ref_count\":%u,\"source\":%d}\n",
+                id, mSamplingRate, mFormat, mChannelMask, mDevice, mRefCount, mInputSource);
+}
+
 // --- StreamDescriptor class implementation
 
 AudioPolicyManagerBase::StreamDescriptor::StreamDescriptor()
-    :   mIndexMin(0), mIndexMax(1), mCanBeMuted(true)
+    :   mIndexMin(0), mIndexMax(1), mIndexValid(0), mCanBeMuted(true)
 {
-    mIndexCur.add(AUDIO_DEVICE_OUT_DEFAULT, 0);
+    memset(mIndexCur, 0, sizeof(mIndexCur));
+    setVolumeIndex(AUDIO_DEVICE_OUT_DEFAULT, 0);
 }
 
 int AudioPolicyManagerBase::StreamDescriptor::getVolumeIndex(audio_devices_t device)
 {
     device = AudioPolicyManagerBase::getDeviceForVolume(device);
     // there is always a valid entry for AUDIO_DEVICE_OUT_DEFAULT
-    if (mIndexCur.indexOfKey(device) < 0) {
-        device = AUDIO_DEVICE_OUT_DEFAULT;
+    if ((device != AUDIO_DEVICE_NONE) && ((device & (device - 1)) == 0)) {
+        uint32_t slot = __builtin_ctz(device);
+        if (mIndexValid & (1u << slot)) {
+            return mIndexCur[slot];
+        }
     }
-    return mIndexCur.valueFor(device);
+    return mIndexCur[__builtin_ctz(AUDIO_DEVICE_OUT_DEFAULT)];
+}
+
+void AudioPolicyManagerBase::StreamDescriptor::setVolumeIndex(audio_devices_t device, int index)
+{
+    uint32_t slot = __builtin_ctz(device);
+    mIndexCur[slot] = index;
+    mIndexValid |= 1u << slot;
+}
+
+void AudioPolicyManagerBase::StreamDescriptor::clearVolumeIndexes()
+{
+    mIndexValid &= AUDIO_DEVICE_OUT_DEFAULT;
 }
 
 void AudioPolicyManagerBase::StreamDescriptor::dump(int fd)
@@ -3513,10 +5251,11 @@ void AudioPolicyManagerBase::StreamDescriptor::dump(int fd)
     snprintf(buffer, SIZE, "%s         %02d         %02d         ",
              mCanBeMuted ? "true " : "false", mIndexMin, mIndexMax);
     result.append(buffer);
-    for (size_t i = 0; i < mIndexCur.size(); i++) {
+    for (uint32_t valid = mIndexValid; valid != 0; valid &= valid - 1) {
+        uint32_t slot = __builtin_ctz(valid);
         snprintf(buffer, SIZE, "%04x : %02d, ",
-                 mIndexCur.keyAt(i),
-                 mIndexCur.valueAt(i));
+                 1u << slot,
+                 mIndexCur[slot]);
         result.append(buffer);
     }
     result.append("\n");
@@ -3524,6 +5263,18 @@ void AudioPolicyManagerBase::StreamDescriptor::dump(int fd)
     write(fd, result.string(), result.size());
 }
 
+void AudioPolicyManagerBase::StreamDescriptor::dumpJson(PolicyDumpBuffer& out, int stream)
+{
+    out.appendf("{\"type\":\"stream\",\"stream\":%d,\"can_be_muted\":%s,\"index_min\":%d,"
+                "\"index_max\":%d,\"index\":{",
+                stream, mCanBeMuted ? "true" : "false", mIndexMin, mIndexMax);
+    for (uint32_t valid = mIndexValid; valid != 0; valid &= valid - 1) {
+        uint32_t slot = __builtin_ctz(valid);
+        out.appendf("%s\"%u\":%d", (valid == mIndexValid) ? "" : ",", 1u << slot, mIndexCur[slot]);
+    }
+    out.appendf("}}\n");
+}
+
 // --- EffectDescriptor class implementation
 
 status_t AudioPolicyManagerBase::EffectDescriptor::dump(int fd)
@@ -3547,6 +5298,15 @@ status_t AudioPolicyManagerBase::EffectDescriptor::dump(int fd)
     return NO_ERROR;
 }
 
+void AudioPolicyManagerBase::EffectDescriptor::dumpJson(PolicyDumpBuffer& out, int id)
+{
+    out.appendf("{\"type\":\"effect\",\"id\":%d,\"io\":%d,\"strategy\":%d,\"session\":%d,"
+                "\"enabled\":%s,\"name\":",
+                id, mIo, mStrategy, mSession, mEnabled ? "true" : "false");
+    out.appendString(mDesc.name);
+    out.appendf("}\n");
+}
+
 // --- IOProfile class implementation
 
 AudioPolicyManagerBase::HwModule::HwModule(const char *name)
@@ -3594,8 +5354,21 @@ void AudioPolicyManagerBase::HwModule::dump(int fd)
     }
 }
 
+void AudioPolicyManagerBase::HwModule::dumpJson(PolicyDumpBuffer& out)
+{
+    out.appendf("{\"type\":\"module\",\"name\":");
+    out.appendString(mName);
+    out.appendf(",\"handle\":%d}\n", mHandle);
+    for (size_t i = 0; i < mOutputProfiles.size(); i++) {
+        mOutputProfiles[i]->dumpJson(out, "output_profile", i);
+    }
+    for (size_t i = 0; i < mInputProfiles.size(); i++) {
+        mInputProfiles[i]->dumpJson(out, "input_profile", i);
+    }
+}
+
 AudioPolicyManagerBase::IOProfile::IOProfile(HwModule *module)
-    : mFlags((audio_output_flags_t)0), mModule(module)
+    : mFlags((audio_output_flags_t)0), mModule(module), mIdleStandbyMs(0)
 {
 }
 
@@ -3687,10 +5460,36 @@ void AudioPolicyManagerBase::IOProfile::dump(int fd)
     result.append(buffer);
     snprintf(buffer, SIZE, "    - flags: 0x%04x\n", mFlags);
     result.append(buffer);
+    if (mIdleStandbyMs != 0) {
+        snprintf(buffer, SIZE, "    - idle standby: %u ms\n", mIdleStandbyMs);
+        result.append(buffer);
+    }
 
     write(fd, result.string(), result.size());
 }
 
+void AudioPolicyManagerBase::IOProfile::dumpJson(PolicyDumpBuffer& out,
+                                                 const char *type,
+                                                 size_t index)
+{
+    out.appendf("{\"type\":\"%s\",\"module\":", type);
+    out.appendString(mModule->mName);
+    out.appendf(",\"index\":%zu,\"sampling_rates\":[", index);
+    for (size_t i = 0; i < mSamplingRates.size(); i++) {
+        out.appendf("%s%u", (i == 0) ? "" : ",", mSamplingRates[i]);
+    }
+    out.appendf("],\"channel_masks\":[");
+    for (size_t i = 0; i < mChannelMasks.size(); i++) {
+        out.appendf("%s%u", (i == 0) ? "" : ",", mChannelMasks[i]);
+    }
+    out.appendf("],\"formats\":[");
+    for (size_t i = 0; i < mFormats.size(); i++) {
+        out.appendf("%s%u", (i == 0) ? "" : ",", mFormats[i]);
+    }
+    out.appendf("],\"devices\":%u,\"flags\":%u,\"idle_standby_ms\":%u}\n",
+                mSupportedDevices, mFlags, mIdleStandbyMs);
+}
+
 // --- audio_policy.conf file parsing
 
 struct StringToEnum {
@@ -3986,6 +5785,7 @@ status_t AudioPolicyManagerBase::loadInput(cnode *root, HwModule *module)
     cnode *node = root->first_child;
 
     IOProfile *profile = new IOProfile(module);
+    profile->mName = String8(root->name);
 
     while (node) {
         if (strcmp(node->name, SAMPLING_RATES_TAG) == 0) {
@@ -4027,6 +5827,7 @@ status_t AudioPolicyManagerBase::loadOutput(cnode *root, HwModule *module)
     cnode *node = root->first_child;
 
     IOProfile *profile = new IOProfile(module);
+    profile->mName = String8(root->name);
 
     while (node) {
         if (strcmp(node->name, SAMPLING_RATES_TAG) == 0) {
@@ -4039,6 +5840,8 @@ status_t AudioPolicyManagerBase::loadOutput(cnode *root, HwModule *module)
             profile->mSupportedDevices = parseDeviceNames((char *)node->value);
         } else if (strcmp(node->name, FLAGS_TAG) == 0) {
             profile->mFlags = parseFlagNames((char *)node->value);
+        } else if (strcmp(node->name, IDLE_STANDBY_TAG) == 0) {
+            profile->mIdleStandbyMs = (uint32_t)atoi((char *)node->value);
         }
         node = node->next;
     }
@@ -4067,6 +5870,11 @@ status_t AudioPolicyManagerBase::loadOutput(cnode *root, HwModule *module)
 }
 
 void AudioPolicyManagerBase::loadHwModule(cnode *root)
+{
+    loadHwModule(root, mHwModules);
+}
+
+void AudioPolicyManagerBase::loadHwModule(cnode *root, Vector <HwModule *>& modules)
 {
     cnode *node = config_find(root, OUTPUTS_TAG);
     status_t status = NAME_NOT_FOUND;
@@ -4105,13 +5913,18 @@ void AudioPolicyManagerBase::loadHwModule(cnode *root)
         }
     }
     if (status == NO_ERROR) {
-        mHwModules.add(module);
+        modules.add(module);
     } else {
         delete module;
     }
 }
 
 void AudioPolicyManagerBase::loadHwModules(cnode *root)
+{
+    loadHwModules(root, mHwModules);
+}
+
+void AudioPolicyManagerBase::loadHwModules(cnode *root, Vector <HwModule *>& modules)
 {
     cnode *node = config_find(root, AUDIO_HW_MODULE_TAG);
     if (node == NULL) {
@@ -4121,7 +5934,7 @@ void AudioPolicyManagerBase::loadHwModules(cnode *root)
     node = node->first_child;
     while (node) {
         ALOGV("loadHwModules() loading module %s", node->name);
-        loadHwModule(node);
+        loadHwModule(node, modules);
         node = node->next;
     }
 }
@@ -4177,7 +5990,261 @@ status_t AudioPolicyManagerBase::loadAudioPolicyConfig(const char *path)
     free(data);
 
     ALOGI("loadAudioPolicyConfig() loaded %s\n", path);
+    mConfigFile = String8(path);
+
+    return NO_ERROR;
+}
+
+// replaces values read from audio_policy.conf. Returns true if they changed.
+// Dynamic values already read from an opened stream are kept if the values are still dynamic.
+template <typename T>
+static bool reloadProfileValues(Vector <T>& values, const Vector <T>& newValues)
+{
+    if ((values[0] == 0) && (newValues.size() == 1) && (newValues[0] == 0)) {
+        return false;
+    }
+    if (values.size() == newValues.size()) {
+        size_t i;
+        for (i = 0; i < values.size(); i++) {
+            if (values[i] != newValues[i]) {
+                break;
+            }
+        }
+        if (i == values.size()) {
+            return false;
+        }
+    }
+    values = newValues;
+    return true;
+}
+
+bool AudioPolicyManagerBase::isProfileInUse(const IOProfile *profile)
+{
+    for (size_t i = 0; i < mOutputs.size(); i++) {
+        if (mOutputs.valueAt(i)->mProfile == profile) {
+            return true;
+        }
+    }
+    for (size_t i = 0; i < mInputs.size(); i++) {
+        if (mInputs.valueAt(i)->mProfile == profile) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool AudioPolicyManagerBase::reloadProfiles(HwModule *module,
+                                            Vector <IOProfile *>& profiles,
+                                            Vector <IOProfile *>& newProfiles,
+                                            SortedVector <const IOProfile *>& changedProfiles)
+{
+    bool devicesChanged = false;
+
+    // remove profiles not present any more, unless a stream is still opened from them
+    for (size_t i = 0; i < profiles.size(); ) {
+        IOProfile *profile = profiles[i];
+        size_t j;
+        for (j = 0; j < newProfiles.size(); j++) {
+            if (newProfiles[j]->mName == profile->mName) {
+                break;
+            }
+        }
+        if (j != newProfiles.size()) {
+            i++;
+            continue;
+        }
+        if (isProfileInUse(profile)) {
+            ALOGW("reloadProfiles() module %s profile %s removed but in use, kept",
+                  module->mName, profile->mName.string());
+            i++;
+            continue;
+        }
+        ALOGV("reloadProfiles() module %s removing profile %s",
+              module->mName, profile->mName.string());
+        delete profile;
+        profiles.removeAt(i);
+        devicesChanged = true;
+    }
+
+    // update existing profiles in place so that descriptors keep pointing to them,
+    // and take ownership of new ones
+    for (size_t i = 0; i < newProfiles.size(); ) {
+        IOProfile *newProfile = newProfiles[i];
+        IOProfile *profile = NULL;
+        for (size_t j = 0; j < profiles.size(); j++) {
+            if (profiles[j]->mName == newProfile->mName) {
+                profile = profiles[j];
+                break;
+            }
+        }
+        if (profile == NULL) {
+            ALOGV("reloadProfiles() module %s adding profile %s",
+                  module->mName, newProfile->mName.string());
+            newProfile->mModule = module;
+            profiles.add(newProfile);
+            newProfiles.removeAt(i);
+            devicesChanged = true;
+            continue;
+        }
+        bool configChanged = reloadProfileValues(profile->mSamplingRates,
+                                                 newProfile->mSamplingRates);
+        configChanged = reloadProfileValues(profile->mFormats, newProfile->mFormats) ||
+                configChanged;
+        configChanged = reloadProfileValues(profile->mChannelMasks, newProfile->mChannelMasks) ||
+                configChanged;
+        if (profile->mFlags != newProfile->mFlags) {
+            profile->mFlags = newProfile->mFlags;
+            configChanged = true;
+        }
+        if (profile->mSupportedDevices != newProfile->mSupportedDevices) {
+            profile->mSupportedDevices = newProfile->mSupportedDevices;
+            devicesChanged = true;
+        }
+        profile->mIdleStandbyMs = newProfile->mIdleStandbyMs;
+        if (configChanged) {
+            ALOGV("reloadProfiles() module %s profile %s configuration changed",
+                  module->mName, profile->mName.string());
+            changedProfiles.add(profile);
+        }
+        i++;
+    }
+    return devicesChanged;
+}
+
+void AudioPolicyManagerBase::reopenOutput(audio_io_handle_t output)
+{
+    AudioOutputDescriptor *desc = mOutputs.valueFor(output);
+    const IOProfile *profile = desc->mProfile;
+    audio_devices_t device = desc->mDevice;
+
+    ALOGV("reopenOutput() output %d", output);
+    closeOutput(output);
+
+    AudioOutputDescriptor *outputDesc = new AudioOutputDescriptor(profile);
+    outputDesc->mDevice = (audio_devices_t)(device & profile->mSupportedDevices);
+    if (outputDesc->mDevice == AUDIO_DEVICE_NONE) {
+        outputDesc->mDevice = (audio_devices_t)(mDefaultOutputDevice & profile->mSupportedDevices);
+    }
+    output = mpClientInterface->openOutput(profile->mModule->mHandle,
+                                           &outputDesc->mDevice,
+                                           &outputDesc->mSamplingRate,
+                                           &outputDesc->mFormat,
+                                           &outputDesc->mChannelMask,
+                                           &outputDesc->mLatency,
+                                           outputDesc->mFlags);
+    if (output == 0) {
+        ALOGE("reopenOutput() could not open output for profile %s", profile->mName.string());
+        delete outputDesc;
+        return;
+    }
+    addOutput(output, outputDesc);
+}
+
+status_t AudioPolicyManagerBase::reloadAudioPolicyConfig()
+{
+    PolicyAutolock _l(this, LOCK_ALL);
+    Vector <HwModule *> modules;
+    const char *path = AUDIO_POLICY_VENDOR_CONFIG_FILE;
+    char *data = (char *)load_file(path, NULL);
+
+    if (data == NULL) {
+        path = AUDIO_POLICY_CONFIG_FILE;
+        data = (char *)load_file(path, NULL);
+        if (data == NULL) {
+            ALOGW("reloadAudioPolicyConfig() could not load audio policy configuration file");
+            return -ENODEV;
+        }
+    }
+    cnode *root = config_node("", "");
+    config_load(root, data);
+    loadHwModules(root, modules);
+    config_free(root);
+    free(root);
+    free(data);
+    ALOGI("reloadAudioPolicyConfig() reloading %s", path);
+
+    SortedVector <const IOProfile *> changedProfiles;
+    bool devicesChanged = false;
+    for (size_t i = 0; i < modules.size(); i++) {
+        HwModule *module = NULL;
+        for (size_t j = 0; j < mHwModules.size(); j++) {
+            if (strcmp(mHwModules[j]->mName, modules[i]->mName) == 0) {
+                module = mHwModules[j];
+                break;
+            }
+        }
+        if (module == NULL) {
+            ALOGW("reloadAudioPolicyConfig() new module %s ignored until restart",
+                  modules[i]->mName);
+            continue;
+        }
+        devicesChanged = reloadProfiles(module, module->mOutputProfiles,
+                                        modules[i]->mOutputProfiles, changedProfiles) ||
+                devicesChanged;
+        devicesChanged = reloadProfiles(module, module->mInputProfiles,
+                                        modules[i]->mInputProfiles, changedProfiles) ||
+                devicesChanged;
+    }
+    for (size_t i = 0; i < modules.size(); i++) {
+        delete modules[i];
+    }
+    startIdleStandbyIfNeeded();
+
+    // reopen idle outputs whose profile changed. The primary output, outputs used by a stream
+    // or recently stopped, direct outputs in use and outputs duplicated to another output keep
+    // their configuration.
+    nsecs_t sysTime = mClock->now();
+    SortedVector <audio_io_handle_t> reopenOutputs;
+    for (size_t i = 0; i < mOutputs.size(); i++) {
+        AudioOutputDescriptor *desc = mOutputs.valueAt(i);
+        if (desc->isDuplicated() || (changedProfiles.indexOf(desc->mProfile) < 0)) {
+            continue;
+        }
+        bool duplicated = false;
+        for (size_t j = 0; j < mOutputs.size(); j++) {
+            AudioOutputDescriptor *dupDesc = mOutputs.valueAt(j);
+            if (dupDesc->isDuplicated() &&
+                    (dupDesc->mOutput1 == desc || dupDesc->mOutput2 == desc)) {
+                duplicated = true;
+                break;
+            }
+        }
+        if ((mOutputs.keyAt(i) == mPrimaryOutput) || (desc->refCount() != 0) ||
+                desc->isActive(RELOAD_CONFIG_RECENT_USE_MS, sysTime) ||
+                (desc->mDirectOpenCount != 0) || duplicated) {
+            ALOGW("reloadAudioPolicyConfig() output %d in use, keeps its configuration",
+                  mOutputs.keyAt(i));
+            continue;
+        }
+        reopenOutputs.add(mOutputs.keyAt(i));
+    }
+
+    if (!devicesChanged && reopenOutputs.isEmpty()) {
+        return NO_ERROR;
+    }
+    mPreviousOutputs = mOutputs;
+    for (size_t i = 0; i < reopenOutputs.size(); i++) {
+        reopenOutput(reopenOutputs[i]);
+    }
 
+    // open the outputs of added profiles or of profiles now supporting a connected device
+    SortedVector <audio_io_handle_t> outputs;
+    if (devicesChanged) {
+        for (uint32_t bit = 1; bit != 0; bit <<= 1) {
+            audio_devices_t device = (audio_devices_t)bit;
+            if (!(mAvailableOutputDevices & device)) {
+                continue;
+            }
+            const char *address = "";
+            if (audio_is_a2dp_device(device)) {
+                address = mA2dpDeviceAddress.string();
+            } else if (audio_is_usb_device(device)) {
+                address = mUsbCardAndDevice.string();
+            }
+            checkOutputsForDevice(device, AudioSystem::DEVICE_STATE_AVAILABLE, outputs, address);
+        }
+    }
+    applyOutputDeviceConnection(outputs);
     return NO_ERROR;
 }
 
@@ -0,0 +1,410 @@
+/*
+**
+** Copyright 2011, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#define LOG_TAG "LegacyFormatConverter"
+//#define LOG_NDEBUG 0
+
+#include <string.h>
+
+#if defined(LEGACY_AUDIO_SCALAR_KERNELS)
+// SIMD kernels disabled by the build, see Android.mk
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CONVERTER_USE_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define CONVERTER_USE_SSE2
+#endif
+
+#include <utils/Log.h>
+
+#include "LegacyFormatConverter.h"
+
+namespace android_audio_legacy {
+
+// ----------------------------------------------------------------------------
+
+static inline int16_t clamp16(int32_t sample)
+{
+    if ((sample >> 15) ^ (sample >> 31)) {
+        sample = 0x7FFF ^ (sample >> 31);
+    }
+    return sample;
+}
+
+// Each kernel converts count samples. The vector loops handle 8 samples per iteration and
+// leave the remainder to the scalar loop, which defines the exact result.
+
+static void floatToInt16(const float *in, int16_t *out, size_t count)
+{
+    size_t i = 0;
+#if defined(CONVERTER_USE_NEON)
+    for (; i + 8 <= count; i += 8) {
+        // vcvtq_s32_f32 truncates and saturates like the scalar loop
+        int32x4_t lo = vcvtq_s32_f32(vmulq_n_f32(vld1q_f32(in + i), 32768.0f));
+        int32x4_t hi = vcvtq_s32_f32(vmulq_n_f32(vld1q_f32(in + i + 4), 32768.0f));
+        vst1q_s16(out + i, vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi)));
+    }
+#elif defined(CONVERTER_USE_SSE2)
+    const __m128 scale = _mm_set1_ps(32768.0f);
+    const __m128 max = _mm_set1_ps(32767.0f);
+    const __m128 min = _mm_set1_ps(-32768.0f);
+    for (; i + 8 <= count; i += 8) {
+        __m128 lo = _mm_mul_ps(_mm_loadu_ps(in + i), scale);
+        __m128 hi = _mm_mul_ps(_mm_loadu_ps(in + i + 4), scale);
+        // clamp before the conversion, which does not saturate
+        lo = _mm_max_ps(_mm_min_ps(lo, max), min);
+        hi = _mm_max_ps(_mm_min_ps(hi, max), min);
+        __m128i packed = _mm_packs_epi32(_mm_cvttps_epi32(lo), _mm_cvttps_epi32(hi));
+        _mm_storeu_si128((__m128i *)(out + i), packed);
+    }
+#endif
+    for (; i < count; i++) {
+        float sample = in[i] * 32768.0f;
+        if (sample >= 32767.0f) {
+            out[i] = 32767;
+        } else if (sample <= -32768.0f) {
+            out[i] = -32768;
+        } else {
+            out[i] = (int16_t)sample;
+        }
+    }
+}
+
+static void int16ToFloat(const int16_t *in, float *out, size_t count)
+{
+    const float scale = 1.0f / 32768.0f;
+    size_t i = 0;
+#if defined(CONVERTER_USE_NEON)
+    for (; i + 8 <= count; i += 8) {
+        int16x8_t samples = vld1q_s16(in + i);
+        vst1q_f32(out + i, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(samples))), scale));
+        vst1q_f32(out + i + 4,
+                  vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(samples))), scale));
+    }
+#elif defined(CONVERTER_USE_SSE2)
+    const __m128 vscale = _mm_set1_ps(scale);
+    for (; i + 8 <= count; i += 8) {
+        __m128i samples = _mm_loadu_si128((const __m128i *)(in + i));
+        // sign extend by placing each sample in the upper half of a 32 bit lane
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16);
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), vscale));
+        _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), vscale));
+    }
+#endif
+    for (; i < count; i++) {
+        out[i] = in[i] * scale;
+    }
+}
+
+// 32 bit containers to 16 bit: Q8.23 is shifted by 8 and saturated, Q31 is shifted by 16
+static void int32ToInt16(const int32_t *in, int16_t *out, size_t count, int shift)
+{
+    size_t i = 0;
+#if defined(CONVERTER_USE_NEON)
+    if (shift == 8) {
+        for (; i + 8 <= count; i += 8) {
+            int16x4_t lo = vqshrn_n_s32(vld1q_s32(in + i), 8);
+            int16x4_t hi = vqshrn_n_s32(vld1q_s32(in + i + 4), 8);
+            vst1q_s16(out + i, vcombine_s16(lo, hi));
+        }
+    } else {
+        for (; i + 8 <= count; i += 8) {
+            int16x4_t lo = vshrn_n_s32(vld1q_s32(in + i), 16);
+            int16x4_t hi = vshrn_n_s32(vld1q_s32(in + i + 4), 16);
+            vst1q_s16(out + i, vcombine_s16(lo, hi));
+        }
+    }
+#elif defined(CONVERTER_USE_SSE2)
+    const __m128i vshift = _mm_cvtsi32_si128(shift);
+    for (; i + 8 <= count; i += 8) {
+        __m128i lo = _mm_sra_epi32(_mm_loadu_si128((const __m128i *)(in + i)), vshift);
+        __m128i hi = _mm_sra_epi32(_mm_loadu_si128((const __m128i *)(in + i + 4)), vshift);
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(lo, hi));
+    }
+#endif
+    for (; i < count; i++) {
+        out[i] = clamp16(in[i] >> shift);
+    }
+}
+
+static void int16ToInt32(const int16_t *in, int32_t *out, size_t count, int shift)
+{
+    for (size_t i = 0; i < count; i++) {
+        out[i] = (int32_t)in[i] << shift;
+    }
+}
+
+// keeps the two most significant bytes of each little endian 24 bit sample
+static void packed24ToInt16(const uint8_t *in, int16_t *out, size_t count)
+{
+    size_t i = 0;
+#if defined(CONVERTER_USE_NEON)
+    for (; i + 16 <= count; i += 16) {
+        uint8x16x3_t bytes = vld3q_u8(in + 3 * i);
+        uint8x16x2_t samples = vzipq_u8(bytes.val[1], bytes.val[2]);
+        vst1q_u8((uint8_t *)(out + i), samples.val[0]);
+        vst1q_u8((uint8_t *)(out + i + 8), samples.val[1]);
+    }
+#endif
+    for (; i < count; i++) {
+        out[i] = (int16_t)(in[3 * i + 1] | (in[3 * i + 2] << 8));
+    }
+}
+
+static void int16ToPacked24(const int16_t *in, uint8_t *out, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        out[3 * i] = 0;
+        out[3 * i + 1] = (uint8_t)in[i];
+        out[3 * i + 2] = (uint8_t)((uint16_t)in[i] >> 8);
+    }
+}
+
+static void monoToStereo(const int16_t *in, int16_t *out, size_t frames)
+{
+    size_t i = 0;
+#if defined(CONVERTER_USE_NEON)
+    for (; i + 8 <= frames; i += 8) {
+        int16x8x2_t stereo;
+        stereo.val[0] = stereo.val[1] = vld1q_s16(in + i);
+        vst2q_s16(out + 2 * i, stereo);
+    }
+#elif defined(CONVERTER_USE_SSE2)
+    for (; i + 8 <= frames; i += 8) {
+        __m128i mono = _mm_loadu_si128((const __m128i *)(in + i));
+        _mm_storeu_si128((__m128i *)(out + 2 * i), _mm_unpacklo_epi16(mono, mono));
+        _mm_storeu_si128((__m128i *)(out + 2 * i + 8), _mm_unpackhi_epi16(mono, mono));
+    }
+#endif
+    for (; i < frames; i++) {
+        out[2 * i] = out[2 * i + 1] = in[i];
+    }
+}
+
+// average of both channels, rounded towards minus infinity
+static void stereoToMono(const int16_t *in, int16_t *out, size_t frames)
+{
+    size_t i = 0;
+#if defined(CONVERTER_USE_NEON)
+    for (; i + 8 <= frames; i += 8) {
+        int16x8x2_t stereo = vld2q_s16(in + 2 * i);
+        vst1q_s16(out + i, vhaddq_s16(stereo.val[0], stereo.val[1]));
+    }
+#elif defined(CONVERTER_USE_SSE2)
+    const __m128i ones = _mm_set1_epi16(1);
+    for (; i + 8 <= frames; i += 8) {
+        // left + right of each frame in a 32 bit lane
+        __m128i lo = _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(in + 2 * i)), ones);
+        __m128i hi = _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(in + 2 * i + 8)), ones);
+        lo = _mm_srai_epi32(lo, 1);
+        hi = _mm_srai_epi32(hi, 1);
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(lo, hi));
+    }
+#endif
+    for (; i < frames; i++) {
+        out[i] = (int16_t)(((int32_t)in[2 * i] + in[2 * i + 1]) >> 1);
+    }
+}
+
+// 5.1 (FL FR FC LFE BL BR) or 7.1 (... SL SR) to stereo. The center and surround channels
+// are mixed at -3 dB, the low frequency channel is dropped, and the result is scaled by
+// 1 / (1 + 0.7071 * number of mixed channels) so that full scale inputs cannot clip.
+// Q15 gains of the front and of the -3 dB channels, for 5.1 and 7.1
+static const int32_t kDownmixGains[2][2] = {
+    { 13573, 9598 },    // 5.1
+    { 10498, 7423 },    // 7.1
+};
+
+static void downmixToStereo(const int16_t *in, int16_t *out, size_t frames,
+                            uint32_t channelCount)
+{
+    const int32_t front = kDownmixGains[channelCount == 8][0];
+    const int32_t mixed = kDownmixGains[channelCount == 8][1];
+
+    for (size_t i = 0; i < frames; i++, in += channelCount) {
+        int32_t center = in[2] * mixed;
+        int32_t left = in[0] * front + center + in[4] * mixed;
+        int32_t right = in[1] * front + center + in[5] * mixed;
+        if (channelCount == 8) {
+            left += in[6] * mixed;
+            right += in[7] * mixed;
+        }
+        out[2 * i] = clamp16(left >> 15);
+        out[2 * i + 1] = clamp16(right >> 15);
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+LegacyFormatConverter *LegacyFormatConverter::create(sample_format inFormat,
+                                                     uint32_t inChannelCount,
+                                                     sample_format outFormat,
+                                                     uint32_t outChannelCount,
+                                                     size_t maxFrames)
+{
+    if (!isSupported(inFormat, inChannelCount, outFormat, outChannelCount) || maxFrames == 0) {
+        ALOGW("create() cannot convert format %d, %u channels to format %d, %u channels",
+                inFormat, inChannelCount, outFormat, outChannelCount);
+        return NULL;
+    }
+    LegacyFormatConverter *converter = new LegacyFormatConverter();
+    converter->mInFormat = inFormat;
+    converter->mOutFormat = outFormat;
+    converter->mInChannelCount = inChannelCount;
+    converter->mOutChannelCount = outChannelCount;
+    converter->mInFrameSize = sampleSize(inFormat) * inChannelCount;
+    converter->mOutFrameSize = sampleSize(outFormat) * outChannelCount;
+    converter->mMaxFrames = maxFrames;
+    // the channels are converted on 16 bit samples between the two sample format steps
+    if (inFormat != outFormat && inChannelCount != outChannelCount) {
+        uint32_t channelCount = inChannelCount > outChannelCount ?
+                inChannelCount : outChannelCount;
+        converter->mScratch = new int16_t[maxFrames * channelCount];
+    }
+    ALOGV("create() format %d, %u channels -> format %d, %u channels",
+            inFormat, inChannelCount, outFormat, outChannelCount);
+    return converter;
+}
+
+LegacyFormatConverter::LegacyFormatConverter()
+    : mInFormat(SAMPLE_FORMAT_INVALID), mOutFormat(SAMPLE_FORMAT_INVALID),
+      mInChannelCount(0), mOutChannelCount(0), mInFrameSize(0), mOutFrameSize(0),
+      mMaxFrames(0), mScratch(NULL)
+{
+}
+
+LegacyFormatConverter::~LegacyFormatConverter()
+{
+    delete[] mScratch;
+}
+
+size_t LegacyFormatConverter::sampleSize(sample_format format)
+{
+    switch (format) {
+    case SAMPLE_FORMAT_INT16:
+        return sizeof(int16_t);
+    case SAMPLE_FORMAT_Q8_23:
+    case SAMPLE_FORMAT_Q31:
+        return sizeof(int32_t);
+    case SAMPLE_FORMAT_FLOAT:
+        return sizeof(float);
+    case SAMPLE_FORMAT_PACKED_24:
+        return 3;
+    default:
+        return 0;
+    }
+}
+
+bool LegacyFormatConverter::isSupported(sample_format inFormat, uint32_t inChannelCount,
+                                        sample_format outFormat, uint32_t outChannelCount)
+{
+    if (sampleSize(inFormat) == 0 || sampleSize(outFormat) == 0) {
+        return false;
+    }
+    if (inFormat != SAMPLE_FORMAT_INT16 && outFormat != SAMPLE_FORMAT_INT16) {
+        return false;
+    }
+    if (inChannelCount == outChannelCount) {
+        return inChannelCount != 0;
+    }
+    if ((inChannelCount == 1 && outChannelCount == 2) ||
+            (inChannelCount == 2 && outChannelCount == 1)) {
+        return true;
+    }
+    return (inChannelCount == 6 || inChannelCount == 8) && outChannelCount == 2;
+}
+
+void LegacyFormatConverter::convertChannels(const int16_t *in, int16_t *out, size_t frames)
+{
+    if (mInChannelCount == mOutChannelCount) {
+        memcpy(out, in, frames * mInChannelCount * sizeof(int16_t));
+    } else if (mInChannelCount == 1) {
+        monoToStereo(in, out, frames);
+    } else if (mInChannelCount == 2) {
+        stereoToMono(in, out, frames);
+    } else {
+        downmixToStereo(in, out, frames, mInChannelCount);
+    }
+}
+
+void LegacyFormatConverter::convert(const void *in, void *out, size_t frames)
+{
+    if (frames > mMaxFrames) {
+        ALOGW("convert() %zu frames, max %zu", frames, mMaxFrames);
+        frames = mMaxFrames;
+    }
+
+    if (mInFormat != SAMPLE_FORMAT_INT16) {
+        // to 16 bit first, then to the output channels
+        int16_t *dst = mScratch ? mScratch : (int16_t *)out;
+        size_t count = frames * mInChannelCount;
+        switch (mInFormat) {
+        case SAMPLE_FORMAT_FLOAT:
+            floatToInt16((const float *)in, dst, count);
+            break;
+        case SAMPLE_FORMAT_Q8_23:
+            int32ToInt16((const int32_t *)in, dst, count, 8);
+            break;
+        case SAMPLE_FORMAT_Q31:
+            int32ToInt16((const int32_t *)in, dst, count, 16);
+            break;
+        case SAMPLE_FORMAT_PACKED_24:
+            packed24ToInt16((const uint8_t *)in, dst, count);
+            break;
+        default:
+            break;
+        }
+        if (mScratch) {
+            convertChannels(mScratch, (int16_t *)out, frames);
+        }
+        return;
+    }
+
+    // from 16 bit: to the output channels first, then to the output format
+    const int16_t *src = (const int16_t *)in;
+    if (mOutFormat == SAMPLE_FORMAT_INT16) {
+        convertChannels(src, (int16_t *)out, frames);
+        return;
+    }
+    if (mScratch) {
+        convertChannels(src, mScratch, frames);
+        src = mScratch;
+    }
+    size_t count = frames * mOutChannelCount;
+    switch (mOutFormat) {
+    case SAMPLE_FORMAT_FLOAT:
+        int16ToFloat(src, (float *)out, count);
+        break;
+    case SAMPLE_FORMAT_Q8_23:
+        int16ToInt32(src, (int32_t *)out, count, 8);
+        break;
+    case SAMPLE_FORMAT_Q31:
+        int16ToInt32(src, (int32_t *)out, count, 16);
+        break;
+    case SAMPLE_FORMAT_PACKED_24:
+        int16ToPacked24(src, (uint8_t *)out, count);
+        break;
+    default:
+        break;
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+}; // namespace android_audio_legacy
@@ -0,0 +1,84 @@
+/*
+**
+** Copyright 2011, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef ANDROID_LEGACY_FORMAT_CONVERTER_H
+#define ANDROID_LEGACY_FORMAT_CONVERTER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+namespace android_audio_legacy {
+
+// ----------------------------------------------------------------------------
+
+/**
+ * LegacyFormatConverter converts interleaved PCM between the sample format and channel
+ * layout seen by the framework and the 16 bit mono or stereo PCM most legacy HALs accept.
+ * One side of the conversion is always 16 bit. Channels are converted on 16 bit samples:
+ * mono to stereo, stereo to mono, and 5.1 or 7.1 to stereo. The sample format and
+ * mono/stereo kernels use NEON or SSE2 when available.
+ * All allocations are made by create().
+ */
+class LegacyFormatConverter
+{
+public:
+    enum sample_format {
+        SAMPLE_FORMAT_INVALID,
+        SAMPLE_FORMAT_INT16,        // AUDIO_FORMAT_PCM_16_BIT
+        SAMPLE_FORMAT_Q8_23,        // AUDIO_FORMAT_PCM_8_24_BIT: 24 bit in 32 bit containers
+        SAMPLE_FORMAT_Q31,          // AUDIO_FORMAT_PCM_32_BIT
+        SAMPLE_FORMAT_FLOAT,        // [-1.0, 1.0]
+        SAMPLE_FORMAT_PACKED_24,    // 3 bytes per sample, little endian
+    };
+
+    // returns NULL if the conversion is not supported
+    static  LegacyFormatConverter *create(sample_format inFormat, uint32_t inChannelCount,
+                                          sample_format outFormat, uint32_t outChannelCount,
+                                          size_t maxFrames);
+                        ~LegacyFormatConverter();
+
+    // converts frames, at most maxFrames, from in to out
+            void        convert(const void *in, void *out, size_t frames);
+
+            size_t      inFrameSize() const { return mInFrameSize; }
+            size_t      outFrameSize() const { return mOutFrameSize; }
+            size_t      maxFrames() const { return mMaxFrames; }
+
+    static  size_t      sampleSize(sample_format format);
+    static  bool        isSupported(sample_format inFormat, uint32_t inChannelCount,
+                                    sample_format outFormat, uint32_t outChannelCount);
+
+private:
+                        LegacyFormatConverter();
+                        LegacyFormatConverter(const LegacyFormatConverter &);
+            LegacyFormatConverter& operator = (const LegacyFormatConverter&);
+
+            void        convertChannels(const int16_t *in, int16_t *out, size_t frames);
+
+    sample_format   mInFormat;
+    sample_format   mOutFormat;
+    uint32_t        mInChannelCount;
+    uint32_t        mOutChannelCount;
+    size_t          mInFrameSize;
+    size_t          mOutFrameSize;
+    size_t          mMaxFrames;
+    int16_t         *mScratch;      // 16 bit samples between the two steps, NULL if unused
+};
+
+}; // namespace android_audio_legacy
+
+#endif // ANDROID_LEGACY_FORMAT_CONVERTER_H
@@ -0,0 +1,319 @@
+/*
+**
+** Copyright 2011, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#define LOG_TAG "LegacyResampler"
+//#define LOG_NDEBUG 0
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(LEGACY_AUDIO_SCALAR_KERNELS)
+// SIMD kernels disabled by the build, see Android.mk
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define RESAMPLER_USE_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define RESAMPLER_USE_SSE2
+#endif
+
+#include <utils/Log.h>
+
+#include "LegacyResampler.h"
+
+namespace android_audio_legacy {
+
+// ----------------------------------------------------------------------------
+
+// limits the coefficient table to MAX_PHASES * MAX_TAPS * sizeof(int16_t) bytes
+#define MAX_PHASES 1024
+#define MAX_TAPS 128
+// input frames buffered in addition to the filter length
+#define HISTORY_BLOCK_FRAMES 256
+
+static const struct {
+    size_t taps;
+    double beta;        // Kaiser window parameter
+    double rolloff;     // cutoff frequency relative to the lower Nyquist frequency
+} kQualities[] = {
+    {  8, 5.0, 0.85 },  // LOW_QUALITY
+    { 16, 7.0, 0.90 },  // MEDIUM_QUALITY
+    { 32, 9.0, 0.94 },  // HIGH_QUALITY
+};
+
+static uint32_t gcd(uint32_t a, uint32_t b)
+{
+    while (b != 0) {
+        uint32_t r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+// zeroth order modified Bessel function of the first kind
+static double besselI0(double x)
+{
+    double sum = 1.0;
+    double term = 1.0;
+    for (int k = 1; k < 32; k++) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+        if (term < sum * 1e-12) {
+            break;
+        }
+    }
+    return sum;
+}
+
+// Q15 dot product of n samples, n being a multiple of 8
+static inline int32_t dotProduct(const int16_t *x, const int16_t *h, size_t n)
+{
+#if defined(RESAMPLER_USE_NEON)
+    int32x4_t acc = vdupq_n_s32(0);
+    for (size_t i = 0; i < n; i += 8) {
+        acc = vmlal_s16(acc, vld1_s16(x + i), vld1_s16(h + i));
+        acc = vmlal_s16(acc, vld1_s16(x + i + 4), vld1_s16(h + i + 4));
+    }
+    int32x2_t sum = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+    sum = vpadd_s32(sum, sum);
+    return vget_lane_s32(sum, 0);
+#elif defined(RESAMPLER_USE_SSE2)
+    __m128i acc = _mm_setzero_si128();
+    for (size_t i = 0; i < n; i += 8) {
+        __m128i xv = _mm_loadu_si128((const __m128i *)(x + i));
+        __m128i hv = _mm_loadu_si128((const __m128i *)(h + i));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(xv, hv));
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(acc);
+#else
+    int32_t acc = 0;
+    for (size_t i = 0; i < n; i++) {
+        acc += (int32_t)x[i] * h[i];
+    }
+    return acc;
+#endif
+}
+
+static inline int16_t clamp16(int32_t sample)
+{
+    if ((sample >> 15) ^ (sample >> 31)) {
+        sample = 0x7FFF ^ (sample >> 31);
+    }
+    return sample;
+}
+
+// ----------------------------------------------------------------------------
+
+LegacyResampler *LegacyResampler::create(uint32_t inRate, uint32_t outRate,
+                                         uint32_t channelCount, quality q)
+{
+    LegacyResampler *resampler = new LegacyResampler();
+    if (!resampler->init(inRate, outRate, channelCount, q)) {
+        delete resampler;
+        return NULL;
+    }
+    return resampler;
+}
+
+LegacyResampler::LegacyResampler()
+    : mInRate(0), mOutRate(0), mChannelCount(0), mInterpolation(1), mDecimation(1),
+      mTaps(0), mCoefs(NULL), mHistory(NULL), mCapacity(0), mFrames(0), mIndex(0), mPhase(0)
+{
+}
+
+LegacyResampler::~LegacyResampler()
+{
+    delete[] mCoefs;
+    delete[] mHistory;
+}
+
+bool LegacyResampler::init(uint32_t inRate, uint32_t outRate, uint32_t channelCount,
+                           quality q)
+{
+    if (inRate == 0 || outRate == 0 || channelCount == 0 || channelCount > 2 ||
+            q < LOW_QUALITY || q > HIGH_QUALITY) {
+        return false;
+    }
+    uint32_t divisor = gcd(inRate, outRate);
+    mInterpolation = outRate / divisor;
+    mDecimation = inRate / divisor;
+    if (mInterpolation > MAX_PHASES) {
+        ALOGW("create() cannot convert %u Hz to %u Hz: %u phases",
+                inRate, outRate, mInterpolation);
+        return false;
+    }
+    mInRate = inRate;
+    mOutRate = outRate;
+    mChannelCount = channelCount;
+
+    // when decimating, the filter must span as many output samples as when interpolating
+    mTaps = kQualities[q].taps;
+    if (mDecimation > mInterpolation) {
+        mTaps = (mTaps * mDecimation + mInterpolation - 1) / mInterpolation;
+        mTaps = (mTaps + 7) & ~7;
+        if (mTaps > MAX_TAPS) {
+            mTaps = MAX_TAPS;
+        }
+    }
+
+    // windowed sinc prototype at L times the input rate, cut off below the lower of the
+    // two Nyquist frequencies
+    size_t length = mTaps * mInterpolation;
+    double cutoff = kQualities[q].rolloff * 0.5 /
+            (mInterpolation > mDecimation ? mInterpolation : mDecimation);
+    double center = (length - 1) / 2.0;
+    double beta = kQualities[q].beta;
+    double i0Beta = besselI0(beta);
+
+    mCoefs = new int16_t[length];
+    double *phase = new double[mTaps];
+    for (uint32_t p = 0; p < mInterpolation; p++) {
+        // phase p holds the prototype coefficients p, p + L, p + 2L... in reverse order,
+        // so that the dot product runs forward over the history, oldest frame first
+        double sum = 0;
+        for (size_t k = 0; k < mTaps; k++) {
+            double n = (double)((mTaps - 1 - k) * mInterpolation + p);
+            double t = n - center;
+            double sinc = (t == 0) ? 2.0 * cutoff :
+                    sin(2.0 * M_PI * cutoff * t) / (M_PI * t);
+            double r = 2.0 * n / (length - 1) - 1.0;
+            double window = besselI0(beta * sqrt(r * r < 1.0 ? 1.0 - r * r : 0.0)) / i0Beta;
+            phase[k] = sinc * window;
+            sum += phase[k];
+        }
+        // unity DC gain for each phase
+        for (size_t k = 0; k < mTaps; k++) {
+            double coef = floor(phase[k] / sum * 32768.0 + 0.5);
+            if (coef > 32767.0) coef = 32767.0;
+            if (coef < -32767.0) coef = -32767.0;
+            mCoefs[p * mTaps + k] = (int16_t)coef;
+        }
+    }
+    delete[] phase;
+
+    mCapacity = mTaps + HISTORY_BLOCK_FRAMES;
+    mHistory = new int16_t[mCapacity * mChannelCount];
+    reset();
+
+    ALOGV("create() %u Hz -> %u Hz, %u/%u, %zu taps per phase",
+            inRate, outRate, mInterpolation, mDecimation, mTaps);
+    return true;
+}
+
+void LegacyResampler::reset()
+{
+    // start with a full filter of silence so that the first input frame produces output
+    memset(mHistory, 0, mCapacity * mChannelCount * sizeof(int16_t));
+    mFrames = mTaps - 1;
+    mIndex = 0;
+    mPhase = 0;
+}
+
+void LegacyResampler::compact()
+{
+    size_t shift = mIndex < mFrames ? mIndex : mFrames;
+    if (shift == 0) {
+        return;
+    }
+    for (uint32_t c = 0; c < mChannelCount; c++) {
+        int16_t *history = mHistory + c * mCapacity;
+        memmove(history, history + shift, (mFrames - shift) * sizeof(int16_t));
+    }
+    mFrames -= shift;
+    mIndex -= shift;
+}
+
+void LegacyResampler::resample(const int16_t *in, size_t *inFrames,
+                               int16_t *out, size_t *outFrames)
+{
+    size_t consumed = 0;
+    size_t produced = 0;
+
+    for (;;) {
+        while (produced < *outFrames && mIndex + mTaps <= mFrames) {
+            const int16_t *coefs = mCoefs + mPhase * mTaps;
+            for (uint32_t c = 0; c < mChannelCount; c++) {
+                int32_t acc = dotProduct(mHistory + c * mCapacity + mIndex, coefs, mTaps);
+                *out++ = clamp16((acc + (1 << 14)) >> 15);
+            }
+            produced++;
+            mPhase += mDecimation;
+            while (mPhase >= mInterpolation) {
+                mPhase -= mInterpolation;
+                mIndex++;
+            }
+        }
+        if (produced == *outFrames || consumed == *inFrames) {
+            break;
+        }
+
+        compact();
+        size_t count = *inFrames - consumed;
+        if (count > mCapacity - mFrames) {
+            count = mCapacity - mFrames;
+        }
+        // deinterleave into the planar history of each channel
+        const int16_t *src = in + consumed * mChannelCount;
+        if (mChannelCount == 1) {
+            memcpy(mHistory + mFrames, src, count * sizeof(int16_t));
+        } else {
+            int16_t *left = mHistory + mFrames;
+            int16_t *right = mHistory + mCapacity + mFrames;
+            for (size_t i = 0; i < count; i++) {
+                left[i] = src[2 * i];
+                right[i] = src[2 * i + 1];
+            }
+        }
+        mFrames += count;
+        consumed += count;
+    }
+
+    *inFrames = consumed;
+    *outFrames = produced;
+}
+
+size_t LegacyResampler::toOutFrames(size_t inFrames) const
+{
+    return (size_t)((uint64_t)inFrames * mOutRate / mInRate);
+}
+
+size_t LegacyResampler::toInFrames(size_t outFrames) const
+{
+    return (size_t)((uint64_t)outFrames * mInRate / mOutRate);
+}
+
+bool LegacyResampler::parseQuality(const char *value, quality *q)
+{
+    if (strcmp(value, "low") == 0) {
+        *q = LOW_QUALITY;
+    } else if (strcmp(value, "medium") == 0) {
+        *q = MEDIUM_QUALITY;
+    } else if (strcmp(value, "high") == 0) {
+        *q = HIGH_QUALITY;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+
+}; // namespace android_audio_legacy
@@ -0,0 +1,95 @@
+/*
+**
+** Copyright 2011, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef ANDROID_LEGACY_RESAMPLER_H
+#define ANDROID_LEGACY_RESAMPLER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+namespace android_audio_legacy {
+
+// ----------------------------------------------------------------------------
+
+/**
+ * LegacyResampler converts interleaved 16 bit PCM between two fixed sample rates with a
+ * polyphase FIR filter, so that streams can be opened at rates a legacy HAL does not support.
+ * The rate ratio is reduced to L/M and the windowed sinc prototype filter is split into L
+ * phases of Q15 coefficients. Each output sample is the dot product of one phase with the
+ * most recent input samples of its channel, computed with NEON or SSE2 when available.
+ * The filter state is kept between calls: all allocations are made by create().
+ */
+class LegacyResampler
+{
+public:
+    enum quality {
+        LOW_QUALITY,        // 8 taps per phase
+        MEDIUM_QUALITY,     // 16 taps per phase
+        HIGH_QUALITY,       // 32 taps per phase
+    };
+
+    // returns NULL if the conversion is not supported
+    static  LegacyResampler *create(uint32_t inRate, uint32_t outRate, uint32_t channelCount,
+                                    quality q);
+                        ~LegacyResampler();
+
+    // Converts up to *inFrames frames from in into up to *outFrames frames in out.
+    // On return *inFrames and *outFrames hold the number of frames consumed and produced.
+    // Input is only consumed while output can be produced.
+            void        resample(const int16_t *in, size_t *inFrames,
+                                 int16_t *out, size_t *outFrames);
+    // clears the filter history, e.g. when the stream enters standby
+            void        reset();
+
+            uint32_t    inRate() const { return mInRate; }
+            uint32_t    outRate() const { return mOutRate; }
+            uint32_t    channelCount() const { return mChannelCount; }
+            size_t      taps() const { return mTaps; }
+
+    // converts a frame count at the input rate to the output rate and back, rounding down
+            size_t      toOutFrames(size_t inFrames) const;
+            size_t      toInFrames(size_t outFrames) const;
+
+    // parses "low", "medium" or "high"; returns false for anything else
+    static  bool        parseQuality(const char *value, quality *q);
+
+private:
+                        LegacyResampler();
+                        LegacyResampler(const LegacyResampler &);
+            LegacyResampler& operator = (const LegacyResampler&);
+
+            bool        init(uint32_t inRate, uint32_t outRate, uint32_t channelCount,
+                             quality q);
+            void        compact();
+
+    uint32_t    mInRate;
+    uint32_t    mOutRate;
+    uint32_t    mChannelCount;
+    uint32_t    mInterpolation;     // L: number of phases
+    uint32_t    mDecimation;        // M: input frames per L output frames
+    size_t      mTaps;              // coefficients per phase, a multiple of 8
+    int16_t     *mCoefs;            // mInterpolation phases of mTaps coefficients
+    int16_t     *mHistory;          // mChannelCount planar buffers of mCapacity frames
+    size_t      mCapacity;
+    size_t      mFrames;            // frames in the history buffers
+    size_t      mIndex;             // first history frame of the next output frame
+    uint32_t    mPhase;             // phase of the next output frame
+};
+
+}; // namespace android_audio_legacy
+
+#endif // ANDROID_LEGACY_RESAMPLER_H
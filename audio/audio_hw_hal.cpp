@@ -18,14 +18,28 @@
 //#define LOG_NDEBUG 0
 
 #include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cutils/atomic.h>
+#include <cutils/properties.h>
 
 #include <hardware/hardware.h>
 #include <system/audio.h>
 #include <hardware/audio.h>
 
 #include <hardware_legacy/AudioHardwareInterface.h>
+#include <hardware_legacy/AudioParameterView.h>
 #include <hardware_legacy/AudioSystemLegacy.h>
 
+#include "LegacyFormatConverter.h"
+#include "LegacyResampler.h"
+
 namespace android_audio_legacy {
 
 extern "C" {
@@ -40,16 +54,32 @@ struct legacy_audio_device {
     struct AudioHardwareInterface *hwif;
 };
 
+struct legacy_write_clock;
+struct legacy_async_writer;
+struct legacy_stream_telemetry;
+struct legacy_rate_converter;
+struct legacy_format_converter;
+struct legacy_capture_ring;
+
 struct legacy_stream_out {
     struct audio_stream_out stream;
 
     AudioStreamOut *legacy_out;
+    struct legacy_write_clock *write_clock;
+    struct legacy_async_writer *async_writer; /* NULL if writes are synchronous */
+    struct legacy_stream_telemetry *telemetry;
+    struct legacy_rate_converter *rate_converter; /* NULL if the rate is not converted */
+    struct legacy_format_converter *format_converter; /* NULL if the format is not converted */
 };
 
 struct legacy_stream_in {
     struct audio_stream_in stream;
 
     AudioStreamIn *legacy_in;
+    struct legacy_capture_ring *capture_ring; /* NULL if reads are synchronous */
+    struct legacy_stream_telemetry *telemetry;
+    struct legacy_rate_converter *rate_converter; /* NULL if the rate is not converted */
+    struct legacy_format_converter *format_converter; /* NULL if the format is not converted */
 };
 
 
@@ -88,39 +118,1242 @@ static uint32_t audio_device_conv_table[][HAL_API_REV_NUM] =
     { AudioSystem::DEVICE_IN_DEFAULT, AUDIO_DEVICE_IN_DEFAULT },
 };
 
-static uint32_t convert_audio_device(uint32_t from_device, int from_rev, int to_rev)
+/* audio_device_bit_table[rev][is_input][bit] is the device in the other API revision
+ * corresponding to device bit "bit" in revision "rev", or AUDIO_DEVICE_NONE if none.
+ * Built once from audio_device_conv_table. Legacy input and output devices do not share bits
+ * and are all indexed with is_input 0. */
+static uint32_t audio_device_bit_table[HAL_API_REV_NUM][2][32];
+static pthread_once_t audio_device_bit_table_once = PTHREAD_ONCE_INIT;
+
+static void init_audio_device_bit_table()
 {
     const uint32_t k_num_devices = sizeof(audio_device_conv_table)/sizeof(uint32_t)/HAL_API_REV_NUM;
+
+    for (uint32_t i = 0; i < k_num_devices; i++) {
+        for (int rev = 0; rev < HAL_API_REV_NUM; rev++) {
+            uint32_t device = audio_device_conv_table[i][rev];
+            int is_input = 0;
+
+            if (rev != HAL_API_REV_1_0) {
+                is_input = (device & AUDIO_DEVICE_BIT_IN) ? 1 : 0;
+                device &= ~AUDIO_DEVICE_BIT_IN;
+            }
+            if (__builtin_popcount(device) != 1) {
+                ALOGE("%s: cannot map device 0x%x of revision %d", __func__,
+                      audio_device_conv_table[i][rev], rev);
+                continue;
+            }
+            /* several legacy devices can share a value: keep the first entry, as the
+             * former linear search did */
+            uint32_t *entry = &audio_device_bit_table[rev][is_input][__builtin_ctz(device)];
+            if (*entry == AUDIO_DEVICE_NONE) {
+                *entry = audio_device_conv_table[i][HAL_API_REV_NUM - 1 - rev];
+            }
+        }
+    }
+}
+
+static uint32_t convert_audio_device(uint32_t from_device, int from_rev, int to_rev)
+{
     uint32_t to_device = AUDIO_DEVICE_NONE;
-    uint32_t in_bit = 0;
+    int is_input = 0;
+
+    if (from_rev == to_rev) {
+        return from_device;
+    }
+    pthread_once(&audio_device_bit_table_once, init_audio_device_bit_table);
 
     if (from_rev != HAL_API_REV_1_0) {
-        in_bit = from_device & AUDIO_DEVICE_BIT_IN;
+        is_input = (from_device & AUDIO_DEVICE_BIT_IN) ? 1 : 0;
         from_device &= ~AUDIO_DEVICE_BIT_IN;
     }
 
+    const uint32_t *table = audio_device_bit_table[from_rev][is_input];
     while (from_device) {
-        uint32_t i = 31 - __builtin_clz(from_device);
-        uint32_t cur_device = (1 << i) | in_bit;
+        uint32_t i = __builtin_ctz(from_device);
 
-        for (i = 0; i < k_num_devices; i++) {
-            if (audio_device_conv_table[i][from_rev] == cur_device) {
-                to_device |= audio_device_conv_table[i][to_rev];
-                break;
+        to_device |= table[i];
+        from_device &= from_device - 1;
+    }
+    return to_device;
+}
+
+
+/** write clock
+ *
+ * Estimates the presentation position of legacy streams that do not report it from the
+ * frames written to the legacy stream, the CLOCK_MONOTONIC time at which the last write
+ * returned and latency(): a blocking write returns when the driver has room for more audio,
+ * at which time all frames written but latency() have been presented. The actual sample rate
+ * is tracked with a first order filter to follow the drift between the audio clock and
+ * CLOCK_MONOTONIC. **/
+
+/* the rate is measured over the writes of each window */
+#define WRITE_CLOCK_WINDOW_NS 500000000LL
+/* weight of a new rate measurement in the drift filter: 1 / (1 << WRITE_CLOCK_FILTER_SHIFT) */
+#define WRITE_CLOCK_FILTER_SHIFT 3
+/* rate measurements further than this ratio from the nominal rate are ignored, e.g. while
+ * the driver buffers fill up after standby */
+#define WRITE_CLOCK_MAX_DRIFT 0.05f
+
+struct legacy_write_clock {
+    pthread_mutex_t lock;
+    uint32_t sample_rate;       /* nominal sample rate */
+    uint32_t frame_size;
+    float rate;                 /* estimated actual sample rate */
+    uint64_t frames_written;    /* frames written to the legacy stream since standby */
+    int64_t write_time_ns;      /* time at which the last write returned, 0 if none */
+    int64_t window_time_ns;     /* time at which the current measurement window started */
+    uint64_t window_frames;     /* frames written since then */
+    uint64_t frames_presented;  /* last position reported, which never goes back */
+};
+
+static int64_t write_clock_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static struct legacy_write_clock *write_clock_create(AudioStreamOut *legacy_out)
+{
+    struct legacy_write_clock *clock =
+        (struct legacy_write_clock *)calloc(1, sizeof(*clock));
+    if (!clock)
+        return NULL;
+    pthread_mutex_init(&clock->lock, NULL);
+    clock->sample_rate = legacy_out->sampleRate();
+    clock->frame_size = legacy_out->frameSize();
+    clock->rate = clock->sample_rate;
+    return clock;
+}
+
+static void write_clock_destroy(struct legacy_write_clock *clock)
+{
+    pthread_mutex_destroy(&clock->lock);
+    free(clock);
+}
+
+/* called after each write to the legacy stream */
+static void write_clock_update(struct legacy_write_clock *clock, size_t bytes)
+{
+    int64_t now = write_clock_now_ns();
+    uint32_t frames = bytes / clock->frame_size;
+
+    pthread_mutex_lock(&clock->lock);
+    if (clock->write_time_ns == 0) {
+        clock->window_time_ns = now;
+        clock->window_frames = 0;
+    } else {
+        clock->window_frames += frames;
+        if (now - clock->window_time_ns >= WRITE_CLOCK_WINDOW_NS) {
+            float measured = clock->window_frames * 1000000000.0f /
+                             (now - clock->window_time_ns);
+            float drift = measured / clock->sample_rate - 1.0f;
+            if (drift < WRITE_CLOCK_MAX_DRIFT && drift > -WRITE_CLOCK_MAX_DRIFT)
+                clock->rate += (measured - clock->rate) / (1 << WRITE_CLOCK_FILTER_SHIFT);
+            clock->window_time_ns = now;
+            clock->window_frames = 0;
+        }
+    }
+    clock->frames_written += frames;
+    clock->write_time_ns = now;
+    pthread_mutex_unlock(&clock->lock);
+}
+
+/* called when the legacy stream enters standby */
+static void write_clock_reset(struct legacy_write_clock *clock)
+{
+    pthread_mutex_lock(&clock->lock);
+    clock->frames_written = 0;
+    clock->write_time_ns = 0;
+    clock->frames_presented = 0;
+    pthread_mutex_unlock(&clock->lock);
+}
+
+/* frames presented since standby */
+static uint64_t write_clock_position(struct legacy_write_clock *clock, uint32_t latency_ms)
+{
+    int64_t now = write_clock_now_ns();
+
+    pthread_mutex_lock(&clock->lock);
+    if (clock->write_time_ns != 0) {
+        int64_t position = (int64_t)clock->frames_written -
+                           (int64_t)latency_ms * clock->sample_rate / 1000 +
+                           (int64_t)((now - clock->write_time_ns) * (double)clock->rate /
+                                     1000000000.0);
+        if (position > (int64_t)clock->frames_written)
+            position = clock->frames_written;
+        if (position > (int64_t)clock->frames_presented)
+            clock->frames_presented = position;
+    }
+    uint64_t frames = clock->frames_presented;
+    pthread_mutex_unlock(&clock->lock);
+    return frames;
+}
+
+/* time in us at which the next frame written to the legacy stream will be presented */
+static int write_clock_next_write_time(struct legacy_write_clock *clock, uint32_t latency_ms,
+                                       int64_t *timestamp)
+{
+    int64_t now = write_clock_now_ns();
+
+    pthread_mutex_lock(&clock->lock);
+    if (clock->write_time_ns == 0) {
+        pthread_mutex_unlock(&clock->lock);
+        return -ENODATA;
+    }
+    /* audio written at write_time_ns is presented after the driver latency, or immediately
+     * after the driver latency from now if the driver ran out of audio since */
+    int64_t latency_ns = (int64_t)(latency_ms * (double)clock->sample_rate / clock->rate *
+                                   1000000.0);
+    int64_t time_ns = clock->write_time_ns + latency_ns;
+    if (time_ns < now)
+        time_ns = now + latency_ns;
+    pthread_mutex_unlock(&clock->lock);
+
+    *timestamp = time_ns / 1000;
+    return 0;
+}
+
+/** stream telemetry
+ *
+ * Per-stream counters of the transfers to and from the legacy streams: duration of each
+ * legacy write() or read(), interval between the starts of successive transfers, bytes moved
+ * and errors. Durations and intervals are kept in log2 histograms. A transfer starting later
+ * than twice the duration of the audio moved by the previous one is counted as an xrun: the
+ * legacy driver has probably run out of audio (output) or of room (input) in between.
+ * Transfers to a legacy stream are made by a single thread, which is the only writer of the
+ * counters; the histogram buckets and event counters are updated atomically so that dumps
+ * and get_parameters() see consistent values without taking a lock. The 64 bit byte count
+ * is kept in two halves guarded by a sequence count so that it cannot be read torn on 32 bit
+ * platforms. **/
+
+#define TELEMETRY_PARAMETER "telemetry"
+#define TELEMETRY_BUCKETS 16
+/* upper bound of the first bucket: 1 << TELEMETRY_BUCKET_SHIFT us; each bucket doubles it
+ * and the last bucket has no upper bound */
+#define TELEMETRY_BUCKET_SHIFT 7
+
+struct legacy_stream_telemetry {
+    uint32_t frame_size;
+    uint32_t sample_rate;
+    volatile int32_t transfers;
+    volatile int32_t errors;
+    volatile int32_t xruns;
+    volatile int32_t restart;       /* set at standby: the next interval is not measured */
+    volatile int32_t duration_max_us;
+    volatile int32_t duration_hist[TELEMETRY_BUCKETS];
+    volatile int32_t interval_hist[TELEMETRY_BUCKETS];
+    volatile int32_t bytes_seq;     /* odd while bytes_hi and bytes_lo are updated */
+    volatile int32_t bytes_hi;      /* only written by the transferring thread */
+    volatile int32_t bytes_lo;
+    int64_t last_start_ns;          /* start of the previous transfer, 0 if none */
+    int64_t last_audio_ns;          /* duration of the audio moved by the previous transfer */
+};
+
+static struct legacy_stream_telemetry *telemetry_create(uint32_t frame_size,
+                                                        uint32_t sample_rate)
+{
+    struct legacy_stream_telemetry *telemetry =
+        (struct legacy_stream_telemetry *)calloc(1, sizeof(*telemetry));
+    if (!telemetry)
+        return NULL;
+    telemetry->frame_size = frame_size ? frame_size : 1;
+    telemetry->sample_rate = sample_rate;
+    return telemetry;
+}
+
+static void telemetry_destroy(struct legacy_stream_telemetry *telemetry)
+{
+    free(telemetry);
+}
+
+static int telemetry_bucket(int64_t us)
+{
+    if (us < (1 << TELEMETRY_BUCKET_SHIFT))
+        return 0;
+    uint32_t scaled = (us >> TELEMETRY_BUCKET_SHIFT) > 0xFFFFFFFFLL ?
+                      0xFFFFFFFF : (uint32_t)(us >> TELEMETRY_BUCKET_SHIFT);
+    int bucket = 32 - __builtin_clz(scaled);
+    return bucket < TELEMETRY_BUCKETS ? bucket : TELEMETRY_BUCKETS - 1;
+}
+
+static void telemetry_add_bytes(struct legacy_stream_telemetry *telemetry, uint32_t count)
+{
+    uint64_t bytes = ((uint64_t)(uint32_t)telemetry->bytes_hi << 32) |
+                     (uint32_t)telemetry->bytes_lo;
+    bytes += count;
+    android_atomic_inc(&telemetry->bytes_seq);
+    android_atomic_release_store((int32_t)(bytes >> 32), &telemetry->bytes_hi);
+    android_atomic_release_store((int32_t)bytes, &telemetry->bytes_lo);
+    android_atomic_inc(&telemetry->bytes_seq);
+}
+
+static uint64_t telemetry_bytes(const struct legacy_stream_telemetry *telemetry)
+{
+    int32_t seq;
+    uint32_t hi, lo;
+
+    do {
+        seq = android_atomic_acquire_load(&telemetry->bytes_seq);
+        hi = (uint32_t)android_atomic_acquire_load(&telemetry->bytes_hi);
+        lo = (uint32_t)android_atomic_acquire_load(&telemetry->bytes_lo);
+    } while ((seq & 1) || (seq != android_atomic_acquire_load(&telemetry->bytes_seq)));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* returns the start time to pass to telemetry_end() */
+static int64_t telemetry_begin()
+{
+    return write_clock_now_ns();
+}
+
+/* called after each legacy write() or read() with its return value */
+static void telemetry_end(struct legacy_stream_telemetry *telemetry, int64_t start_ns,
+                          ssize_t ret)
+{
+    int64_t duration_us = (write_clock_now_ns() - start_ns) / 1000;
+
+    android_atomic_inc(&telemetry->duration_hist[telemetry_bucket(duration_us)]);
+    if (duration_us > telemetry->duration_max_us)
+        android_atomic_release_store(duration_us > 0x7FFFFFFF ? 0x7FFFFFFF : (int32_t)duration_us,
+                                     &telemetry->duration_max_us);
+
+    if (android_atomic_acquire_load(&telemetry->restart)) {
+        android_atomic_release_store(0, &telemetry->restart);
+        telemetry->last_start_ns = 0;
+    }
+    if (telemetry->last_start_ns != 0) {
+        int64_t interval_ns = start_ns - telemetry->last_start_ns;
+        android_atomic_inc(&telemetry->interval_hist[telemetry_bucket(interval_ns / 1000)]);
+        /* nothing is known about the driver after a failed or empty transfer */
+        if (telemetry->last_audio_ns != 0 && interval_ns > 2 * telemetry->last_audio_ns)
+            android_atomic_inc(&telemetry->xruns);
+    }
+    telemetry->last_start_ns = start_ns;
+
+    android_atomic_inc(&telemetry->transfers);
+    if (ret < 0) {
+        android_atomic_inc(&telemetry->errors);
+        telemetry->last_audio_ns = 0;
+        return;
+    }
+    telemetry_add_bytes(telemetry, (uint32_t)ret);
+    telemetry->last_audio_ns = telemetry->sample_rate == 0 ? 0 :
+            (int64_t)(ret / telemetry->frame_size) * 1000000000LL / telemetry->sample_rate;
+}
+
+/* called when the legacy stream enters standby, which is not an xrun */
+static void telemetry_standby(struct legacy_stream_telemetry *telemetry)
+{
+    android_atomic_release_store(1, &telemetry->restart);
+}
+
+static void telemetry_append_histogram(String8& result, const volatile int32_t *hist,
+                                       char separator)
+{
+    char buffer[32];
+
+    for (int i = 0; i < TELEMETRY_BUCKETS; i++) {
+        if (i == TELEMETRY_BUCKETS - 1)
+            snprintf(buffer, sizeof(buffer), "%c>=%d:%d", separator,
+                     1 << (TELEMETRY_BUCKET_SHIFT + i - 1), android_atomic_acquire_load(&hist[i]));
+        else
+            snprintf(buffer, sizeof(buffer), "%c<%d:%d", separator,
+                     1 << (TELEMETRY_BUCKET_SHIFT + i), android_atomic_acquire_load(&hist[i]));
+        result.append(i == 0 ? buffer + 1 : buffer);
+    }
+}
+
+/* value of the telemetry parameter: comma separated name:value fields, histogram
+ * buckets are named after their bounds in us */
+static String8 telemetry_to_string(const struct legacy_stream_telemetry *telemetry)
+{
+    char buffer[160];
+    String8 result;
+
+    snprintf(buffer, sizeof(buffer),
+             "transfers:%d,bytes:%llu,errors:%d,xruns:%d,duration_max_us:%d,duration:",
+             android_atomic_acquire_load(&telemetry->transfers),
+             (unsigned long long)telemetry_bytes(telemetry),
+             android_atomic_acquire_load(&telemetry->errors),
+             android_atomic_acquire_load(&telemetry->xruns),
+             android_atomic_acquire_load(&telemetry->duration_max_us));
+    result.append(buffer);
+    telemetry_append_histogram(result, telemetry->duration_hist, '|');
+    result.append(",interval:");
+    telemetry_append_histogram(result, telemetry->interval_hist, '|');
+    return result;
+}
+
+static void telemetry_dump(const struct legacy_stream_telemetry *telemetry, int fd)
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    String8 result;
+
+    snprintf(buffer, SIZE, "Legacy stream telemetry:\n"
+             "\ttransfers: %d bytes: %llu errors: %d xruns: %d max duration: %d us\n",
+             android_atomic_acquire_load(&telemetry->transfers),
+             (unsigned long long)telemetry_bytes(telemetry),
+             android_atomic_acquire_load(&telemetry->errors),
+             android_atomic_acquire_load(&telemetry->xruns),
+             android_atomic_acquire_load(&telemetry->duration_max_us));
+    result.append(buffer);
+    result.append("\tduration (us): ");
+    telemetry_append_histogram(result, telemetry->duration_hist, ' ');
+    result.append("\n\tinterval (us): ");
+    telemetry_append_histogram(result, telemetry->interval_hist, ' ');
+    result.append("\n");
+    ::write(fd, result.string(), result.size());
+}
+
+/* adds the telemetry parameter to the reply of get_parameters() if it was requested */
+static bool telemetry_get_parameter(const struct legacy_stream_telemetry *telemetry,
+                                    const char *keys, AudioParameter& reply)
+{
+    AudioParameterView view(keys);
+    if (!view.has(AudioParameterView::KEY_TELEMETRY))
+        return false;
+    reply.add(String8(TELEMETRY_PARAMETER), telemetry_to_string(telemetry));
+    return true;
+}
+
+/** rate conversion
+ *
+ * Legacy streams often run at a single fixed rate and reject any other in set(), returning
+ * their own rate. When RESAMPLER_QUALITY_PROPERTY is set, such a stream is opened at its own
+ * rate and the wrapper converts between it and the rate requested by the framework with a
+ * LegacyResampler, on 16 bit PCM in the channel layout of the legacy stream. **/
+
+/* "low", "medium" or "high"; rate conversion is disabled when not set */
+#define RESAMPLER_QUALITY_PROPERTY "audio.legacy.resampler_quality"
+
+struct legacy_rate_converter {
+    LegacyResampler *resampler;
+    uint32_t rate;              /* rate seen by the framework */
+    uint32_t legacy_rate;       /* rate of the legacy stream */
+    uint32_t channel_count;
+    size_t frame_size;
+    int16_t *buffer;            /* audio at the legacy rate, one legacy buffer */
+    size_t buffer_frames;
+    size_t offset;              /* input only: first frame in buffer not yet converted */
+    size_t count;               /* input only: frames in buffer not yet converted */
+};
+
+static bool rate_converter_enabled(LegacyResampler::quality *quality)
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    if (property_get(RESAMPLER_QUALITY_PROPERTY, value, NULL) <= 0)
+        return false;
+    return LegacyResampler::parseQuality(value, quality);
+}
+
+static struct legacy_rate_converter *rate_converter_create(uint32_t rate, uint32_t legacy_rate,
+                                                           size_t frame_size,
+                                                           size_t buffer_size, bool capture,
+                                                           LegacyResampler::quality quality)
+{
+    struct legacy_rate_converter *conv =
+        (struct legacy_rate_converter *)calloc(1, sizeof(*conv));
+    if (!conv)
+        return NULL;
+    conv->rate = rate;
+    conv->legacy_rate = legacy_rate;
+    conv->frame_size = frame_size;
+    conv->channel_count = frame_size / sizeof(int16_t);
+    conv->buffer_frames = buffer_size / frame_size;
+    if (capture)
+        conv->resampler = LegacyResampler::create(legacy_rate, rate, conv->channel_count,
+                                                  quality);
+    else
+        conv->resampler = LegacyResampler::create(rate, legacy_rate, conv->channel_count,
+                                                  quality);
+    if (conv->buffer_frames != 0)
+        conv->buffer = (int16_t *)malloc(conv->buffer_frames * frame_size);
+    if (!conv->resampler || !conv->buffer) {
+        delete conv->resampler;
+        free(conv->buffer);
+        free(conv);
+        return NULL;
+    }
+    ALOGV("%s: %u Hz <-> %u Hz, %zu taps", __func__, rate, legacy_rate,
+          conv->resampler->taps());
+    return conv;
+}
+
+static void rate_converter_destroy(struct legacy_rate_converter *conv)
+{
+    delete conv->resampler;
+    free(conv->buffer);
+    free(conv);
+}
+
+static void rate_converter_reset(struct legacy_rate_converter *conv)
+{
+    conv->resampler->reset();
+    conv->offset = 0;
+    conv->count = 0;
+}
+
+static void rate_converter_dump(const struct legacy_rate_converter *conv, int fd)
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+
+    snprintf(buffer, SIZE, "Rate conversion: %u Hz (legacy) <-> %u Hz, %zu taps per phase\n",
+             conv->legacy_rate, conv->rate, conv->resampler->taps());
+    ::write(fd, buffer, strlen(buffer));
+}
+
+/* converts a frame count at the legacy rate to the framework rate */
+static uint64_t rate_converter_frames(const struct legacy_rate_converter *conv,
+                                      uint64_t legacy_frames)
+{
+    return legacy_frames * conv->rate / conv->legacy_rate;
+}
+
+/* buffer frame count seen by the framework for a legacy buffer of legacy_frames */
+static size_t rate_converter_buffer_frames(const struct legacy_rate_converter *conv,
+                                           size_t legacy_frames)
+{
+    uint64_t frames = rate_converter_frames(conv, legacy_frames);
+    /* keep the frame count a multiple of 16 for the mixer */
+    return (size_t)((frames + 15) & ~15ULL);
+}
+
+/** format conversion
+ *
+ * Most legacy streams only take 16 bit mono or stereo PCM. When FORMAT_CONVERSION_PROPERTY is
+ * set, a stream the legacy HAL rejects for its format or channel mask is opened with the 16 bit
+ * configuration the legacy HAL returned and the wrapper converts with a LegacyFormatConverter:
+ * other PCM formats to and from 16 bit, mono to and from stereo, and 5.1 or 7.1 playback to
+ * stereo. Format conversion happens at the framework rate, before rate conversion on output
+ * and after it on input. **/
+
+/* "1" or "true" to enable format conversion */
+#define FORMAT_CONVERSION_PROPERTY "audio.legacy.format_conversion"
+
+struct legacy_format_converter {
+    LegacyFormatConverter *converter;
+    int format;                 /* format seen by the framework */
+    uint32_t channels;          /* channel mask seen by the framework */
+    size_t frame_size;          /* frame size seen by the framework */
+    size_t legacy_frame_size;
+    uint8_t *buffer;            /* 16 bit audio, converter->maxFrames() frames */
+};
+
+static bool format_converter_enabled()
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    if (property_get(FORMAT_CONVERSION_PROPERTY, value, "0") <= 0)
+        return false;
+    return atoi(value) != 0 || strcmp(value, "true") == 0;
+}
+
+static LegacyFormatConverter::sample_format format_converter_sample_format(int format)
+{
+    switch (format) {
+    case AUDIO_FORMAT_PCM_16_BIT:
+        return LegacyFormatConverter::SAMPLE_FORMAT_INT16;
+    case AUDIO_FORMAT_PCM_8_24_BIT:
+        return LegacyFormatConverter::SAMPLE_FORMAT_Q8_23;
+    case AUDIO_FORMAT_PCM_32_BIT:
+        return LegacyFormatConverter::SAMPLE_FORMAT_Q31;
+#ifdef LEGACY_AUDIO_FLOAT_FORMATS
+    case AUDIO_FORMAT_PCM_FLOAT:
+        return LegacyFormatConverter::SAMPLE_FORMAT_FLOAT;
+    case AUDIO_FORMAT_PCM_24_BIT_PACKED:
+        return LegacyFormatConverter::SAMPLE_FORMAT_PACKED_24;
+#endif
+    default:
+        return LegacyFormatConverter::SAMPLE_FORMAT_INVALID;
+    }
+}
+
+/* number of interleaved channels of the masks the converter handles, 0 for other masks */
+static uint32_t format_converter_channel_count(uint32_t channels, bool capture)
+{
+    if (capture) {
+        switch (channels) {
+        case AUDIO_CHANNEL_IN_MONO:
+            return 1;
+        case AUDIO_CHANNEL_IN_STEREO:
+            return 2;
+        default:
+            return 0;
+        }
+    }
+    switch (channels) {
+    case AUDIO_CHANNEL_OUT_MONO:
+        return 1;
+    case AUDIO_CHANNEL_OUT_STEREO:
+        return 2;
+    case AUDIO_CHANNEL_OUT_5POINT1:
+        return 6;
+    case AUDIO_CHANNEL_OUT_7POINT1:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+static bool format_converter_supported(int format, uint32_t channels, int legacy_format,
+                                       uint32_t legacy_channels, bool capture)
+{
+    LegacyFormatConverter::sample_format sample_format = format_converter_sample_format(format);
+    LegacyFormatConverter::sample_format legacy_sample_format =
+        format_converter_sample_format(legacy_format);
+    uint32_t channel_count = format_converter_channel_count(channels, capture);
+    uint32_t legacy_channel_count = format_converter_channel_count(legacy_channels, capture);
+
+    if (capture)
+        return LegacyFormatConverter::isSupported(legacy_sample_format, legacy_channel_count,
+                                                  sample_format, channel_count);
+    return LegacyFormatConverter::isSupported(sample_format, channel_count,
+                                              legacy_sample_format, legacy_channel_count);
+}
+
+static struct legacy_format_converter *format_converter_create(int format, uint32_t channels,
+                                                               int legacy_format,
+                                                               uint32_t legacy_channels,
+                                                               size_t buffer_frames,
+                                                               bool capture)
+{
+    LegacyFormatConverter::sample_format sample_format = format_converter_sample_format(format);
+    LegacyFormatConverter::sample_format legacy_sample_format =
+        format_converter_sample_format(legacy_format);
+    uint32_t channel_count = format_converter_channel_count(channels, capture);
+    uint32_t legacy_channel_count = format_converter_channel_count(legacy_channels, capture);
+
+    struct legacy_format_converter *conv =
+        (struct legacy_format_converter *)calloc(1, sizeof(*conv));
+    if (!conv)
+        return NULL;
+    conv->format = format;
+    conv->channels = channels;
+    if (capture)
+        conv->converter = LegacyFormatConverter::create(legacy_sample_format,
+                                                        legacy_channel_count, sample_format,
+                                                        channel_count, buffer_frames);
+    else
+        conv->converter = LegacyFormatConverter::create(sample_format, channel_count,
+                                                        legacy_sample_format,
+                                                        legacy_channel_count, buffer_frames);
+    if (conv->converter) {
+        conv->frame_size = capture ? conv->converter->outFrameSize() :
+                                     conv->converter->inFrameSize();
+        conv->legacy_frame_size = capture ? conv->converter->inFrameSize() :
+                                            conv->converter->outFrameSize();
+        conv->buffer = (uint8_t *)malloc(buffer_frames * conv->legacy_frame_size);
+    }
+    if (!conv->converter || !conv->buffer) {
+        delete conv->converter;
+        free(conv->buffer);
+        free(conv);
+        return NULL;
+    }
+    return conv;
+}
+
+static void format_converter_destroy(struct legacy_format_converter *conv)
+{
+    delete conv->converter;
+    free(conv->buffer);
+    free(conv);
+}
+
+static void format_converter_dump(const struct legacy_format_converter *conv, int fd)
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+
+    snprintf(buffer, SIZE, "Format conversion: format %#x channels %#x <-> 16 bit, "
+             "%zu bytes <-> %zu bytes per frame\n", conv->format, conv->channels,
+             conv->frame_size, conv->legacy_frame_size);
+    ::write(fd, buffer, strlen(buffer));
+}
+
+/* Decides how a stream the legacy HAL rejected with BAD_VALUE can be opened with the
+ * configuration it returned instead. Returns false if the difference cannot be converted. */
+static bool stream_conversion_possible(int format, uint32_t channels, uint32_t rate,
+                                       int legacy_format, uint32_t legacy_channels,
+                                       uint32_t legacy_rate, bool capture,
+                                       bool *convert_format, bool *convert_rate,
+                                       LegacyResampler::quality *quality)
+{
+    if (legacy_format != AUDIO_FORMAT_PCM_16_BIT || legacy_rate == 0)
+        return false;
+    *convert_format = format != legacy_format || channels != legacy_channels;
+    *convert_rate = rate != legacy_rate;
+    if (*convert_format &&
+            (!format_converter_enabled() ||
+             !format_converter_supported(format, channels, legacy_format, legacy_channels,
+                                         capture)))
+        return false;
+    if (*convert_rate && !rate_converter_enabled(quality))
+        return false;
+    return *convert_format || *convert_rate;
+}
+
+/** asynchronous output writer
+ *
+ * When ASYNC_WRITE_PERIODS_PROPERTY is set, out_write() copies the audio to a single producer,
+ * single consumer ring buffer and returns. A SCHED_FIFO thread writes it to the legacy stream
+ * one buffer at a time, so that a legacy driver blocking longer than usual does not make
+ * AudioFlinger miss its mix deadline. out_write() only blocks when the ring is full.
+ * The ring indices are only written by their owner (rear by out_write(), front by the writer
+ * thread); wait_lock is only used to sleep and wake up. **/
+
+/* number of legacy stream buffers held by the ring; 0 (default) for synchronous writes */
+#define ASYNC_WRITE_PERIODS_PROPERTY "audio.legacy.async_write_periods"
+#define ASYNC_WRITE_MAX_PERIODS 16
+#define ASYNC_WRITE_PRIORITY 2
+
+struct legacy_async_writer {
+    AudioStreamOut *legacy_out;
+    struct legacy_write_clock *clock;
+    struct legacy_stream_telemetry *telemetry;
+    pthread_t thread;
+    pthread_mutex_t legacy_lock;    /* serializes calls to legacy_out with the writer thread */
+    pthread_mutex_t wait_lock;
+    pthread_cond_t data_cond;       /* signaled when audio is queued, to drain or to exit */
+    pthread_cond_t space_cond;      /* signaled when audio is consumed */
+    uint8_t *ring;
+    uint32_t size;                  /* ring size in bytes, one frame is always left empty */
+    uint32_t period;                /* bytes written to the legacy stream at once */
+    uint32_t frame_size;
+    volatile int32_t rear;          /* write offset, only updated by out_write() */
+    volatile int32_t front;         /* read offset, only updated by the writer thread */
+    volatile int32_t error;         /* last legacy write error, reported by the next write */
+    bool draining;                  /* protected by wait_lock */
+    bool exiting;                   /* protected by wait_lock */
+};
+
+static uint32_t async_writer_fill(struct legacy_async_writer *writer)
+{
+    uint32_t rear = (uint32_t)android_atomic_acquire_load(&writer->rear);
+    uint32_t front = (uint32_t)android_atomic_acquire_load(&writer->front);
+    return (rear + writer->size - front) % writer->size;
+}
+
+static void *async_writer_loop(void *context)
+{
+    struct legacy_async_writer *writer = (struct legacy_async_writer *)context;
+
+    for (;;) {
+        pthread_mutex_lock(&writer->wait_lock);
+        /* read under wait_lock so that a signal from out_write() cannot be missed */
+        uint32_t fill = async_writer_fill(writer);
+        if (writer->exiting) {
+            pthread_mutex_unlock(&writer->wait_lock);
+            break;
+        }
+        /* wait for a full buffer unless out_standby() waits for the ring to drain */
+        if ((fill == 0) || ((fill < writer->period) && !writer->draining)) {
+            pthread_cond_wait(&writer->data_cond, &writer->wait_lock);
+            pthread_mutex_unlock(&writer->wait_lock);
+            continue;
+        }
+        pthread_mutex_unlock(&writer->wait_lock);
+
+        uint32_t front = (uint32_t)writer->front;
+        uint32_t bytes = fill;
+        if (bytes > writer->period)
+            bytes = writer->period;
+        if (bytes > writer->size - front)
+            bytes = writer->size - front;
+
+        pthread_mutex_lock(&writer->legacy_lock);
+        int64_t start_ns = telemetry_begin();
+        ssize_t ret = writer->legacy_out->write(writer->ring + front, bytes);
+        pthread_mutex_unlock(&writer->legacy_lock);
+        if (writer->telemetry)
+            telemetry_end(writer->telemetry, start_ns, ret);
+        if (ret < 0) {
+            /* the audio is dropped, as AudioFlinger would do after a failed write */
+            android_atomic_release_store((int32_t)ret, &writer->error);
+        } else if (ret > 0 && (uint32_t)ret < bytes) {
+            bytes = ret;
+        }
+        if (ret > 0 && writer->clock)
+            write_clock_update(writer->clock, ret);
+        android_atomic_release_store((int32_t)((front + bytes) % writer->size), &writer->front);
+
+        pthread_mutex_lock(&writer->wait_lock);
+        pthread_cond_broadcast(&writer->space_cond);
+        pthread_mutex_unlock(&writer->wait_lock);
+    }
+    return NULL;
+}
+
+static struct legacy_async_writer *async_writer_create(AudioStreamOut *legacy_out,
+                                                      struct legacy_write_clock *clock,
+                                                      struct legacy_stream_telemetry *telemetry)
+{
+    char value[PROPERTY_VALUE_MAX];
+    uint32_t periods = 0;
+
+    if (property_get(ASYNC_WRITE_PERIODS_PROPERTY, value, NULL) > 0)
+        periods = strtoul(value, NULL, 0);
+    if (periods == 0)
+        return NULL;
+    if (periods > ASYNC_WRITE_MAX_PERIODS)
+        periods = ASYNC_WRITE_MAX_PERIODS;
+    /* compressed or direct streams are not always written in whole frames */
+    if (legacy_out->format() != AUDIO_FORMAT_PCM_16_BIT)
+        return NULL;
+
+    struct legacy_async_writer *writer =
+        (struct legacy_async_writer *)calloc(1, sizeof(*writer));
+    if (!writer)
+        return NULL;
+    writer->legacy_out = legacy_out;
+    writer->clock = clock;
+    writer->telemetry = telemetry;
+    writer->frame_size = legacy_out->frameSize();
+    writer->period = legacy_out->bufferSize();
+    writer->period -= writer->period % writer->frame_size;
+    writer->size = writer->period * periods + writer->frame_size;
+    writer->ring = (uint8_t *)malloc(writer->size);
+    if (!writer->ring || writer->period == 0) {
+        free(writer->ring);
+        free(writer);
+        return NULL;
+    }
+    pthread_mutex_init(&writer->legacy_lock, NULL);
+    pthread_mutex_init(&writer->wait_lock, NULL);
+    pthread_cond_init(&writer->data_cond, NULL);
+    pthread_cond_init(&writer->space_cond, NULL);
+
+    if (pthread_create(&writer->thread, NULL, async_writer_loop, writer) != 0) {
+        ALOGW("%s: cannot create writer thread, using synchronous writes", __func__);
+        pthread_cond_destroy(&writer->space_cond);
+        pthread_cond_destroy(&writer->data_cond);
+        pthread_mutex_destroy(&writer->wait_lock);
+        pthread_mutex_destroy(&writer->legacy_lock);
+        free(writer->ring);
+        free(writer);
+        return NULL;
+    }
+    struct sched_param param;
+    param.sched_priority = ASYNC_WRITE_PRIORITY;
+    if (pthread_setschedparam(writer->thread, SCHED_FIFO, &param) != 0)
+        ALOGW("%s: cannot use SCHED_FIFO for writer thread", __func__);
+
+    ALOGV("%s: %u buffers of %u bytes", __func__, periods, writer->period);
+    return writer;
+}
+
+static void async_writer_destroy(struct legacy_async_writer *writer)
+{
+    pthread_mutex_lock(&writer->wait_lock);
+    writer->exiting = true;
+    pthread_cond_signal(&writer->data_cond);
+    pthread_cond_broadcast(&writer->space_cond);
+    pthread_mutex_unlock(&writer->wait_lock);
+    pthread_join(writer->thread, NULL);
+
+    pthread_cond_destroy(&writer->space_cond);
+    pthread_cond_destroy(&writer->data_cond);
+    pthread_mutex_destroy(&writer->wait_lock);
+    pthread_mutex_destroy(&writer->legacy_lock);
+    free(writer->ring);
+    free(writer);
+}
+
+static ssize_t async_writer_write(struct legacy_async_writer *writer, const void *buffer,
+                                  size_t bytes)
+{
+    int32_t error = android_atomic_acquire_load(&writer->error);
+    if (error != 0) {
+        android_atomic_release_cas(error, 0, &writer->error);
+        return error;
+    }
+
+    const uint8_t *src = (const uint8_t *)buffer;
+    size_t remaining = bytes;
+    while (remaining > 0) {
+        uint32_t space = writer->size - writer->frame_size - async_writer_fill(writer);
+        if (space == 0) {
+            pthread_mutex_lock(&writer->wait_lock);
+            while (!writer->exiting &&
+                   (writer->size - writer->frame_size - async_writer_fill(writer) == 0))
+                pthread_cond_wait(&writer->space_cond, &writer->wait_lock);
+            pthread_mutex_unlock(&writer->wait_lock);
+            continue;
+        }
+        uint32_t rear = (uint32_t)writer->rear;
+        uint32_t count = remaining;
+        if (count > space)
+            count = space;
+        if (count > writer->size - rear)
+            count = writer->size - rear;
+        memcpy(writer->ring + rear, src, count);
+        android_atomic_release_store((int32_t)((rear + count) % writer->size), &writer->rear);
+
+        pthread_mutex_lock(&writer->wait_lock);
+        pthread_cond_signal(&writer->data_cond);
+        pthread_mutex_unlock(&writer->wait_lock);
+        src += count;
+        remaining -= count;
+    }
+    return bytes;
+}
+
+/* waits until all queued audio has been written to the legacy stream */
+static void async_writer_drain(struct legacy_async_writer *writer)
+{
+    pthread_mutex_lock(&writer->wait_lock);
+    writer->draining = true;
+    pthread_cond_signal(&writer->data_cond);
+    while (!writer->exiting && async_writer_fill(writer) != 0)
+        pthread_cond_wait(&writer->space_cond, &writer->wait_lock);
+    writer->draining = false;
+    pthread_mutex_unlock(&writer->wait_lock);
+}
+
+/* number of frames queued but not yet written to the legacy stream */
+static uint32_t async_writer_pending_frames(struct legacy_async_writer *writer)
+{
+    return async_writer_fill(writer) / writer->frame_size;
+}
+
+/* serialize the calls to legacy_out with the writer thread, if any. Every legacy_out
+ * call but write() must be bracketed by these. */
+static void out_lock_legacy(const struct legacy_stream_out *out)
+{
+    if (out->async_writer)
+        pthread_mutex_lock(&out->async_writer->legacy_lock);
+}
+
+static void out_unlock_legacy(const struct legacy_stream_out *out)
+{
+    if (out->async_writer)
+        pthread_mutex_unlock(&out->async_writer->legacy_lock);
+}
+
+/** capture ring
+ *
+ * When CAPTURE_RING_PERIODS_PROPERTY is set, a SCHED_FIFO thread reads the legacy input stream
+ * one buffer at a time into a single producer, single consumer ring buffer and in_read()
+ * copies from the ring, so that a client late to read does not make the legacy driver
+ * overrun. A buffer read when the ring has no room for it is dropped and counted in the
+ * frames lost reported by in_get_input_frames_lost(), along with those the legacy stream
+ * reports. The thread also timestamps the capture of each buffer: the capture position
+ * gives the time at which the next frame returned by in_read() was captured. Capture starts
+ * with the first read after standby and stops at standby.
+ * The ring indices are only written by their owner (rear by the capture thread, front by
+ * in_read()); wait_lock is only used to sleep and wake up. **/
+
+/* number of legacy stream buffers held by the ring; 0 (default) for synchronous reads */
+#define CAPTURE_RING_PERIODS_PROPERTY "audio.legacy.capture_ring_periods"
+#define CAPTURE_RING_MAX_PERIODS 16
+#define CAPTURE_RING_PRIORITY 2
+#define CAPTURE_POSITION_PARAMETER "capture_position"
+
+struct legacy_capture_ring {
+    AudioStreamIn *legacy_in;
+    struct legacy_stream_telemetry *telemetry;
+    pthread_t thread;
+    pthread_mutex_t legacy_lock;    /* serializes calls to legacy_in with the capture thread */
+    pthread_mutex_t wait_lock;
+    pthread_cond_t start_cond;      /* signaled when capture starts, or to exit */
+    pthread_cond_t data_cond;       /* signaled when audio is captured or a read fails */
+    uint8_t *ring;
+    uint8_t *buffer;                /* one period read from the legacy stream */
+    uint32_t size;                  /* ring size in bytes, one frame is always left empty */
+    uint32_t period;                /* bytes read from the legacy stream at once */
+    uint32_t frame_size;
+    uint32_t sample_rate;
+    volatile int32_t rear;          /* write offset, only updated by the capture thread */
+    volatile int32_t front;         /* read offset, only updated by in_read() */
+    volatile int32_t error;         /* last legacy read error, reported by the next read */
+    volatile int32_t active;        /* set by in_read(), cleared by in_standby() */
+    volatile int32_t frames_lost;   /* dropped since the last in_get_input_frames_lost() */
+    volatile int32_t overruns;      /* buffers dropped since the stream was opened */
+    /* protected by wait_lock */
+    uint64_t position;              /* frames captured since standby, including dropped ones */
+    int64_t time_ns;                /* time at which the last buffer was captured, 0 if none */
+    bool exiting;
+};
+
+static uint32_t capture_ring_fill(struct legacy_capture_ring *ring)
+{
+    uint32_t rear = (uint32_t)android_atomic_acquire_load(&ring->rear);
+    uint32_t front = (uint32_t)android_atomic_acquire_load(&ring->front);
+    return (rear + ring->size - front) % ring->size;
+}
+
+static void *capture_ring_loop(void *context)
+{
+    struct legacy_capture_ring *ring = (struct legacy_capture_ring *)context;
+
+    for (;;) {
+        pthread_mutex_lock(&ring->wait_lock);
+        while (!ring->exiting && !android_atomic_acquire_load(&ring->active))
+            pthread_cond_wait(&ring->start_cond, &ring->wait_lock);
+        bool exiting = ring->exiting;
+        pthread_mutex_unlock(&ring->wait_lock);
+        if (exiting)
+            break;
+
+        pthread_mutex_lock(&ring->legacy_lock);
+        /* in_standby() may have stopped capture while this thread waited for legacy_lock */
+        if (!android_atomic_acquire_load(&ring->active)) {
+            pthread_mutex_unlock(&ring->legacy_lock);
+            continue;
+        }
+        int64_t start_ns = telemetry_begin();
+        ssize_t ret = ring->legacy_in->read(ring->buffer, ring->period);
+        int64_t now = write_clock_now_ns();
+        if (ring->telemetry)
+            telemetry_end(ring->telemetry, start_ns, ret);
+
+        uint32_t bytes = ret > 0 ? (uint32_t)ret - (uint32_t)ret % ring->frame_size : 0;
+        uint32_t space = ring->size - ring->frame_size - capture_ring_fill(ring);
+        bool overrun = bytes > space;
+        uint32_t rear = (uint32_t)ring->rear;
+        if (bytes != 0 && !overrun) {
+            uint32_t count = bytes;
+            if (count > ring->size - rear)
+                count = ring->size - rear;
+            memcpy(ring->ring + rear, ring->buffer, count);
+            memcpy(ring->ring, ring->buffer + count, bytes - count);
+        }
+
+        pthread_mutex_lock(&ring->wait_lock);
+        if (ret < 0) {
+            android_atomic_release_store((int32_t)ret, &ring->error);
+        } else if (bytes != 0) {
+            ring->position += bytes / ring->frame_size;
+            ring->time_ns = now;
+            if (overrun) {
+                android_atomic_add((int32_t)(bytes / ring->frame_size), &ring->frames_lost);
+                android_atomic_inc(&ring->overruns);
+            } else {
+                android_atomic_release_store((int32_t)((rear + bytes) % ring->size),
+                                             &ring->rear);
             }
         }
-        from_device &= ~cur_device;
+        pthread_cond_broadcast(&ring->data_cond);
+        pthread_mutex_unlock(&ring->wait_lock);
+        pthread_mutex_unlock(&ring->legacy_lock);
+
+        /* the legacy stream does not pace the loop when it fails */
+        if (bytes == 0)
+            usleep((uint64_t)ring->period / ring->frame_size * 1000000 / ring->sample_rate);
     }
-    return to_device;
+    return NULL;
+}
+
+static struct legacy_capture_ring *capture_ring_create(AudioStreamIn *legacy_in,
+                                                       struct legacy_stream_telemetry *telemetry)
+{
+    char value[PROPERTY_VALUE_MAX];
+    uint32_t periods = 0;
+
+    if (property_get(CAPTURE_RING_PERIODS_PROPERTY, value, NULL) > 0)
+        periods = strtoul(value, NULL, 0);
+    if (periods == 0)
+        return NULL;
+    if (periods > CAPTURE_RING_MAX_PERIODS)
+        periods = CAPTURE_RING_MAX_PERIODS;
+    if (legacy_in->format() != AUDIO_FORMAT_PCM_16_BIT || legacy_in->sampleRate() == 0)
+        return NULL;
+
+    struct legacy_capture_ring *ring =
+        (struct legacy_capture_ring *)calloc(1, sizeof(*ring));
+    if (!ring)
+        return NULL;
+    ring->legacy_in = legacy_in;
+    ring->telemetry = telemetry;
+    ring->frame_size = legacy_in->frameSize();
+    ring->sample_rate = legacy_in->sampleRate();
+    ring->period = legacy_in->bufferSize();
+    ring->period -= ring->period % ring->frame_size;
+    ring->size = ring->period * periods + ring->frame_size;
+    ring->ring = (uint8_t *)malloc(ring->size);
+    ring->buffer = (uint8_t *)malloc(ring->period);
+    if (!ring->ring || !ring->buffer || ring->period == 0) {
+        free(ring->buffer);
+        free(ring->ring);
+        free(ring);
+        return NULL;
+    }
+    pthread_mutex_init(&ring->legacy_lock, NULL);
+    pthread_mutex_init(&ring->wait_lock, NULL);
+    pthread_cond_init(&ring->start_cond, NULL);
+    pthread_cond_init(&ring->data_cond, NULL);
+
+    if (pthread_create(&ring->thread, NULL, capture_ring_loop, ring) != 0) {
+        ALOGW("%s: cannot create capture thread, using synchronous reads", __func__);
+        pthread_cond_destroy(&ring->data_cond);
+        pthread_cond_destroy(&ring->start_cond);
+        pthread_mutex_destroy(&ring->wait_lock);
+        pthread_mutex_destroy(&ring->legacy_lock);
+        free(ring->buffer);
+        free(ring->ring);
+        free(ring);
+        return NULL;
+    }
+    struct sched_param param;
+    param.sched_priority = CAPTURE_RING_PRIORITY;
+    if (pthread_setschedparam(ring->thread, SCHED_FIFO, &param) != 0)
+        ALOGW("%s: cannot use SCHED_FIFO for capture thread", __func__);
+
+    ALOGV("%s: %u buffers of %u bytes", __func__, periods, ring->period);
+    return ring;
+}
+
+static void capture_ring_destroy(struct legacy_capture_ring *ring)
+{
+    pthread_mutex_lock(&ring->wait_lock);
+    ring->exiting = true;
+    pthread_cond_signal(&ring->start_cond);
+    pthread_cond_broadcast(&ring->data_cond);
+    pthread_mutex_unlock(&ring->wait_lock);
+    pthread_join(ring->thread, NULL);
+
+    pthread_cond_destroy(&ring->data_cond);
+    pthread_cond_destroy(&ring->start_cond);
+    pthread_mutex_destroy(&ring->wait_lock);
+    pthread_mutex_destroy(&ring->legacy_lock);
+    free(ring->buffer);
+    free(ring->ring);
+    free(ring);
 }
 
+static ssize_t capture_ring_read(struct legacy_capture_ring *ring, void *buffer, size_t bytes)
+{
+    int32_t error = android_atomic_acquire_load(&ring->error);
+    if (error != 0) {
+        android_atomic_release_cas(error, 0, &ring->error);
+        return error;
+    }
+    if (!android_atomic_acquire_load(&ring->active)) {
+        pthread_mutex_lock(&ring->wait_lock);
+        android_atomic_release_store(1, &ring->active);
+        pthread_cond_signal(&ring->start_cond);
+        pthread_mutex_unlock(&ring->wait_lock);
+    }
+
+    uint8_t *dst = (uint8_t *)buffer;
+    size_t remaining = bytes - bytes % ring->frame_size;
+    while (remaining > 0) {
+        uint32_t fill = capture_ring_fill(ring);
+        if (fill == 0) {
+            pthread_mutex_lock(&ring->wait_lock);
+            while (!ring->exiting && capture_ring_fill(ring) == 0 &&
+                   android_atomic_acquire_load(&ring->error) == 0)
+                pthread_cond_wait(&ring->data_cond, &ring->wait_lock);
+            bool exiting = ring->exiting;
+            pthread_mutex_unlock(&ring->wait_lock);
+            /* a read error is reported once the audio captured before it has been read */
+            if (capture_ring_fill(ring) != 0)
+                continue;
+            if (dst != buffer || exiting)
+                break;
+            error = android_atomic_acquire_load(&ring->error);
+            android_atomic_release_cas(error, 0, &ring->error);
+            return error;
+        }
+        uint32_t front = (uint32_t)ring->front;
+        uint32_t count = remaining;
+        if (count > fill)
+            count = fill;
+        if (count > ring->size - front)
+            count = ring->size - front;
+        memcpy(dst, ring->ring + front, count);
+        android_atomic_release_store((int32_t)((front + count) % ring->size), &ring->front);
+        dst += count;
+        remaining -= count;
+    }
+    return dst - (uint8_t *)buffer;
+}
+
+/* stops capture and discards the audio captured; returns with legacy_lock held so that the
+ * caller can put the legacy stream in standby before capture restarts */
+static void capture_ring_stop(struct legacy_capture_ring *ring)
+{
+    android_atomic_release_store(0, &ring->active);
+    pthread_mutex_lock(&ring->legacy_lock);
+    pthread_mutex_lock(&ring->wait_lock);
+    android_atomic_release_store(android_atomic_acquire_load(&ring->rear), &ring->front);
+    android_atomic_release_store(0, &ring->error);
+    ring->position = 0;
+    ring->time_ns = 0;
+    pthread_mutex_unlock(&ring->wait_lock);
+}
+
+/* frames dropped since the previous call */
+static uint32_t capture_ring_frames_lost(struct legacy_capture_ring *ring)
+{
+    int32_t lost;
+    do {
+        lost = android_atomic_acquire_load(&ring->frames_lost);
+    } while (android_atomic_release_cas(lost, 0, &ring->frames_lost) != 0);
+    return (uint32_t)lost;
+}
+
+/* Position since standby of the next frame in_read() returns and time at which it was
+ * captured, at the legacy rate. Frames queued before an overrun are positioned as if the
+ * dropped frames came first. Returns -ENODATA if nothing was captured since standby. */
+static int capture_ring_position(struct legacy_capture_ring *ring, uint64_t *frames,
+                                 int64_t *time_ns)
+{
+    pthread_mutex_lock(&ring->wait_lock);
+    if (ring->time_ns == 0) {
+        pthread_mutex_unlock(&ring->wait_lock);
+        return -ENODATA;
+    }
+    uint32_t queued = capture_ring_fill(ring) / ring->frame_size;
+    *frames = ring->position - queued;
+    *time_ns = ring->time_ns - (int64_t)queued * 1000000000LL / ring->sample_rate;
+    pthread_mutex_unlock(&ring->wait_lock);
+    return 0;
+}
+
+static void capture_ring_dump(struct legacy_capture_ring *ring, int fd)
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+
+    snprintf(buffer, SIZE, "Capture ring: %u bytes, %u bytes per read, %u bytes queued, "
+             "%d overruns, %d frames lost pending\n", ring->size - ring->frame_size,
+             ring->period, capture_ring_fill(ring), android_atomic_acquire_load(&ring->overruns),
+             android_atomic_acquire_load(&ring->frames_lost));
+    ::write(fd, buffer, strlen(buffer));
+}
+
+/* serialize the calls to legacy_in with the capture thread, if any. Every legacy_in
+ * call but read() must be bracketed by these. */
+static void in_lock_legacy(const struct legacy_stream_in *in)
+{
+    if (in->capture_ring)
+        pthread_mutex_lock(&in->capture_ring->legacy_lock);
+}
+
+static void in_unlock_legacy(const struct legacy_stream_in *in)
+{
+    if (in->capture_ring)
+        pthread_mutex_unlock(&in->capture_ring->legacy_lock);
+}
 
 /** audio_stream_out implementation **/
 static uint32_t out_get_sample_rate(const struct audio_stream *stream)
 {
     const struct legacy_stream_out *out =
         reinterpret_cast<const struct legacy_stream_out *>(stream);
-    return out->legacy_out->sampleRate();
+    if (out->rate_converter)
+        return out->rate_converter->rate;
+    out_lock_legacy(out);
+    uint32_t rate = out->legacy_out->sampleRate();
+    out_unlock_legacy(out);
+    return rate;
 }
 
 static int out_set_sample_rate(struct audio_stream *stream, uint32_t rate)
@@ -137,22 +1370,44 @@ static size_t out_get_buffer_size(const struct audio_stream *stream)
 {
     const struct legacy_stream_out *out =
         reinterpret_cast<const struct legacy_stream_out *>(stream);
-    return out->legacy_out->bufferSize();
+    out_lock_legacy(out);
+    size_t buffer_size = out->legacy_out->bufferSize();
+    size_t frame_size = out->legacy_out->frameSize();
+    out_unlock_legacy(out);
+    if (!out->rate_converter && !out->format_converter)
+        return buffer_size;
+
+    size_t frames = buffer_size / frame_size;
+    if (out->rate_converter)
+        frames = rate_converter_buffer_frames(out->rate_converter, frames);
+    if (out->format_converter)
+        return frames * out->format_converter->frame_size;
+    return frames * frame_size;
 }
 
 static audio_channel_mask_t out_get_channels(const struct audio_stream *stream)
 {
     const struct legacy_stream_out *out =
         reinterpret_cast<const struct legacy_stream_out *>(stream);
-    return (audio_channel_mask_t) out->legacy_out->channels();
+    if (out->format_converter)
+        return (audio_channel_mask_t) out->format_converter->channels;
+    out_lock_legacy(out);
+    uint32_t channels = out->legacy_out->channels();
+    out_unlock_legacy(out);
+    return (audio_channel_mask_t) channels;
 }
 
 static audio_format_t out_get_format(const struct audio_stream *stream)
 {
     const struct legacy_stream_out *out =
         reinterpret_cast<const struct legacy_stream_out *>(stream);
+    if (out->format_converter)
+        return (audio_format_t) out->format_converter->format;
+    out_lock_legacy(out);
     // legacy API, don't change return type
-    return (audio_format_t) out->legacy_out->format();
+    int format = out->legacy_out->format();
+    out_unlock_legacy(out);
+    return (audio_format_t) format;
 }
 
 static int out_set_format(struct audio_stream *stream, audio_format_t format)
@@ -168,7 +1423,20 @@ static int out_standby(struct audio_stream *stream)
 {
     struct legacy_stream_out *out =
         reinterpret_cast<struct legacy_stream_out *>(stream);
-    return out->legacy_out->standby();
+    int ret;
+
+    if (out->async_writer)
+        async_writer_drain(out->async_writer);
+    out_lock_legacy(out);
+    ret = out->legacy_out->standby();
+    out_unlock_legacy(out);
+    if (out->write_clock)
+        write_clock_reset(out->write_clock);
+    if (out->telemetry)
+        telemetry_standby(out->telemetry);
+    if (out->rate_converter)
+        rate_converter_reset(out->rate_converter);
+    return ret;
 }
 
 static int out_dump(const struct audio_stream *stream, int fd)
@@ -176,25 +1444,54 @@ static int out_dump(const struct audio_stream *stream, int fd)
     const struct legacy_stream_out *out =
         reinterpret_cast<const struct legacy_stream_out *>(stream);
     Vector<String16> args;
-    return out->legacy_out->dump(fd, args);
+    out_lock_legacy(out);
+    int ret = out->legacy_out->dump(fd, args);
+    out_unlock_legacy(out);
+    if (out->format_converter)
+        format_converter_dump(out->format_converter, fd);
+    if (out->rate_converter)
+        rate_converter_dump(out->rate_converter, fd);
+    if (out->telemetry)
+        telemetry_dump(out->telemetry, fd);
+    return ret;
 }
 
-static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
+/* Converts the routing value of a stream set_parameters() string to the legacy
+ * device encoding. Strings without routing, and the frequent routing only
+ * case, are handled from a view over kvpairs without building an
+ * AudioParameter: the String8 returned, which the legacy setParameters()
+ * takes, is then the only allocation. */
+static String8 convert_set_parameters(const char *kvpairs)
 {
-    struct legacy_stream_out *out =
-        reinterpret_cast<struct legacy_stream_out *>(stream);
+    AudioParameterView view(kvpairs);
     int val;
-    String8 s8 = String8(kvpairs);
-    AudioParameter parms = AudioParameter(String8(kvpairs));
 
-    if (parms.getInt(String8(AUDIO_PARAMETER_STREAM_ROUTING), val) == NO_ERROR) {
-        val = convert_audio_device(val, HAL_API_REV_2_0, HAL_API_REV_1_0);
-        parms.remove(String8(AUDIO_PARAMETER_STREAM_ROUTING));
-        parms.addInt(String8(AUDIO_PARAMETER_STREAM_ROUTING), val);
-        s8 = parms.toString();
+    if (view.getInt(AudioParameterView::KEY_ROUTING, &val) != NO_ERROR)
+        return String8(kvpairs);
+
+    val = convert_audio_device(val, HAL_API_REV_2_0, HAL_API_REV_1_0);
+    if (view.size() == 1) {
+        char routing[32];
+        snprintf(routing, sizeof(routing), "%s=%d", AUDIO_PARAMETER_STREAM_ROUTING, val);
+        return String8(routing);
     }
 
-    return out->legacy_out->setParameters(s8);
+    AudioParameter parms = AudioParameter(String8(kvpairs));
+    parms.remove(String8(AUDIO_PARAMETER_STREAM_ROUTING));
+    parms.addInt(String8(AUDIO_PARAMETER_STREAM_ROUTING), val);
+    return parms.toString();
+}
+
+static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
+{
+    struct legacy_stream_out *out =
+        reinterpret_cast<struct legacy_stream_out *>(stream);
+    String8 s8 = convert_set_parameters(kvpairs);
+
+    out_lock_legacy(out);
+    int ret = out->legacy_out->setParameters(s8);
+    out_unlock_legacy(out);
+    return ret;
 }
 
 static char * out_get_parameters(const struct audio_stream *stream, const char *keys)
@@ -204,15 +1501,22 @@ static char * out_get_parameters(const struct audio_stream *stream, const char *
     String8 s8;
     int val;
 
+    out_lock_legacy(out);
     s8 = out->legacy_out->getParameters(String8(keys));
+    out_unlock_legacy(out);
 
     AudioParameter parms = AudioParameter(s8);
+    bool changed = false;
     if (parms.getInt(String8(AUDIO_PARAMETER_STREAM_ROUTING), val) == NO_ERROR) {
         val = convert_audio_device(val, HAL_API_REV_1_0, HAL_API_REV_2_0);
         parms.remove(String8(AUDIO_PARAMETER_STREAM_ROUTING));
         parms.addInt(String8(AUDIO_PARAMETER_STREAM_ROUTING), val);
-        s8 = parms.toString();
+        changed = true;
     }
+    if (out->telemetry && telemetry_get_parameter(out->telemetry, keys, parms))
+        changed = true;
+    if (changed)
+        s8 = parms.toString();
 
     return strdup(s8.string());
 }
@@ -221,7 +1525,18 @@ static uint32_t out_get_latency(const struct audio_stream_out *stream)
 {
     const struct legacy_stream_out *out =
         reinterpret_cast<const struct legacy_stream_out *>(stream);
-    return out->legacy_out->latency();
+    out_lock_legacy(out);
+    uint32_t latency = out->legacy_out->latency();
+    uint32_t rate = out->legacy_out->sampleRate();
+    out_unlock_legacy(out);
+
+    /* audio can wait in a full ring before reaching the legacy stream */
+    if (out->async_writer) {
+        const struct legacy_async_writer *writer = out->async_writer;
+        latency += (uint32_t)(((uint64_t)(writer->size - writer->frame_size) /
+                               writer->frame_size) * 1000 / rate);
+    }
+    return latency;
 }
 
 static int out_set_volume(struct audio_stream_out *stream, float left,
@@ -229,7 +1544,53 @@ static int out_set_volume(struct audio_stream_out *stream, float left,
 {
     struct legacy_stream_out *out =
         reinterpret_cast<struct legacy_stream_out *>(stream);
-    return out->legacy_out->setVolume(left, right);
+    out_lock_legacy(out);
+    int ret = out->legacy_out->setVolume(left, right);
+    out_unlock_legacy(out);
+    return ret;
+}
+
+/* writes audio at the legacy rate */
+static ssize_t out_write_legacy(struct legacy_stream_out *out, const void* buffer,
+                                size_t bytes)
+{
+    ssize_t ret;
+
+    if (out->async_writer)
+        return async_writer_write(out->async_writer, buffer, bytes);
+    int64_t start_ns = telemetry_begin();
+    ret = out->legacy_out->write(buffer, bytes);
+    if (out->telemetry)
+        telemetry_end(out->telemetry, start_ns, ret);
+    if (ret > 0 && out->write_clock)
+        write_clock_update(out->write_clock, ret);
+    return ret;
+}
+
+/* writes audio in the legacy format */
+static ssize_t out_write_resampled(struct legacy_stream_out *out, const void* buffer,
+                                   size_t bytes)
+{
+    struct legacy_rate_converter *conv = out->rate_converter;
+
+    if (!conv)
+        return out_write_legacy(out, buffer, bytes);
+
+    const int16_t *src = (const int16_t *)buffer;
+    size_t frames = bytes / conv->frame_size;
+    while (frames > 0) {
+        size_t consumed = frames;
+        size_t produced = conv->buffer_frames;
+        conv->resampler->resample(src, &consumed, conv->buffer, &produced);
+        if (produced > 0) {
+            ssize_t ret = out_write_legacy(out, conv->buffer, produced * conv->frame_size);
+            if (ret < 0)
+                return ret;
+        }
+        src += consumed * conv->channel_count;
+        frames -= consumed;
+    }
+    return bytes;
 }
 
 static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
@@ -237,7 +1598,25 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
 {
     struct legacy_stream_out *out =
         reinterpret_cast<struct legacy_stream_out *>(stream);
-    return out->legacy_out->write(buffer, bytes);
+    struct legacy_format_converter *conv = out->format_converter;
+
+    if (!conv)
+        return out_write_resampled(out, buffer, bytes);
+
+    const uint8_t *src = (const uint8_t *)buffer;
+    size_t frames = bytes / conv->frame_size;
+    while (frames > 0) {
+        size_t count = frames;
+        if (count > conv->converter->maxFrames())
+            count = conv->converter->maxFrames();
+        conv->converter->convert(src, conv->buffer, count);
+        ssize_t ret = out_write_resampled(out, conv->buffer, count * conv->legacy_frame_size);
+        if (ret < 0)
+            return ret;
+        src += count * conv->frame_size;
+        frames -= count;
+    }
+    return bytes;
 }
 
 static int out_get_render_position(const struct audio_stream_out *stream,
@@ -245,7 +1624,19 @@ static int out_get_render_position(const struct audio_stream_out *stream,
 {
     const struct legacy_stream_out *out =
         reinterpret_cast<const struct legacy_stream_out *>(stream);
-    return out->legacy_out->getRenderPosition(dsp_frames);
+    out_lock_legacy(out);
+    int ret = out->legacy_out->getRenderPosition(dsp_frames);
+    uint32_t latency = out->legacy_out->latency();
+    out_unlock_legacy(out);
+
+    /* estimate the position when the legacy stream does not report it */
+    if (ret != 0 && out->write_clock) {
+        *dsp_frames = (uint32_t)write_clock_position(out->write_clock, latency);
+        ret = 0;
+    }
+    if (ret == 0 && out->rate_converter)
+        *dsp_frames = (uint32_t)rate_converter_frames(out->rate_converter, *dsp_frames);
+    return ret;
 }
 
 #ifndef ICS_AUDIO_BLOB
@@ -254,7 +1645,20 @@ static int out_get_next_write_timestamp(const struct audio_stream_out *stream,
 {
     const struct legacy_stream_out *out =
         reinterpret_cast<const struct legacy_stream_out *>(stream);
-    return out->legacy_out->getNextWriteTimestamp(timestamp);
+    out_lock_legacy(out);
+    int ret = out->legacy_out->getNextWriteTimestamp(timestamp);
+    uint32_t latency = out->legacy_out->latency();
+    uint32_t rate = out->legacy_out->sampleRate();
+    out_unlock_legacy(out);
+
+    if (ret != 0 && out->write_clock)
+        ret = write_clock_next_write_time(out->write_clock, latency, timestamp);
+    /* the next write is presented after the audio still queued in the ring */
+    if (ret == 0 && out->async_writer) {
+        *timestamp += (int64_t)async_writer_pending_frames(out->async_writer) * 1000000 /
+                      rate;
+    }
+    return ret;
 }
 #endif
 
@@ -273,7 +1677,12 @@ static uint32_t in_get_sample_rate(const struct audio_stream *stream)
 {
     const struct legacy_stream_in *in =
         reinterpret_cast<const struct legacy_stream_in *>(stream);
-    return in->legacy_in->sampleRate();
+    if (in->rate_converter)
+        return in->rate_converter->rate;
+    in_lock_legacy(in);
+    uint32_t rate = in->legacy_in->sampleRate();
+    in_unlock_legacy(in);
+    return rate;
 }
 
 static int in_set_sample_rate(struct audio_stream *stream, uint32_t rate)
@@ -290,22 +1699,44 @@ static size_t in_get_buffer_size(const struct audio_stream *stream)
 {
     const struct legacy_stream_in *in =
         reinterpret_cast<const struct legacy_stream_in *>(stream);
-    return in->legacy_in->bufferSize();
+    in_lock_legacy(in);
+    size_t buffer_size = in->legacy_in->bufferSize();
+    size_t frame_size = in->legacy_in->frameSize();
+    in_unlock_legacy(in);
+    if (!in->rate_converter && !in->format_converter)
+        return buffer_size;
+
+    size_t frames = buffer_size / frame_size;
+    if (in->rate_converter)
+        frames = rate_converter_buffer_frames(in->rate_converter, frames);
+    if (in->format_converter)
+        return frames * in->format_converter->frame_size;
+    return frames * frame_size;
 }
 
 static audio_channel_mask_t in_get_channels(const struct audio_stream *stream)
 {
     const struct legacy_stream_in *in =
         reinterpret_cast<const struct legacy_stream_in *>(stream);
-    return (audio_channel_mask_t) in->legacy_in->channels();
+    if (in->format_converter)
+        return (audio_channel_mask_t) in->format_converter->channels;
+    in_lock_legacy(in);
+    uint32_t channels = in->legacy_in->channels();
+    in_unlock_legacy(in);
+    return (audio_channel_mask_t) channels;
 }
 
 static audio_format_t in_get_format(const struct audio_stream *stream)
 {
     const struct legacy_stream_in *in =
         reinterpret_cast<const struct legacy_stream_in *>(stream);
+    if (in->format_converter)
+        return (audio_format_t) in->format_converter->format;
+    in_lock_legacy(in);
     // legacy API, don't change return type
-    return (audio_format_t) in->legacy_in->format();
+    int format = in->legacy_in->format();
+    in_unlock_legacy(in);
+    return (audio_format_t) format;
 }
 
 static int in_set_format(struct audio_stream *stream, audio_format_t format)
@@ -320,7 +1751,20 @@ static int in_set_format(struct audio_stream *stream, audio_format_t format)
 static int in_standby(struct audio_stream *stream)
 {
     struct legacy_stream_in *in = reinterpret_cast<struct legacy_stream_in *>(stream);
-    return in->legacy_in->standby();
+    int ret;
+
+    if (!in->capture_ring) {
+        ret = in->legacy_in->standby();
+    } else {
+        capture_ring_stop(in->capture_ring);
+        ret = in->legacy_in->standby();
+        pthread_mutex_unlock(&in->capture_ring->legacy_lock);
+    }
+    if (in->telemetry)
+        telemetry_standby(in->telemetry);
+    if (in->rate_converter)
+        rate_converter_reset(in->rate_converter);
+    return ret;
 }
 
 static int in_dump(const struct audio_stream *stream, int fd)
@@ -328,25 +1772,52 @@ static int in_dump(const struct audio_stream *stream, int fd)
     const struct legacy_stream_in *in =
         reinterpret_cast<const struct legacy_stream_in *>(stream);
     Vector<String16> args;
-    return in->legacy_in->dump(fd, args);
+    in_lock_legacy(in);
+    int ret = in->legacy_in->dump(fd, args);
+    in_unlock_legacy(in);
+    if (in->capture_ring)
+        capture_ring_dump(in->capture_ring, fd);
+    if (in->format_converter)
+        format_converter_dump(in->format_converter, fd);
+    if (in->rate_converter)
+        rate_converter_dump(in->rate_converter, fd);
+    if (in->telemetry)
+        telemetry_dump(in->telemetry, fd);
+    return ret;
 }
 
 static int in_set_parameters(struct audio_stream *stream, const char *kvpairs)
 {
     struct legacy_stream_in *in =
         reinterpret_cast<struct legacy_stream_in *>(stream);
-    int val;
-    AudioParameter parms = AudioParameter(String8(kvpairs));
-    String8 s8 = String8(kvpairs);
+    String8 s8 = convert_set_parameters(kvpairs);
 
-    if (parms.getInt(String8(AUDIO_PARAMETER_STREAM_ROUTING), val) == NO_ERROR) {
-        val = convert_audio_device(val, HAL_API_REV_2_0, HAL_API_REV_1_0);
-        parms.remove(String8(AUDIO_PARAMETER_STREAM_ROUTING));
-        parms.addInt(String8(AUDIO_PARAMETER_STREAM_ROUTING), val);
-        s8 = parms.toString();
-    }
+    in_lock_legacy(in);
+    int ret = in->legacy_in->setParameters(s8);
+    in_unlock_legacy(in);
+    return ret;
+}
 
-    return in->legacy_in->setParameters(s8);
+/* adds the capture position parameter to the reply of get_parameters() if it was requested:
+ * "frames:<position since standby>,time_ns:<CLOCK_MONOTONIC capture time>" of the next frame
+ * in_read() returns */
+static bool in_get_capture_position(const struct legacy_stream_in *in, const char *keys,
+                                    AudioParameter& reply)
+{
+    AudioParameterView view(keys);
+    uint64_t frames;
+    int64_t time_ns;
+    char value[64];
+
+    if (!view.has(AudioParameterView::KEY_CAPTURE_POSITION) || !in->capture_ring ||
+            capture_ring_position(in->capture_ring, &frames, &time_ns) != 0)
+        return false;
+    if (in->rate_converter)
+        frames = rate_converter_frames(in->rate_converter, frames);
+    snprintf(value, sizeof(value), "frames:%llu,time_ns:%lld", (unsigned long long)frames,
+             (long long)time_ns);
+    reply.add(String8(CAPTURE_POSITION_PARAMETER), String8(value));
+    return true;
 }
 
 static char * in_get_parameters(const struct audio_stream *stream,
@@ -357,15 +1828,24 @@ static char * in_get_parameters(const struct audio_stream *stream,
     String8 s8;
     int val;
 
+    in_lock_legacy(in);
     s8 = in->legacy_in->getParameters(String8(keys));
+    in_unlock_legacy(in);
 
     AudioParameter parms = AudioParameter(s8);
+    bool changed = false;
     if (parms.getInt(String8(AUDIO_PARAMETER_STREAM_ROUTING), val) == NO_ERROR) {
         val = convert_audio_device(val, HAL_API_REV_1_0, HAL_API_REV_2_0);
         parms.remove(String8(AUDIO_PARAMETER_STREAM_ROUTING));
         parms.addInt(String8(AUDIO_PARAMETER_STREAM_ROUTING), val);
-        s8 = parms.toString();
+        changed = true;
     }
+    if (in->telemetry && telemetry_get_parameter(in->telemetry, keys, parms))
+        changed = true;
+    if (in_get_capture_position(in, keys, parms))
+        changed = true;
+    if (changed)
+        s8 = parms.toString();
 
     return strdup(s8.string());
 }
@@ -374,7 +1854,57 @@ static int in_set_gain(struct audio_stream_in *stream, float gain)
 {
     struct legacy_stream_in *in =
         reinterpret_cast<struct legacy_stream_in *>(stream);
-    return in->legacy_in->setGain(gain);
+    in_lock_legacy(in);
+    int ret = in->legacy_in->setGain(gain);
+    in_unlock_legacy(in);
+    return ret;
+}
+
+/* reads audio at the legacy rate */
+static ssize_t in_read_legacy(struct legacy_stream_in *in, void* buffer, size_t bytes)
+{
+    if (in->capture_ring)
+        return capture_ring_read(in->capture_ring, buffer, bytes);
+
+    int64_t start_ns = telemetry_begin();
+    ssize_t ret = in->legacy_in->read(buffer, bytes);
+    if (in->telemetry)
+        telemetry_end(in->telemetry, start_ns, ret);
+    return ret;
+}
+
+/* reads audio in the legacy format */
+static ssize_t in_read_resampled(struct legacy_stream_in *in, void* buffer, size_t bytes)
+{
+    struct legacy_rate_converter *conv = in->rate_converter;
+
+    if (!conv)
+        return in_read_legacy(in, buffer, bytes);
+
+    /* audio read from the legacy stream but not converted yet is kept for the next read */
+    int16_t *dst = (int16_t *)buffer;
+    size_t frames = bytes / conv->frame_size;
+    while (frames > 0) {
+        if (conv->count == 0) {
+            ssize_t ret = in_read_legacy(in, conv->buffer,
+                                         conv->buffer_frames * conv->frame_size);
+            if (ret <= 0)
+                return ret;
+            conv->offset = 0;
+            conv->count = ret / conv->frame_size;
+            if (conv->count == 0)
+                return -EIO;
+        }
+        size_t consumed = conv->count;
+        size_t produced = frames;
+        conv->resampler->resample(conv->buffer + conv->offset * conv->channel_count,
+                                  &consumed, dst, &produced);
+        conv->offset += consumed;
+        conv->count -= consumed;
+        dst += produced * conv->channel_count;
+        frames -= produced;
+    }
+    return bytes;
 }
 
 static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
@@ -382,28 +1912,63 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
 {
     struct legacy_stream_in *in =
         reinterpret_cast<struct legacy_stream_in *>(stream);
-    return in->legacy_in->read(buffer, bytes);
+    struct legacy_format_converter *conv = in->format_converter;
+
+    if (!conv)
+        return in_read_resampled(in, buffer, bytes);
+
+    uint8_t *dst = (uint8_t *)buffer;
+    size_t frames = bytes / conv->frame_size;
+    while (frames > 0) {
+        size_t count = frames;
+        if (count > conv->converter->maxFrames())
+            count = conv->converter->maxFrames();
+        ssize_t ret = in_read_resampled(in, conv->buffer, count * conv->legacy_frame_size);
+        if (ret <= 0)
+            return ret;
+        count = ret / conv->legacy_frame_size;
+        if (count == 0)
+            return -EIO;
+        conv->converter->convert(conv->buffer, dst, count);
+        dst += count * conv->frame_size;
+        frames -= count;
+    }
+    return bytes;
 }
 
 static uint32_t in_get_input_frames_lost(struct audio_stream_in *stream)
 {
     struct legacy_stream_in *in =
         reinterpret_cast<struct legacy_stream_in *>(stream);
-    return in->legacy_in->getInputFramesLost();
+
+    in_lock_legacy(in);
+    uint32_t lost = in->legacy_in->getInputFramesLost();
+    in_unlock_legacy(in);
+    if (in->capture_ring)
+        lost += capture_ring_frames_lost(in->capture_ring);
+    if (in->rate_converter)
+        lost = (uint32_t)rate_converter_frames(in->rate_converter, lost);
+    return lost;
 }
 
 static int in_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
 {
     const struct legacy_stream_in *in =
         reinterpret_cast<const struct legacy_stream_in *>(stream);
-    return in->legacy_in->addAudioEffect(effect);
+    in_lock_legacy(in);
+    int ret = in->legacy_in->addAudioEffect(effect);
+    in_unlock_legacy(in);
+    return ret;
 }
 
 static int in_remove_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
 {
     const struct legacy_stream_in *in =
         reinterpret_cast<const struct legacy_stream_in *>(stream);
-    return in->legacy_in->removeAudioEffect(effect);
+    in_lock_legacy(in);
+    int ret = in->legacy_in->removeAudioEffect(effect);
+    in_unlock_legacy(in);
+    return ret;
 }
 
 /** audio_hw_device implementation **/
@@ -479,13 +2044,59 @@ static char * adev_get_parameters(const struct audio_hw_device *dev,
     return strdup(s8.string());
 }
 
+/* When the legacy HAL does not support the configuration and conversion is enabled, returns the
+ * buffer size of the first 16 bit mono or stereo legacy configuration it supports, scaled to
+ * the requested rate and frame size. */
+static size_t get_input_buffer_size(AudioHardwareInterface *hwif, uint32_t sample_rate,
+                                    int format, int channel_count)
+{
+    static const uint32_t legacy_rates[] = { 8000, 16000, 44100, 48000, 22050, 11025, 32000 };
+    LegacyResampler::quality quality;
+
+    size_t size = hwif->getInputBufferSize(sample_rate, format, channel_count);
+    if (size != 0 || channel_count <= 0 || channel_count > 2)
+        return size;
+
+    size_t frame_size = channel_count *
+        LegacyFormatConverter::sampleSize(format_converter_sample_format(format));
+    bool format_conversion = format_converter_enabled();
+    bool rate_conversion = rate_converter_enabled(&quality);
+    if (frame_size == 0 || (!format_conversion && !rate_conversion))
+        return 0;
+
+    const int legacy_channel_counts[] = { channel_count, 3 - channel_count };
+    for (size_t c = 0; c < 2; c++) {
+        int legacy_channel_count = legacy_channel_counts[c];
+        size_t legacy_frame_size = legacy_channel_count * sizeof(int16_t);
+        if ((format != AUDIO_FORMAT_PCM_16_BIT || legacy_channel_count != channel_count) &&
+                !format_conversion)
+            continue;
+        size = hwif->getInputBufferSize(sample_rate, AUDIO_FORMAT_PCM_16_BIT,
+                                        legacy_channel_count);
+        if (size != 0)
+            return size / legacy_frame_size * frame_size;
+        if (!rate_conversion)
+            continue;
+        for (size_t i = 0; i < sizeof(legacy_rates) / sizeof(legacy_rates[0]); i++) {
+            size = hwif->getInputBufferSize(legacy_rates[i], AUDIO_FORMAT_PCM_16_BIT,
+                                            legacy_channel_count);
+            if (size != 0) {
+                uint64_t frames = (uint64_t)(size / legacy_frame_size) * sample_rate /
+                    legacy_rates[i];
+                return (size_t)((frames + 15) & ~15ULL) * frame_size;
+            }
+        }
+    }
+    return 0;
+}
+
 #ifndef ICS_AUDIO_BLOB
 static size_t adev_get_input_buffer_size(const struct audio_hw_device *dev,
                                          const struct audio_config *config)
 {
     const struct legacy_audio_device *ladev = to_cladev(dev);
-    return ladev->hwif->getInputBufferSize(config->sample_rate, (int) config->format,
-                                           popcount(config->channel_mask));
+    return get_input_buffer_size(ladev->hwif, config->sample_rate, (int) config->format,
+                                 popcount(config->channel_mask));
 }
 #else
 static size_t adev_get_input_buffer_size(const struct audio_hw_device *dev,
@@ -493,7 +2104,7 @@ static size_t adev_get_input_buffer_size(const struct audio_hw_device *dev,
                                          int channel_count)
 {
     const struct legacy_audio_device *ladev = to_cladev(dev);
-    return ladev->hwif->getInputBufferSize(sample_rate, format, channel_count);
+    return get_input_buffer_size(ladev->hwif, sample_rate, format, channel_count);
 }
 #endif
 
@@ -516,7 +2127,18 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     struct legacy_audio_device *ladev = to_ladev(dev);
     status_t status;
     struct legacy_stream_out *out;
+    LegacyResampler::quality quality;
+    bool convert_format = false;
+    bool convert_rate = false;
     int ret;
+#ifndef ICS_AUDIO_BLOB
+    int *format = (int *) &config->format;
+    uint32_t *channels = &config->channel_mask;
+    uint32_t *sample_rate = &config->sample_rate;
+#endif
+    int requested_format = *format;
+    uint32_t requested_channels = *channels;
+    uint32_t requested_rate = *sample_rate;
 
     out = (struct legacy_stream_out *)calloc(1, sizeof(*out));
     if (!out)
@@ -524,14 +2146,52 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
 
     devices = convert_audio_device(devices, HAL_API_REV_2_0, HAL_API_REV_1_0);
 
-#ifndef ICS_AUDIO_BLOB
-    out->legacy_out = ladev->hwif->openOutputStream(devices, (int *) &config->format,
-                                                    &config->channel_mask,
-                                                    &config->sample_rate, &status);
-#else
     out->legacy_out = ladev->hwif->openOutputStream(devices, format, channels,
                                                     sample_rate, &status);
-#endif
+
+    /* a legacy stream rejecting the requested configuration returns one it supports:
+     * open it with that configuration and convert */
+    if (!out->legacy_out && status == BAD_VALUE) {
+        if (requested_format == 0)
+            requested_format = *format;
+        if (requested_channels == 0)
+            requested_channels = *channels;
+        if (requested_rate == 0)
+            requested_rate = *sample_rate;
+        if (stream_conversion_possible(requested_format, requested_channels, requested_rate,
+                                       *format, *channels, *sample_rate, false,
+                                       &convert_format, &convert_rate, &quality)) {
+            out->legacy_out = ladev->hwif->openOutputStream(devices, format, channels,
+                                                            sample_rate, &status);
+        }
+        if (out->legacy_out) {
+            size_t frame_size = out->legacy_out->frameSize();
+            size_t buffer_size = out->legacy_out->bufferSize();
+            if (convert_rate)
+                out->rate_converter = rate_converter_create(requested_rate, *sample_rate,
+                                                           frame_size, buffer_size, false,
+                                                           quality);
+            if (convert_format)
+                out->format_converter = format_converter_create(requested_format,
+                                                               requested_channels, *format,
+                                                               *channels, buffer_size / frame_size,
+                                                               false);
+            if ((convert_rate && !out->rate_converter) ||
+                    (convert_format && !out->format_converter)) {
+                if (out->rate_converter)
+                    rate_converter_destroy(out->rate_converter);
+                if (out->format_converter)
+                    format_converter_destroy(out->format_converter);
+                ladev->hwif->closeOutputStream(out->legacy_out);
+                out->legacy_out = NULL;
+                status = BAD_VALUE;
+            } else {
+                *format = requested_format;
+                *channels = requested_channels;
+                *sample_rate = requested_rate;
+            }
+        }
+    }
 
     if (!out->legacy_out) {
         ret = status;
@@ -557,6 +2217,11 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
 #ifndef ICS_AUDIO_BLOB
     out->stream.get_next_write_timestamp = out_get_next_write_timestamp;
 #endif
+    out->write_clock = write_clock_create(out->legacy_out);
+    out->telemetry = telemetry_create(out->legacy_out->frameSize(),
+                                      out->legacy_out->sampleRate());
+    out->async_writer = async_writer_create(out->legacy_out, out->write_clock,
+                                            out->telemetry);
 
     *stream_out = &out->stream;
     return 0;
@@ -573,6 +2238,16 @@ static void adev_close_output_stream(struct audio_hw_device *dev,
     struct legacy_audio_device *ladev = to_ladev(dev);
     struct legacy_stream_out *out = reinterpret_cast<struct legacy_stream_out *>(stream);
 
+    if (out->async_writer)
+        async_writer_destroy(out->async_writer);
+    if (out->write_clock)
+        write_clock_destroy(out->write_clock);
+    if (out->telemetry)
+        telemetry_destroy(out->telemetry);
+    if (out->rate_converter)
+        rate_converter_destroy(out->rate_converter);
+    if (out->format_converter)
+        format_converter_destroy(out->format_converter);
     ladev->hwif->closeOutputStream(out->legacy_out);
     free(out);
 }
@@ -593,7 +2268,21 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     struct legacy_audio_device *ladev = to_ladev(dev);
     status_t status;
     struct legacy_stream_in *in;
+    LegacyResampler::quality quality;
+    bool convert_format = false;
+    bool convert_rate = false;
     int ret;
+#ifndef ICS_AUDIO_BLOB
+    int *format = (int *) &config->format;
+    uint32_t *channels = &config->channel_mask;
+    uint32_t *sample_rate = &config->sample_rate;
+    AudioSystem::audio_in_acoustics in_acoustics = (AudioSystem::audio_in_acoustics)0;
+#else
+    AudioSystem::audio_in_acoustics in_acoustics = (AudioSystem::audio_in_acoustics)acoustics;
+#endif
+    int requested_format = *format;
+    uint32_t requested_channels = *channels;
+    uint32_t requested_rate = *sample_rate;
 
     in = (struct legacy_stream_in *)calloc(1, sizeof(*in));
     if (!in)
@@ -601,15 +2290,53 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
 
     devices = convert_audio_device(devices, HAL_API_REV_2_0, HAL_API_REV_1_0);
 
-#ifndef ICS_AUDIO_BLOB
-    in->legacy_in = ladev->hwif->openInputStream(devices, (int *) &config->format,
-                                                 &config->channel_mask, &config->sample_rate,
-                                                 &status, (AudioSystem::audio_in_acoustics)0);
-#else
-    in->legacy_in = ladev->hwif->openInputStream(devices, format, channels,
-                                    sample_rate, &status,
-                                    (AudioSystem::audio_in_acoustics)acoustics);
-#endif
+    in->legacy_in = ladev->hwif->openInputStream(devices, format, channels, sample_rate,
+                                                 &status, in_acoustics);
+
+    /* a legacy stream rejecting the requested configuration returns one it supports:
+     * open it with that configuration and convert */
+    if (!in->legacy_in && status == BAD_VALUE) {
+        if (requested_format == 0)
+            requested_format = *format;
+        if (requested_channels == 0)
+            requested_channels = *channels;
+        if (requested_rate == 0)
+            requested_rate = *sample_rate;
+        if (stream_conversion_possible(requested_format, requested_channels, requested_rate,
+                                       *format, *channels, *sample_rate, true,
+                                       &convert_format, &convert_rate, &quality)) {
+            in->legacy_in = ladev->hwif->openInputStream(devices, format, channels,
+                                                         sample_rate, &status, in_acoustics);
+        }
+        if (in->legacy_in) {
+            size_t frame_size = in->legacy_in->frameSize();
+            size_t buffer_size = in->legacy_in->bufferSize();
+            if (convert_rate)
+                in->rate_converter = rate_converter_create(requested_rate, *sample_rate,
+                                                           frame_size, buffer_size, true,
+                                                           quality);
+            if (convert_format)
+                in->format_converter = format_converter_create(requested_format,
+                                                               requested_channels, *format,
+                                                               *channels, buffer_size / frame_size,
+                                                               true);
+            if ((convert_rate && !in->rate_converter) ||
+                    (convert_format && !in->format_converter)) {
+                if (in->rate_converter)
+                    rate_converter_destroy(in->rate_converter);
+                if (in->format_converter)
+                    format_converter_destroy(in->format_converter);
+                ladev->hwif->closeInputStream(in->legacy_in);
+                in->legacy_in = NULL;
+                status = BAD_VALUE;
+            } else {
+                *format = requested_format;
+                *channels = requested_channels;
+                *sample_rate = requested_rate;
+            }
+        }
+    }
+
     if (!in->legacy_in) {
         ret = status;
         goto err_open;
@@ -630,6 +2357,8 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     in->stream.set_gain = in_set_gain;
     in->stream.read = in_read;
     in->stream.get_input_frames_lost = in_get_input_frames_lost;
+    in->telemetry = telemetry_create(in->legacy_in->frameSize(), in->legacy_in->sampleRate());
+    in->capture_ring = capture_ring_create(in->legacy_in, in->telemetry);
 
     *stream_in = &in->stream;
     return 0;
@@ -647,6 +2376,14 @@ static void adev_close_input_stream(struct audio_hw_device *dev,
     struct legacy_stream_in *in =
         reinterpret_cast<struct legacy_stream_in *>(stream);
 
+    if (in->capture_ring)
+        capture_ring_destroy(in->capture_ring);
+    if (in->telemetry)
+        telemetry_destroy(in->telemetry);
+    if (in->rate_converter)
+        rate_converter_destroy(in->rate_converter);
+    if (in->format_converter)
+        format_converter_destroy(in->format_converter);
     ladev->hwif->closeInputStream(in->legacy_in);
     free(in);
 }
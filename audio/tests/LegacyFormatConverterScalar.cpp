@@ -0,0 +1,22 @@
+/*
+**
+** Copyright 2011, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+// LegacyFormatConverter built without SIMD kernels in namespace legacy_audio_scalar: the
+// reference legacy_audio_kernel_bench checks the SIMD kernels against
+#define LEGACY_AUDIO_SCALAR_KERNELS
+#define android_audio_legacy legacy_audio_scalar
+#include "../LegacyFormatConverter.cpp"
@@ -0,0 +1,362 @@
+/*
+**
+** Copyright 2011, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+// audio_policy_lock_bench [seconds per run] [max callers]
+//
+// Measures the contention on the AudioPolicyManagerBase domain locks under N concurrent
+// callers, N = 1, 2, 4... max callers. Callers rotate between a volume query (LOCK_VOLUME),
+// an effect registration cycle (LOCK_EFFECT) and an input open/close cycle (LOCK_INPUT)
+// while a routing caller toggles the wired headset connection (LOCK_ALL). Each run is
+// repeated with every call serialized by a single mutex, as when all the calls were made
+// under one policy lock.
+//
+// The stub client emulates AudioFlinger: its output and input operations, parameter and
+// volume changes take a "flinger" lock, and the effect callers hold that lock while calling
+// the manager, as AudioFlinger::createEffect_l() does. The bench therefore also checks the
+// lock order documented in AudioPolicyManagerBase.h: it does not complete if LOCK_EFFECT is
+// not a leaf lock.
+//
+// Run it as the shell user: the bench manager saves its state snapshot like the media server
+// one, and replaces AUDIO_POLICY_STATE_SNAPSHOT_FILE when allowed to write it.
+
+#define LOG_TAG "AudioPolicyLockBench"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <utils/Timers.h>
+#include <utils/threads.h>
+#include <hardware/audio_effect.h>
+#include <hardware_legacy/AudioPolicyManagerBase.h>
+
+using namespace android_audio_legacy;
+using android::Mutex;
+using android::NO_ERROR;
+
+#define DEFAULT_SECONDS_PER_RUN 1.0
+#define DEFAULT_MAX_CALLERS 8
+// pause of the routing caller between two connection changes
+#define ROUTING_PERIOD_US 1000
+
+// lock of the emulated AudioFlinger
+static Mutex gFlingerLock;
+
+class StubClient : public AudioPolicyClientInterface
+{
+public:
+    StubClient() : mNextModule(1), mNextIo(1) {}
+
+    virtual audio_module_handle_t loadHwModule(const char *name)
+    {
+        Mutex::Autolock _l(gFlingerLock);
+        return mNextModule++;
+    }
+    virtual audio_io_handle_t openOutput(audio_module_handle_t module,
+                                         audio_devices_t *pDevices,
+                                         uint32_t *pSamplingRate,
+                                         audio_format_t *pFormat,
+                                         audio_channel_mask_t *pChannelMask,
+                                         uint32_t *pLatencyMs,
+                                         audio_output_flags_t flags,
+                                         const audio_offload_info_t *offloadInfo)
+    {
+        Mutex::Autolock _l(gFlingerLock);
+        if (*pSamplingRate == 0) {
+            *pSamplingRate = 48000;
+        }
+        if (*pFormat == AUDIO_FORMAT_DEFAULT) {
+            *pFormat = AUDIO_FORMAT_PCM_16_BIT;
+        }
+        if (*pChannelMask == 0) {
+            *pChannelMask = AUDIO_CHANNEL_OUT_STEREO;
+        }
+        *pLatencyMs = 40;
+        return mNextIo++;
+    }
+    virtual audio_io_handle_t openDuplicateOutput(audio_io_handle_t output1,
+                                                  audio_io_handle_t output2)
+    {
+        Mutex::Autolock _l(gFlingerLock);
+        return mNextIo++;
+    }
+    virtual status_t closeOutput(audio_io_handle_t output)
+    {
+        Mutex::Autolock _l(gFlingerLock);
+        return NO_ERROR;
+    }
+    virtual status_t suspendOutput(audio_io_handle_t output)
+    {
+        Mutex::Autolock _l(gFlingerLock);
+        return NO_ERROR;
+    }
+    virtual status_t restoreOutput(audio_io_handle_t output)
+    {
+        Mutex::Autolock _l(gFlingerLock);
+        return NO_ERROR;
+    }
+    virtual audio_io_handle_t openInput(audio_module_handle_t module,
+                                        audio_devices_t *pDevices,
+                                        uint32_t *pSamplingRate,
+                                        audio_format_t *pFormat,
+                                        audio_channel_mask_t *pChannelMask)
+    {
+        Mutex::Autolock _l(gFlingerLock);
+        return mNextIo++;
+    }
+    virtual status_t closeInput(audio_io_handle_t input)
+    {
+        Mutex::Autolock _l(gFlingerLock);
+        return NO_ERROR;
+    }
+    virtual status_t setStreamVolume(AudioSystem::stream_type stream, float volume,
+                                     audio_io_handle_t output, int delayMs)
+    {
+        Mutex::Autolock _l(gFlingerLock);
+        return NO_ERROR;
+    }
+    virtual status_t setStreamOutput(AudioSystem::stream_type stream, audio_io_handle_t output)
+    {
+        Mutex::Autolock _l(gFlingerLock);
+        return NO_ERROR;
+    }
+    virtual void setParameters(audio_io_handle_t ioHandle, const String8& keyValuePairs,
+                               int delayMs)
+    {
+        Mutex::Autolock _l(gFlingerLock);
+    }
+    virtual String8 getParameters(audio_io_handle_t ioHandle, const String8& keys)
+    {
+        Mutex::Autolock _l(gFlingerLock);
+        return String8("");
+    }
+    virtual status_t startTone(ToneGenerator::tone_type tone, AudioSystem::stream_type stream)
+    {
+        return NO_ERROR;
+    }
+    virtual status_t stopTone()
+    {
+        return NO_ERROR;
+    }
+    virtual status_t setVoiceVolume(float volume, int delayMs)
+    {
+        Mutex::Autolock _l(gFlingerLock);
+        return NO_ERROR;
+    }
+    virtual status_t moveEffects(int session, audio_io_handle_t srcOutput,
+                                 audio_io_handle_t dstOutput)
+    {
+        Mutex::Autolock _l(gFlingerLock);
+        return NO_ERROR;
+    }
+
+private:
+    audio_module_handle_t mNextModule;
+    audio_io_handle_t mNextIo;
+};
+
+enum caller_type {
+    CALLER_VOLUME,
+    CALLER_EFFECT,
+    CALLER_INPUT,
+    CALLER_ROUTING,
+    NUM_CALLER_TYPES
+};
+
+static const char * const kCallerNames[NUM_CALLER_TYPES] = {
+    "volume", "effect", "input", "routing"
+};
+
+struct BenchContext {
+    AudioPolicyManagerBase *manager;
+    audio_io_handle_t effectOutput;
+    Mutex *serializeLock;   // NULL unless every call is serialized
+    volatile bool stop;
+};
+
+struct Caller {
+    BenchContext *context;
+    caller_type type;
+    int index;
+    pthread_t thread;
+    // results
+    uint32_t calls;
+    nsecs_t totalNs;
+    nsecs_t maxNs;
+};
+
+static void runCall(Caller *caller, uint32_t n)
+{
+    BenchContext *context = caller->context;
+    AudioPolicyManagerBase *manager = context->manager;
+
+    switch (caller->type) {
+    case CALLER_VOLUME: {
+        int index;
+        manager->getStreamVolumeIndex(AudioSystem::MUSIC, &index, AUDIO_DEVICE_OUT_SPEAKER);
+        } break;
+    case CALLER_EFFECT: {
+        effect_descriptor_t desc;
+        memset(&desc, 0, sizeof(desc));
+        strncpy(desc.name, "lock bench", EFFECT_STRING_LEN_MAX - 1);
+        int id = caller->index * 1000000 + (n % 1000000) + 1;
+        Mutex::Autolock _l(gFlingerLock);
+        manager->registerEffect(&desc, context->effectOutput, 0 /*STRATEGY_MEDIA*/,
+                                AUDIO_SESSION_OUTPUT_MIX, id);
+        manager->setEffectEnabled(id, true);
+        manager->unregisterEffect(id);
+        } break;
+    case CALLER_INPUT: {
+        audio_io_handle_t input = manager->getInput(AUDIO_SOURCE_MIC, 16000,
+                                                    AUDIO_FORMAT_PCM_16_BIT,
+                                                    AUDIO_CHANNEL_IN_MONO,
+                                                    (AudioSystem::audio_in_acoustics)0);
+        if (input != 0) {
+            manager->releaseInput(input);
+        }
+        } break;
+    case CALLER_ROUTING:
+        manager->setDeviceConnectionState(AUDIO_DEVICE_OUT_WIRED_HEADSET,
+                                          (n & 1) ? AudioSystem::DEVICE_STATE_UNAVAILABLE :
+                                                    AudioSystem::DEVICE_STATE_AVAILABLE,
+                                          "");
+        break;
+    default:
+        break;
+    }
+}
+
+static void *callerLoop(void *cookie)
+{
+    Caller *caller = (Caller *)cookie;
+    BenchContext *context = caller->context;
+
+    while (!context->stop) {
+        nsecs_t start = systemTime();
+        if (context->serializeLock != NULL) {
+            Mutex::Autolock _l(*context->serializeLock);
+            runCall(caller, caller->calls);
+        } else {
+            runCall(caller, caller->calls);
+        }
+        nsecs_t elapsed = systemTime() - start;
+        caller->calls++;
+        caller->totalNs += elapsed;
+        if (elapsed > caller->maxNs) {
+            caller->maxNs = elapsed;
+        }
+        if (caller->type == CALLER_ROUTING) {
+            usleep(ROUTING_PERIOD_US);
+        }
+    }
+    // leave the headset disconnected for the next run
+    if (caller->type == CALLER_ROUTING && (caller->calls & 1)) {
+        runCall(caller, 1);
+    }
+    return NULL;
+}
+
+// runs numCallers callers and a routing caller for the given time and prints one line per
+// caller type
+static void runBench(BenchContext *context, int numCallers, double seconds, bool serialize)
+{
+    Mutex serializeLock;
+    context->serializeLock = serialize ? &serializeLock : NULL;
+    context->stop = false;
+
+    Caller *callers = new Caller[numCallers + 1];
+    for (int i = 0; i <= numCallers; i++) {
+        Caller *caller = &callers[i];
+        caller->context = context;
+        caller->type = (i == numCallers) ? CALLER_ROUTING : (caller_type)(i % CALLER_ROUTING);
+        caller->index = i;
+        caller->calls = 0;
+        caller->totalNs = 0;
+        caller->maxNs = 0;
+        pthread_create(&caller->thread, NULL, callerLoop, caller);
+    }
+    usleep((useconds_t)(seconds * 1000000));
+    context->stop = true;
+    for (int i = 0; i <= numCallers; i++) {
+        pthread_join(callers[i].thread, NULL);
+    }
+
+    for (int type = 0; type < NUM_CALLER_TYPES; type++) {
+        uint32_t calls = 0;
+        nsecs_t totalNs = 0;
+        nsecs_t maxNs = 0;
+        for (int i = 0; i <= numCallers; i++) {
+            if (callers[i].type != type) {
+                continue;
+            }
+            calls += callers[i].calls;
+            totalNs += callers[i].totalNs;
+            if (callers[i].maxNs > maxNs) {
+                maxNs = callers[i].maxNs;
+            }
+        }
+        if (calls == 0) {
+            continue;
+        }
+        printf("%-12s %7d  %-8s %12.0f %12.2f %12.2f\n",
+               serialize ? "serialized" : "domain", numCallers, kCallerNames[type],
+               calls / seconds, (double)totalNs / calls / 1000, (double)maxNs / 1000);
+    }
+    delete[] callers;
+}
+
+int main(int argc, char **argv)
+{
+    double seconds = DEFAULT_SECONDS_PER_RUN;
+    int maxCallers = DEFAULT_MAX_CALLERS;
+    if (argc > 1) {
+        seconds = atof(argv[1]);
+    }
+    if (argc > 2) {
+        maxCallers = atoi(argv[2]);
+    }
+    if (seconds <= 0 || maxCallers <= 0) {
+        fprintf(stderr, "usage: %s [seconds per run] [max callers]\n", argv[0]);
+        return 2;
+    }
+
+    StubClient client;
+    AudioPolicyManagerBase *manager = new AudioPolicyManagerBase(&client);
+    if (manager->initCheck() != NO_ERROR) {
+        fprintf(stderr, "policy manager initialization failed\n");
+        delete manager;
+        return 1;
+    }
+    for (int stream = 0; stream < AudioSystem::NUM_STREAM_TYPES; stream++) {
+        manager->initStreamVolume((AudioSystem::stream_type)stream, 0, 15);
+    }
+
+    BenchContext context;
+    context.manager = manager;
+    context.effectOutput = manager->getOutputForEffect();
+
+    printf("%-12s %7s  %-8s %12s %12s %12s\n",
+           "locking", "callers", "call", "calls/s", "mean us", "max us");
+    for (int numCallers = 1; numCallers <= maxCallers; numCallers *= 2) {
+        runBench(&context, numCallers, seconds, false);
+        runBench(&context, numCallers, seconds, true);
+    }
+
+    delete manager;
+    return 0;
+}
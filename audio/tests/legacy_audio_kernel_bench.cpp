@@ -0,0 +1,296 @@
+/*
+**
+** Copyright 2011, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+// legacy_audio_kernel_bench [seconds per kernel]
+//
+// Measures the throughput of each resampler and format converter kernel as built for the
+// HAL wrapper (NEON or SSE2 when available) and of the same kernel built without SIMD, and
+// checks that both produce the same output bit for bit. Exits with status 1 on a mismatch.
+// Run it on the target before enabling the NEON kernels with BOARD_LEGACY_AUDIO_NEON_KERNELS.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../LegacyResampler.h"
+#include "../LegacyFormatConverter.h"
+
+// the same classes built with LEGACY_AUDIO_SCALAR_KERNELS, see LegacyResamplerScalar.cpp
+#undef ANDROID_LEGACY_RESAMPLER_H
+#undef ANDROID_LEGACY_FORMAT_CONVERTER_H
+#define android_audio_legacy legacy_audio_scalar
+#include "../LegacyResampler.h"
+#include "../LegacyFormatConverter.h"
+#undef android_audio_legacy
+
+typedef android_audio_legacy::LegacyResampler SimdResampler;
+typedef legacy_audio_scalar::LegacyResampler ScalarResampler;
+typedef android_audio_legacy::LegacyFormatConverter SimdConverter;
+typedef legacy_audio_scalar::LegacyFormatConverter ScalarConverter;
+typedef android_audio_legacy::LegacyFormatConverter Formats;
+
+// one second of 48 kHz audio per kernel run
+#define BENCH_FRAMES 48000
+// frames passed per call, as a HAL period
+#define BENCH_PERIOD_FRAMES 960
+#define DEFAULT_SECONDS_PER_KERNEL 0.5
+
+static double nowSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// deterministic pseudo random bytes, so that runs on different targets are comparable
+static void fillNoise(void *buffer, size_t bytes, uint32_t seed)
+{
+    uint8_t *p = (uint8_t *)buffer;
+    for (size_t i = 0; i < bytes; i++) {
+        seed = seed * 1664525 + 1013904223;
+        p[i] = (uint8_t)(seed >> 24);
+    }
+}
+
+// samples in [-1.25, 1.25] so that the saturation paths are exercised
+static void fillFloatNoise(float *buffer, size_t count, uint32_t seed)
+{
+    for (size_t i = 0; i < count; i++) {
+        seed = seed * 1664525 + 1013904223;
+        buffer[i] = ((int32_t)seed / 2147483648.0f) * 1.25f;
+    }
+}
+
+struct BenchResult {
+    double simdRate;    // samples per second
+    double scalarRate;
+    bool match;
+};
+
+static double sSecondsPerKernel = DEFAULT_SECONDS_PER_KERNEL;
+static int sMismatches = 0;
+
+static void report(const char *name, const BenchResult& result)
+{
+    printf("%-32s %11.1f %11.1f %7.2fx  %s\n", name, result.simdRate / 1e6,
+           result.scalarRate / 1e6, result.simdRate / result.scalarRate,
+           result.match ? "match" : "MISMATCH");
+    if (!result.match) {
+        sMismatches++;
+    }
+}
+
+// feeds the input one period at a time like the HAL wrapper. Returns the frames produced.
+template <class Resampler>
+static size_t runResampler(Resampler *resampler, const int16_t *in, size_t inFrames,
+                           int16_t *out, size_t outCapacity)
+{
+    size_t channels = resampler->channelCount();
+    size_t consumed = 0;
+    size_t produced = 0;
+
+    resampler->reset();
+    while (consumed < inFrames && produced < outCapacity) {
+        size_t inCount = inFrames - consumed;
+        if (inCount > BENCH_PERIOD_FRAMES) {
+            inCount = BENCH_PERIOD_FRAMES;
+        }
+        size_t outCount = outCapacity - produced;
+        resampler->resample(in + consumed * channels, &inCount,
+                            out + produced * channels, &outCount);
+        if (inCount == 0 && outCount == 0) {
+            break;
+        }
+        consumed += inCount;
+        produced += outCount;
+    }
+    return produced;
+}
+
+// output samples per second
+template <class Resampler>
+static double timeResampler(Resampler *resampler, const int16_t *in, size_t inFrames,
+                            int16_t *out, size_t outCapacity)
+{
+    double samples = 0;
+    double start = nowSeconds();
+    double elapsed;
+    do {
+        samples += runResampler(resampler, in, inFrames, out, outCapacity) *
+                resampler->channelCount();
+        elapsed = nowSeconds() - start;
+    } while (elapsed < sSecondsPerKernel);
+    return samples / elapsed;
+}
+
+static void benchResampler(uint32_t inRate, uint32_t outRate, uint32_t channels,
+                           SimdResampler::quality q, const char *qualityName)
+{
+    SimdResampler *simd = SimdResampler::create(inRate, outRate, channels, q);
+    ScalarResampler *scalar = ScalarResampler::create(inRate, outRate, channels,
+                                                      (ScalarResampler::quality)q);
+    if (simd == NULL || scalar == NULL) {
+        printf("resample %u->%u: not supported\n", inRate, outRate);
+        delete simd;
+        delete scalar;
+        return;
+    }
+
+    size_t inFrames = BENCH_FRAMES;
+    size_t outCapacity = (size_t)((uint64_t)inFrames * outRate / inRate) + 1;
+    int16_t *in = new int16_t[inFrames * channels];
+    int16_t *simdOut = new int16_t[outCapacity * channels];
+    int16_t *scalarOut = new int16_t[outCapacity * channels];
+    fillNoise(in, inFrames * channels * sizeof(int16_t), inRate ^ outRate);
+
+    BenchResult result;
+    size_t simdFrames = runResampler(simd, in, inFrames, simdOut, outCapacity);
+    size_t scalarFrames = runResampler(scalar, in, inFrames, scalarOut, outCapacity);
+    result.match = (simdFrames == scalarFrames) &&
+            (memcmp(simdOut, scalarOut, simdFrames * channels * sizeof(int16_t)) == 0);
+    result.simdRate = timeResampler(simd, in, inFrames, simdOut, outCapacity);
+    result.scalarRate = timeResampler(scalar, in, inFrames, scalarOut, outCapacity);
+
+    char name[64];
+    snprintf(name, sizeof(name), "resample %u->%u %uch %s", inRate, outRate, channels,
+             qualityName);
+    report(name, result);
+
+    delete[] in;
+    delete[] simdOut;
+    delete[] scalarOut;
+    delete simd;
+    delete scalar;
+}
+
+// input samples per second
+template <class Converter>
+static double timeConverter(Converter *converter, const uint8_t *in, uint8_t *out,
+                            size_t frames, uint32_t channels)
+{
+    double samples = 0;
+    double start = nowSeconds();
+    double elapsed;
+    do {
+        for (size_t i = 0; i < frames; i += BENCH_PERIOD_FRAMES) {
+            converter->convert(in + i * converter->inFrameSize(),
+                               out + i * converter->outFrameSize(), BENCH_PERIOD_FRAMES);
+        }
+        samples += (double)frames * channels;
+        elapsed = nowSeconds() - start;
+    } while (elapsed < sSecondsPerKernel);
+    return samples / elapsed;
+}
+
+static void benchConverter(const char *name, Formats::sample_format inFormat,
+                           uint32_t inChannels, Formats::sample_format outFormat,
+                           uint32_t outChannels)
+{
+    SimdConverter *simd = SimdConverter::create(inFormat, inChannels, outFormat, outChannels,
+                                                BENCH_PERIOD_FRAMES);
+    ScalarConverter *scalar = ScalarConverter::create(
+            (ScalarConverter::sample_format)inFormat, inChannels,
+            (ScalarConverter::sample_format)outFormat, outChannels, BENCH_PERIOD_FRAMES);
+    if (simd == NULL || scalar == NULL) {
+        printf("%s: not supported\n", name);
+        delete simd;
+        delete scalar;
+        return;
+    }
+
+    // a whole number of periods
+    size_t frames = (BENCH_FRAMES / BENCH_PERIOD_FRAMES) * BENCH_PERIOD_FRAMES;
+    size_t inBytes = frames * simd->inFrameSize();
+    size_t outBytes = frames * simd->outFrameSize();
+    uint8_t *in = new uint8_t[inBytes];
+    uint8_t *simdOut = new uint8_t[outBytes];
+    uint8_t *scalarOut = new uint8_t[outBytes];
+    if (inFormat == Formats::SAMPLE_FORMAT_FLOAT) {
+        fillFloatNoise((float *)in, frames * inChannels, inChannels);
+    } else {
+        fillNoise(in, inBytes, inFormat * 16 + inChannels);
+    }
+
+    BenchResult result;
+    for (size_t i = 0; i < frames; i += BENCH_PERIOD_FRAMES) {
+        simd->convert(in + i * simd->inFrameSize(), simdOut + i * simd->outFrameSize(),
+                      BENCH_PERIOD_FRAMES);
+        scalar->convert(in + i * scalar->inFrameSize(), scalarOut + i * scalar->outFrameSize(),
+                        BENCH_PERIOD_FRAMES);
+    }
+    result.match = memcmp(simdOut, scalarOut, outBytes) == 0;
+    result.simdRate = timeConverter(simd, in, simdOut, frames, inChannels);
+    result.scalarRate = timeConverter(scalar, in, scalarOut, frames, inChannels);
+    report(name, result);
+
+    delete[] in;
+    delete[] simdOut;
+    delete[] scalarOut;
+    delete simd;
+    delete scalar;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1) {
+        sSecondsPerKernel = atof(argv[1]);
+        if (sSecondsPerKernel <= 0) {
+            fprintf(stderr, "usage: %s [seconds per kernel]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    printf("%-32s %11s %11s %8s  %s\n", "kernel", "simd Ms/s", "scalar Ms/s", "speedup",
+           "simd vs scalar");
+
+    benchResampler(44100, 48000, 2, SimdResampler::LOW_QUALITY, "low");
+    benchResampler(44100, 48000, 2, SimdResampler::MEDIUM_QUALITY, "medium");
+    benchResampler(44100, 48000, 2, SimdResampler::HIGH_QUALITY, "high");
+    benchResampler(48000, 44100, 2, SimdResampler::HIGH_QUALITY, "high");
+    benchResampler(16000, 48000, 1, SimdResampler::HIGH_QUALITY, "high");
+    benchResampler(48000, 16000, 1, SimdResampler::HIGH_QUALITY, "high");
+
+    benchConverter("float -> int16 2ch", Formats::SAMPLE_FORMAT_FLOAT, 2,
+                   Formats::SAMPLE_FORMAT_INT16, 2);
+    benchConverter("int16 -> float 2ch", Formats::SAMPLE_FORMAT_INT16, 2,
+                   Formats::SAMPLE_FORMAT_FLOAT, 2);
+    benchConverter("q8.23 -> int16 2ch", Formats::SAMPLE_FORMAT_Q8_23, 2,
+                   Formats::SAMPLE_FORMAT_INT16, 2);
+    benchConverter("q31 -> int16 2ch", Formats::SAMPLE_FORMAT_Q31, 2,
+                   Formats::SAMPLE_FORMAT_INT16, 2);
+    benchConverter("packed24 -> int16 2ch", Formats::SAMPLE_FORMAT_PACKED_24, 2,
+                   Formats::SAMPLE_FORMAT_INT16, 2);
+    benchConverter("int16 -> packed24 2ch", Formats::SAMPLE_FORMAT_INT16, 2,
+                   Formats::SAMPLE_FORMAT_PACKED_24, 2);
+    benchConverter("int16 mono -> stereo", Formats::SAMPLE_FORMAT_INT16, 1,
+                   Formats::SAMPLE_FORMAT_INT16, 2);
+    benchConverter("int16 stereo -> mono", Formats::SAMPLE_FORMAT_INT16, 2,
+                   Formats::SAMPLE_FORMAT_INT16, 1);
+    benchConverter("int16 5.1 -> stereo", Formats::SAMPLE_FORMAT_INT16, 6,
+                   Formats::SAMPLE_FORMAT_INT16, 2);
+    benchConverter("int16 7.1 -> stereo", Formats::SAMPLE_FORMAT_INT16, 8,
+                   Formats::SAMPLE_FORMAT_INT16, 2);
+    benchConverter("float 5.1 -> int16 stereo", Formats::SAMPLE_FORMAT_FLOAT, 6,
+                   Formats::SAMPLE_FORMAT_INT16, 2);
+
+    if (sMismatches != 0) {
+        printf("%d kernel(s) differ from the scalar reference\n", sMismatches);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_AUDIO_PARAMETER_VIEW_H
+#define ANDROID_AUDIO_PARAMETER_VIEW_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <utils/Errors.h>
+
+namespace android_audio_legacy {
+    using android::status_t;
+
+// ----------------------------------------------------------------------------
+
+/**
+ * AudioParameterView is a read-only, allocation free alternative to AudioParameter
+ * for the "key1=value1;key2=value2" strings passed to setParameters().
+ * The pairs are scanned once at construction and the values of a small fixed set of
+ * keys are recorded as offsets into the original string, which must outlive the view.
+ * Keys outside of that set are only counted: callers compare size() with the number of
+ * keys they handled and fall back to AudioParameter when they need to forward the others.
+ */
+class AudioParameterView
+{
+public:
+    enum known_key {
+        KEY_ROUTING,            // AudioParameter::keyRouting
+        KEY_A2DP_SINK_ADDRESS,  // A2DP output stream, see A2dpAudioInterface.cpp
+        KEY_A2DP_SUSPENDED,     // A2DP hardware interface
+        KEY_BLUETOOTH_ENABLED,  // A2DP hardware interface
+        KEY_CLOSING,            // A2DP output stream
+        KEY_TELEMETRY,          // stream telemetry, see audio_hw_hal.cpp
+        KEY_CAPTURE_POSITION,   // input stream capture position, see audio_hw_hal.cpp
+        NUM_KNOWN_KEYS
+    };
+
+    explicit            AudioParameterView(const char *keyValuePairs);
+
+    // number of key/value pairs found, known or not
+            size_t      size() const { return mSize; }
+            bool        has(known_key key) const { return mValueOffset[key] >= 0; }
+
+    // returns a pointer to the (not NUL terminated) value and its length
+            status_t    get(known_key key, const char **value, size_t *length) const;
+    // copies the value NUL terminated into a caller supplied buffer
+            status_t    get(known_key key, char *value, size_t size) const;
+            status_t    getInt(known_key key, int *value) const;
+    // true if the value equals the given string
+            bool        equals(known_key key, const char *value) const;
+
+    static  const char *keyName(known_key key);
+
+private:
+    const char  *mKeyValuePairs;
+    int32_t     mValueOffset[NUM_KNOWN_KEYS];   // -1 when the key is absent
+    uint32_t    mValueLength[NUM_KNOWN_KEYS];
+    size_t      mSize;
+};
+
+}; // namespace android_audio_legacy
+
+#endif // ANDROID_AUDIO_PARAMETER_VIEW_H
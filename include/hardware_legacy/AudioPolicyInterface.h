@@ -252,6 +252,9 @@ public:
                                      audio_io_handle_t srcOutput,
                                      audio_io_handle_t dstOutput) = 0;
 
+    // same as setParameters() for a routing command caused by the policy event identified by eventId (0 if none).
+    virtual void setRoutingParameters(audio_io_handle_t ioHandle, const String8& keyValuePairs, int delayMs,
+                                      uint32_t eventId) { setParameters(ioHandle, keyValuePairs, delayMs); }
 };
 
 extern "C" AudioPolicyInterface* createAudioPolicyManager(AudioPolicyClientInterface *clientInterface);
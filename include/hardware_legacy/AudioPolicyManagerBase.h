@@ -19,12 +19,15 @@
 
 #include <stdint.h>
 #include <sys/types.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <cutils/config_utils.h>
 #include <cutils/misc.h>
 #include <utils/Timers.h>
 #include <utils/Errors.h>
 #include <utils/KeyedVector.h>
 #include <utils/SortedVector.h>
+#include <utils/threads.h>
 #include <hardware_legacy/AudioPolicyInterface.h>
 
 
@@ -58,6 +61,105 @@ namespace android_audio_legacy {
 // Can be overridden by the audio.offload.min.duration.secs property
 #define OFFLOAD_DEFAULT_MIN_DURATION_SECS 60
 
+// Number of latency samples kept per policy event type to compute routing command latency
+// percentiles in dump()
+#define ROUTING_LATENCY_HISTORY_SIZE 64
+
+// File where the policy manager state is saved so that it can be restored quickly after a
+// media server restart. See saveStateSnapshot()
+#define AUDIO_POLICY_STATE_SNAPSHOT_FILE "/data/misc/audio/audio_policy_state"
+// Time in milliseconds without further state change after which the snapshot is written.
+// Coalesces the bursts of updates caused e.g. by a volume key held down
+#define STATE_SNAPSHOT_WRITE_DELAY_MS 1000
+
+// Maximum number of USB audio device capabilities remembered. See loadUsbCapabilities()
+#define MAX_USB_CAPABILITIES 16
+
+// System property set by the platform to enter ("1") or leave ("0") the media idle mode,
+// e.g. when the screen turns off. See checkMediaIdleMode()
+#define MEDIA_IDLE_MODE_PROPERTY "audio.policy.media_idle"
+
+// Interval in milliseconds at which MEDIA_IDLE_MODE_PROPERTY is read while music is playing
+#define MEDIA_IDLE_MODE_POLL_MS 1000
+
+// Maximum nesting level of device connection transactions. Beginning a deeper transaction
+// commits the pending changes
+#define MAX_CONNECTION_TRANSACTION_DEPTH 8
+
+// Time in milliseconds after which a device connection transaction not committed is committed
+// anyway, so that a caller failing to commit does not leave the outputs on stale devices
+#define CONNECTION_TRANSACTION_TIMEOUT_MS 2000
+
+// System property read at boot: "1" watches the audio_policy.conf file loaded and reloads it
+// each time it is rewritten or replaced. See reloadAudioPolicyConfig()
+#define WATCH_CONFIG_PROPERTY "audio.policy.watch_config"
+
+// Time in milliseconds during which an output stopped by its last client is considered still
+// attached to paused clients and is not reopened by reloadAudioPolicyConfig()
+#define RELOAD_CONFIG_RECENT_USE_MS 5000
+
+// System property selecting the format used by dump(int fd): "text" (default) or "jsonl"
+// for one JSON object per line
+#define POLICY_DUMP_FORMAT_PROPERTY "audio.policy.dump_format"
+
+// System property read at boot: "1" issues the openOutput() and closeOutput() client calls
+// caused by a device connection change in parallel instead of one at a time. Only for audio
+// HALs supporting concurrent open_output_stream() and close_output_stream() calls.
+// See runOutputCommands()
+#define PARALLEL_OUTPUT_COMMANDS_PROPERTY "audio.policy.parallel_io"
+
+// Maximum number of openOutput() or closeOutput() client calls issued in parallel
+#define MAX_PARALLEL_OUTPUT_COMMANDS 8
+
+// ----------------------------------------------------------------------------
+// AudioPolicyClock is the time base used by the policy manager to track stream activity, to
+// wait while audio paths are switched and to schedule its background work. The default
+// implementation uses the system monotonic clock. Another clock can be installed with
+// AudioPolicyManagerBase::setClock().
+// ----------------------------------------------------------------------------
+
+class AudioPolicyClock
+{
+public:
+    virtual ~AudioPolicyClock() {}
+
+    // current time in nanoseconds. Must never return 0.
+    virtual nsecs_t now() const { return systemTime(); }
+    // blocks the caller for the specified number of microseconds
+    virtual void sleepUs(uint32_t us) { usleep(us); }
+    // waits until cond is signaled or timeout nanoseconds of this clock elapsed. lock must be
+    // held. Returns NO_ERROR if signaled and TIMED_OUT otherwise, like Condition::waitRelative()
+    virtual android::status_t waitRelative(android::Condition& cond, android::Mutex& lock,
+                                           nsecs_t timeout) {
+        return cond.waitRelative(lock, timeout);
+    }
+};
+
+// Interval in milliseconds of real time at which VirtualAudioPolicyClock::waitRelative() checks
+// the simulated time
+#define VIRTUAL_CLOCK_POLL_MS 10
+
+// Simulated clock for host benchmarks and replay runs: time only moves forward when the
+// policy manager sleeps or when advance() is called, so that multi second scenarios run
+// without actually waiting. The start time is far enough from 0 so that streams that were
+// never stopped are not considered recently active. Background waits end once the simulated
+// time passed their deadline, which is checked every VIRTUAL_CLOCK_POLL_MS of real time.
+class VirtualAudioPolicyClock : public AudioPolicyClock
+{
+public:
+    VirtualAudioPolicyClock(nsecs_t start = seconds(3600)) : mNow(start) {}
+
+    virtual nsecs_t now() const;
+    virtual void sleepUs(uint32_t us) { advance(us * 1000LL); }
+    virtual android::status_t waitRelative(android::Condition& cond, android::Mutex& lock,
+                                           nsecs_t timeout);
+    void advance(nsecs_t delta);
+
+private:
+    mutable android::Mutex mLock; // the policy manager threads read the time concurrently
+    nsecs_t mNow;
+};
+
 // ----------------------------------------------------------------------------
 // AudioPolicyManagerBase implements audio policy manager behavior common to all platforms.
 // Each platform must implement an AudioPolicyManager class derived from AudioPolicyManagerBase
@@ -146,10 +248,43 @@ public:
         virtual bool isStreamActiveRemotely(int stream, uint32_t inPastMs = 0) const;
         virtual bool isSourceActive(audio_source_t source) const;
 
+        enum policy_dump_format {
+            DUMP_FORMAT_TEXT,       // human readable
+            DUMP_FORMAT_JSON_LINES  // one JSON object per line and per policy object
+        };
+
         virtual status_t dump(int fd);
+        virtual status_t dumpFormatted(int fd, policy_dump_format format);
 
         virtual bool isOffloadSupported(const audio_offload_info_t& offloadInfo);
 
+        // enter or leave the media idle mode (e.g. screen off without user interaction).
+        // While idle, music is played on a deep buffer output when one can reach the current
+        // media device in order to reduce the number of mixer wake ups.
+        // Called with the value of MEDIA_IDLE_MODE_PROPERTY when it changes.
+        virtual void setMediaIdleMode(bool idle);
+
+        // reads audio_policy.conf again and applies the differences with the I/O profiles in use:
+        // profiles are updated in place, added or removed, and idle outputs opened from a profile
+        // whose stream configuration changed are reopened. Active outputs and inputs keep their
+        // configuration until they are reopened. Added or removed HW modules and global
+        // configuration changes require a restart.
+        // Called when the file changes if WATCH_CONFIG_PROPERTY is "1".
+        virtual status_t reloadAudioPolicyConfig();
+
+        // group the device connection state changes indicated until the matching
+        // commitDeviceConnectionTransaction() so that outputs are rerouted only once when
+        // several devices are connected or disconnected together (e.g. dock). Can be nested.
+        // Connection states are updated immediately but outputs are rerouted on commit only.
+        // Not part of AudioPolicyInterface: meant for platform policy managers that know when
+        // a burst of setDeviceConnectionState() calls begins and ends.
+        status_t beginDeviceConnectionTransaction();
+        status_t commitDeviceConnectionTransaction();
+
+        // installs the clock used for stream activity tracking and path switch delays.
+        // The clock is not owned by the policy manager. NULL restores the system clock.
+        void setClock(AudioPolicyClock *clock);
+
 protected:
 
         enum routing_strategy {
@@ -183,6 +318,28 @@ protected:
             DEVICE_CATEGORY_CNT
         };
 
+        // output buffer of the JSON lines dump: all lines are formatted in place in a single
+        // growing allocation and written at once
+        class PolicyDumpBuffer
+        {
+        public:
+            PolicyDumpBuffer();
+            ~PolicyDumpBuffer();
+
+            void appendf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+            // appends str as a quoted JSON string
+            void appendString(const char *str);
+            status_t flush(int fd);
+
+        private:
+            bool reserve(size_t size);
+
+            char *mData;
+            size_t mSize;      // bytes used in mData
+            size_t mCapacity;  // bytes allocated for mData
+            bool mOverflow;    // an allocation failed: the dump is truncated
+        };
+
         class IOProfile;
 
         class HwModule {
@@ -191,6 +348,7 @@ protected:
                     ~HwModule();
 
             void dump(int fd);
+            void dumpJson(PolicyDumpBuffer& out);
 
             const char *const mName; // base name of the audio HW module (primary, a2dp ...)
             audio_module_handle_t mHandle;
@@ -216,6 +374,7 @@ protected:
                                      audio_output_flags_t flags) const;
 
             void dump(int fd);
+            void dumpJson(PolicyDumpBuffer& out, const char *type, size_t index);
 
             // by convention, "0' in the first entry in mSamplingRates, mChannelMasks or mFormats
             // indicates the supported parameters should be read from the output stream
@@ -228,6 +387,9 @@ protected:
             audio_output_flags_t mFlags; // attribute flags (e.g primary output,
                                                 // direct output...). For outputs only.
             HwModule *mModule;                     // audio HW module exposing this I/O stream
+            String8 mName;                         // name in audio_policy.conf
+            uint32_t mIdleStandbyMs; // time after the last stream stops before a direct output
+                                     // is suspended. 0 if never. For outputs only.
         };
 
         // default volume curve
@@ -255,15 +417,18 @@ protected:
             AudioOutputDescriptor(const IOProfile *profile);
 
             status_t    dump(int fd);
+            void        dumpJson(PolicyDumpBuffer& out, audio_io_handle_t id);
 
             audio_devices_t device() const;
             void changeRefCount(AudioSystem::stream_type stream, int delta);
+            // number of streams of all types using this output
+            uint32_t refCount() const;
 
             bool isDuplicated() const { return (mOutput1 != NULL && mOutput2 != NULL); }
             audio_devices_t supportedDevices();
             uint32_t latency();
             bool sharesHwModuleWith(const AudioOutputDescriptor *outputDesc);
-            bool isActive(uint32_t inPastMs = 0) const;
+            bool isActive(uint32_t inPastMs = 0, nsecs_t sysTime = 0) const;
             bool isStreamActive(AudioSystem::stream_type stream,
                                 uint32_t inPastMs = 0,
                                 nsecs_t sysTime = 0) const;
@@ -288,6 +453,7 @@ protected:
             bool mStrategyMutedByDevice[NUM_STRATEGIES]; // strategies muted because of incompatible
                                                 // device selection. See checkDeviceMuteStrategies()
             uint32_t mDirectOpenCount; // number of clients using this output (direct outputs only)
+            bool mIdleSuspended; // output suspended while idle. See checkIdleOutputs()
         };
 
         // descriptor for audio inputs. Used to maintain current configuration of each opened audio input
@@ -298,6 +464,7 @@ protected:
             AudioInputDescriptor(const IOProfile *profile);
 
             status_t    dump(int fd);
+            void        dumpJson(PolicyDumpBuffer& out, audio_io_handle_t id);
 
             uint32_t mSamplingRate;                     //
             audio_format_t mFormat;                     // input configuration
@@ -315,11 +482,18 @@ protected:
             StreamDescriptor();
 
             int getVolumeIndex(audio_devices_t device);
+            // sets the volume index for a single output device or AUDIO_DEVICE_OUT_DEFAULT
+            void setVolumeIndex(audio_devices_t device, int index);
+            // forgets all device specific volume indexes, keeping the default one
+            void clearVolumeIndexes();
             void dump(int fd);
+            void dumpJson(PolicyDumpBuffer& out, int stream);
 
             int mIndexMin;      // min volume index
             int mIndexMax;      // max volume index
-            KeyedVector<audio_devices_t, int> mIndexCur;   // current volume index per device
+            int mIndexCur[32];  // current volume index per device, indexed by device bit position
+            uint32_t mIndexValid; // bit field of valid mIndexCur[] entries. The entry for
+                                  // AUDIO_DEVICE_OUT_DEFAULT is always valid
             bool mCanBeMuted;   // true is the stream can be muted
 
             const VolumeCurvePoint *mVolumeCurve[DEVICE_CATEGORY_CNT];
@@ -331,6 +505,7 @@ protected:
         public:
 
             status_t dump(int fd);
+            void dumpJson(PolicyDumpBuffer& out, int id);
 
             int mIo;                // io the effect is attached to
             routing_strategy mStrategy; // routing strategy the effect is associated to
@@ -339,7 +514,131 @@ protected:
             bool mEnabled;              // enabled state: CPU load being used or not
         };
 
+        // dynamic parameters read from a direct output profile the last time a given USB audio
+        // device was connected. See loadUsbCapabilities()
+        class UsbCapabilities
+        {
+        public:
+            UsbCapabilities();
+
+            void dump(int fd, const char *key) const;
+            void dumpJson(PolicyDumpBuffer& out, const char *key) const;
+
+            Vector <uint32_t> mSamplingRates;
+            Vector <audio_format_t> mFormats;
+            Vector <audio_channel_mask_t> mChannelMasks;
+            uint32_t mLatency;  // latency reported when the output was opened
+        };
+
+        // The policy state is split in domains, each protected by its own lock:
+        // - LOCK_ROUTE: outputs, connected devices, phone state, forced usages, device selection
+        // - LOCK_INPUT: inputs
+        // - LOCK_VOLUME: stream descriptors and volume indexes
+        // - LOCK_EFFECT: registered effects and their CPU and memory budget. Also held while
+        //   adding or removing outputs and inputs, so that registerEffect() can check its io
+        //   with this lock only
+        // Locks are always acquired in this order, through PolicyAutolock.
+        // Entry points modifying route state also read by other domains (connected devices,
+        // phone state, forced usages, device selection cache) hold LOCK_ALL, so that entry
+        // points holding a single domain lock can read this state consistently.
+        //
+        // Order against AudioPolicyService and AudioFlinger:
+        //   AudioPolicyService::mLock -> LOCK_ROUTE -> LOCK_INPUT -> LOCK_VOLUME
+        //       -> AudioFlinger locks, AudioPolicyService command threads
+        // AudioPolicyService calls the entry points with its lock held. The client operations
+        // called by the manager never take AudioPolicyService::mLock: output and input
+        // operations and moveEffects() go to AudioFlinger, which takes its own locks, and
+        // parameter and volume changes are posted to the AudioCommandThread, which can be
+        // waited for and calls AudioFlinger without taking AudioPolicyService::mLock either.
+        // The client is therefore called with the policy locks held, and the manager threads
+        // (PolicyTimerThread, ConfigWatcherThread) take LOCK_ROUTE or LOCK_ALL without
+        // AudioPolicyService::mLock: nothing holding a policy lock waits for it, and a binder
+        // thread holding it only waits for the policy locks, which are released without it.
+        // OutputCommandThread workers call the client without taking any policy lock.
+        //
+        // AudioFlinger calls registerEffect(), unregisterEffect() and setEffectEnabled() with
+        // its own lock held, so LOCK_EFFECT is a leaf lock: it is acquired last, only for
+        // the time needed to read or update effects, outputs and inputs, and the client is
+        // never called and no other policy lock is acquired while it is held. It is not part
+        // of LOCK_ALL.
+        enum {
+            LOCK_ROUTE  = 0x1,
+            LOCK_INPUT  = 0x2,
+            LOCK_VOLUME = 0x4,
+            LOCK_EFFECT = 0x8,
+            LOCK_ALL    = LOCK_ROUTE | LOCK_INPUT | LOCK_VOLUME
+        };
+
+        // recursive lock: entry points can call each other and be called back from
+        // platform specific overrides while holding it
+        class PolicyLock
+        {
+        public:
+            PolicyLock();
+            ~PolicyLock();
+
+            void lock();
+            void unlock();
+
+        private:
+            pthread_mutex_t mMutex;
+        };
+
+        // acquires the locks of the specified domains in order for the scope lifetime
+        class PolicyAutolock
+        {
+        public:
+            PolicyAutolock(const AudioPolicyManagerBase *manager, uint32_t domains);
+            ~PolicyAutolock();
+
+        private:
+            const AudioPolicyManagerBase *mManager;
+            uint32_t mDomains;
+        };
+
+        // policy events for which the routing command latency is tracked. See RoutingEventScope
+        enum routing_event_type {
+            ROUTING_EVENT_DEVICE_CONNECTION,
+            ROUTING_EVENT_PHONE_STATE,
+            ROUTING_EVENT_FORCE_USE,
+            NUM_ROUTING_EVENT_TYPES
+        };
+
+        // routing command latency statistics: time from the start of a policy event until the
+        // last routing command it causes is issued to the client, plus the delay requested for
+        // that command. The time spent in the client command queue and in the audio HAL is not
+        // included: the client does not report when a command is applied.
+        class RoutingLatencyStats
+        {
+        public:
+            RoutingLatencyStats();
+
+            void add(uint32_t latencyMs);
+            uint32_t percentile(uint32_t percent) const;
+            void dump(int fd, const char *name) const;
+            void dumpJson(PolicyDumpBuffer& out, const char *name) const;
+
+            uint32_t mSamples[ROUTING_LATENCY_HISTORY_SIZE]; // most recent latencies in ms
+            uint32_t mCount;                                 // number of latencies recorded
+            uint32_t mMaxMs;                                 // highest latency recorded
+        };
+
+        // assigns a tracking ID to the policy event processed while the scope is alive and
+        // records its routing command latency when the scope ends. Nested scopes (e.g. a device
+        // connection caused by startInput()) are part of the outer event.
+        class RoutingEventScope
+        {
+        public:
+            RoutingEventScope(AudioPolicyManagerBase *manager, routing_event_type type);
+            ~RoutingEventScope();
+
+        private:
+            AudioPolicyManagerBase *mManager;
+            bool mOwner;    // true if this scope started the current event
+        };
+
         void addOutput(audio_io_handle_t id, AudioOutputDescriptor *outputDesc);
+        void removeOutput(audio_io_handle_t id);
 
         // return the strategy corresponding to a given stream type
         static routing_strategy getStrategy(AudioSystem::stream_type stream);
@@ -365,6 +664,10 @@ protected:
                              bool force = false,
                              int delayMs = 0);
 
+        // records a routing command issued on behalf of the current policy event.
+        // See RoutingLatencyStats
+        void noteRoutingCommand(audio_io_handle_t output, int delayMs);
+
         // select input device corresponding to requested audio source
         virtual audio_devices_t getDeviceForInputSource(int inputSource);
 
@@ -418,10 +721,162 @@ protected:
         // transfers the audio tracks and effects from one output thread to another accordingly.
         status_t checkOutputsForDevice(audio_devices_t device,
                                        AudioSystem::device_connection_state state,
-                                       SortedVector<audio_io_handle_t>& outputs);
+                                       SortedVector<audio_io_handle_t>& outputs,
+                                       const char *address = "");
 
         // close an output and its companion duplicating output.
         void closeOutput(audio_io_handle_t output);
+        // same as closeOutput() for several outputs. See runOutputCommands()
+        void closeOutputs(const SortedVector<audio_io_handle_t>& outputs);
+
+        // openOutput() or closeOutput() client call. See runOutputCommands()
+        class OutputCommand
+        {
+        public:
+            enum command_type {
+                OPEN_OUTPUT,
+                CLOSE_OUTPUT
+            };
+
+            OutputCommand();
+
+            command_type mType;
+            audio_io_handle_t mOutput;      // output to close, or opened output (0 on failure)
+            AudioOutputDescriptor *mDesc;   // OPEN_OUTPUT: configuration of the output to open
+            audio_offload_info_t mOffloadInfo; // OPEN_OUTPUT: offload configuration
+            bool mNotifyClosing;            // CLOSE_OUTPUT: set "closing" parameter first
+        };
+
+        // worker of the pool executing OutputCommands for runOutputCommands()
+        class OutputCommandThread : public android::Thread
+        {
+        public:
+            OutputCommandThread(AudioPolicyManagerBase *manager);
+
+            // starts executing a command. The thread must be idle
+            void execute(OutputCommand *command);
+            // returns once the command passed to execute() is complete
+            void waitIdle();
+            void exit();
+
+        private:
+            virtual bool threadLoop();
+
+            AudioPolicyManagerBase *mManager;
+            android::Mutex mLock;
+            android::Condition mWaitWorkCV;
+            android::Condition mIdleCV;
+            OutputCommand *mCommand; // command in progress or NULL
+        };
+
+        // issues the client calls, in parallel if PARALLEL_OUTPUT_COMMANDS_PROPERTY is "1",
+        // and returns once they are all complete. Only the client is called: the caller updates
+        // the policy state before or after.
+        void runOutputCommands(Vector<OutputCommand>& commands);
+        void executeOutputCommand(OutputCommand& command);
+
+        // applies output device connection changes: updates outputs used by strategies,
+        // closes the outputs listed by checkOutputsForDevice() that are not needed any more
+        // and reroutes all outputs. Deferred to commitDeviceConnectionTransaction() when
+        // a transaction is in progress.
+        void applyOutputDeviceConnection(const SortedVector<audio_io_handle_t>& outputs);
+        // reroutes the active input after an input device connection change
+        void applyInputDeviceConnection();
+        // applies the device connection changes deferred by the transaction just ended
+        void applyConnectionTransaction();
+        // commits the device connection transaction in progress if it was begun more than
+        // CONNECTION_TRANSACTION_TIMEOUT_MS ago. Returns the time in ns until it must be
+        // committed, or -1 if no transaction is in progress.
+        nsecs_t checkConnectionTransactionTimeout();
+
+        // runs a check of the policy manager in the background, e.g. checkIdleOutputs().
+        // The check returns the time in ns on the policy clock until it must run again, or -1
+        // to wait until wake() is called
+        class PolicyTimerThread : public android::Thread
+        {
+        public:
+            typedef nsecs_t (AudioPolicyManagerBase::*check_function)();
+
+            PolicyTimerThread(AudioPolicyManagerBase *manager, check_function check);
+
+            // runs the check again, e.g. when its next deadline may have changed
+            void wake();
+            void exit();
+
+        private:
+            virtual bool threadLoop();
+
+            AudioPolicyManagerBase *mManager;
+            check_function mCheck;
+            android::Mutex mLock;
+            android::Condition mWaitWorkCV;
+            bool mWakePending;
+        };
+
+        // dumpFormatted(fd, DUMP_FORMAT_JSON_LINES) implementation
+        status_t dumpJsonLines(int fd);
+
+        // applies to the profiles of a module the profiles read again from audio_policy.conf.
+        // Profiles added are moved from newProfiles. Profiles whose stream configuration changed
+        // are added to changedProfiles. Returns true if supported devices changed.
+        bool reloadProfiles(HwModule *module,
+                            Vector <IOProfile *>& profiles,
+                            Vector <IOProfile *>& newProfiles,
+                            SortedVector <const IOProfile *>& changedProfiles);
+        // true if an opened output or input derives from the profile
+        bool isProfileInUse(const IOProfile *profile);
+        // closes an idle output and opens it again with the current configuration of its profile
+        void reopenOutput(audio_io_handle_t output);
+        // starts the idle standby thread if an output profile has an idle standby time
+        void startIdleStandbyIfNeeded();
+
+        // calls reloadAudioPolicyConfig() each time a file is closed after writing or moved
+        // in place of the file watched (inotify watch on its directory)
+        class ConfigWatcherThread : public android::Thread
+        {
+        public:
+            ConfigWatcherThread(AudioPolicyManagerBase *manager);
+            virtual ~ConfigWatcherThread();
+
+            // must be called before run()
+            status_t watch(const char *path);
+            void exit();
+
+        private:
+            virtual bool threadLoop();
+
+            AudioPolicyManagerBase *mManager;
+            String8 mFileName;  // name of the file watched in its directory
+            int mInotifyFd;
+            int mExitPipe[2];   // written by exit() to wake up threadLoop()
+        };
+
+        // suspends direct and offloaded outputs whose streams are all stopped since longer than
+        // the idle standby time of their profile. Returns the time in ns until the next output
+        // can be suspended, or -1 if none.
+        nsecs_t checkIdleOutputs();
+        // restores an output suspended by checkIdleOutputs() before it is used again
+        void restoreIdleOutput(audio_io_handle_t output, AudioOutputDescriptor *outputDesc);
+
+        // writes the snapshots built by saveStateSnapshot() to AUDIO_POLICY_STATE_SNAPSHOT_FILE
+        // outside of the policy locks. Only the last snapshot posted is written
+        class StateSnapshotThread : public android::Thread
+        {
+        public:
+            StateSnapshotThread();
+
+            void post(const Vector<uint8_t>& snapshot);
+            // writes the pending snapshot if any and stops the thread
+            void exit();
+
+        private:
+            virtual bool threadLoop();
+
+            android::Mutex mLock;
+            android::Condition mWaitWorkCV;
+            Vector<uint8_t> mSnapshot; // last snapshot posted
+            bool mSnapshotPending;     // mSnapshot not written yet
+        };
 
         // checks and if necessary changes outputs used for all strategies.
         // must be called every time a condition that affects the output choice for a given strategy
@@ -432,11 +887,14 @@ protected:
         // Same as checkOutputForStrategy() but for a all strategies in order of priority
         void checkOutputForAllStrategies();
 
-        // manages A2DP output suspend/restore according to phone state and BT SCO usage
+        // manages A2DP output suspend/restore according to phone state and BT SCO usage.
+        // Does nothing unless mA2dpSuspendCheckNeeded is set.
         void checkA2dpSuspend();
 
         // returns the A2DP output handle if it is open or 0 otherwise
         audio_io_handle_t getA2dpOutput();
+        // must be called when an output is added or removed or its A2DP routing changes
+        void invalidateA2dpOutput();
 
         // selects the most appropriate device on output for current state
         // must be called every time a condition that affects the device choice for a given output is
@@ -452,6 +910,16 @@ protected:
 
         void updateDevicesAndOutputs();
 
+        // policy recompute pass: after a change of phone state or forced usage, the devices
+        // selected for all strategies are computed once by beginPolicyRecompute() and reused by
+        // checkOutputForAllStrategies(), updateDevicesAndOutputs(), getNewDevice() and
+        // checkDeviceMuteStrategies() until endPolicyRecompute()
+        void beginPolicyRecompute();
+        void endPolicyRecompute();
+        // returns the device selected for a strategy in current state: the value computed by
+        // the recompute pass in progress if any, getDeviceForStrategy() otherwise
+        audio_devices_t getTargetDeviceForStrategy(routing_strategy strategy);
+
         virtual uint32_t getMaxEffectsCpuLoad();
         virtual uint32_t getMaxEffectsMemory();
 #ifdef AUDIO_POLICY_TEST
@@ -495,8 +963,50 @@ protected:
 
         audio_io_handle_t selectOutputForEffects(const SortedVector<audio_io_handle_t>& outputs);
 
+        // returns the estimated CPU cost of running the enabled global effects on the specified
+        // output or EFFECTS_COST_UNSUPPORTED if they cannot run on this output
+        uint32_t getGlobalEffectsCost(AudioOutputDescriptor *outputDesc);
+
+        // moves all global effects (session AUDIO_SESSION_OUTPUT_MIX) to the specified output
+        void moveGlobalEffects(audio_io_handle_t dstOutput);
+
+        // checks and if necessary changes the output global effects are attached to.
+        // must be called every time a condition that affects the output choice for effects
+        // changes: routing, media activity...
+        void checkOutputForEffects();
+
         bool isNonOffloadableEffectEnabled();
 
+        // saves forced usages, volume indexes and USB device capabilities to
+        // AUDIO_POLICY_STATE_SNAPSHOT_FILE. The file is written asynchronously by
+        // mStateSnapshotThread
+        void saveStateSnapshot();
+        // restores the state saved by saveStateSnapshot() if the snapshot was taken since the
+        // last boot and sets mBootId. Must be called once all attached outputs are open.
+        void restoreStateSnapshot();
+
+        // true if some parameters of this profile are read from the output when it is opened
+        static bool hasDynamicParameters(const IOProfile *profile);
+        // returns the mUsbCapabilities key for a USB device address and output profile
+        static String8 getUsbCapabilitiesKey(const char *address, const IOProfile *profile);
+        // fills the dynamic parameters of a direct output profile with the values read last time
+        // the same USB device was connected. Returns false if the device is not known.
+        bool loadUsbCapabilities(const char *address, IOProfile *profile);
+        // remembers the dynamic parameters just read from a direct output profile
+        void storeUsbCapabilities(const char *address, const IOProfile *profile, uint32_t latency);
+
+        // returns the deep buffer output that can reach the specified device or 0 if none
+        audio_io_handle_t getDeepBufferOutput(audio_devices_t device);
+
+        // moves active music streams to or from the deep buffer output according to
+        // the media idle mode. See setMediaIdleMode()
+        void checkOutputForMediaIdle();
+        // applies the media idle mode requested by MEDIA_IDLE_MODE_PROPERTY
+        void updateMediaIdleMode();
+        // calls updateMediaIdleMode(). Returns the time in ns until the property must be read
+        // again, or -1 if no music is playing: startOutput() then wakes mMediaIdleThread
+        nsecs_t checkMediaIdleMode();
+
         //
         // Audio policy configuration file parsing (audio_policy.conf)
         //
@@ -513,7 +1023,9 @@ protected:
         status_t loadOutput(cnode *root,  HwModule *module);
         status_t loadInput(cnode *root,  HwModule *module);
         void loadHwModule(cnode *root);
+        void loadHwModule(cnode *root, Vector <HwModule *>& modules);
         void loadHwModules(cnode *root);
+        void loadHwModules(cnode *root, Vector <HwModule *>& modules);
         void loadGlobalConfig(cnode *root);
         status_t loadAudioPolicyConfig(const char *path);
         void defaultAudioPolicyConfig(void);
@@ -539,6 +1051,8 @@ protected:
         String8 mScoDeviceAddress;                                          // SCO device MAC address
         String8 mUsbCardAndDevice; // USB audio ALSA card and device numbers:
                                    // card=<card_number>;device=<><device_number>
+        // capabilities of the USB audio devices connected since boot. See loadUsbCapabilities()
+        KeyedVector <String8, UsbCapabilities> mUsbCapabilities;
         bool    mLimitRingtoneVolume;                                       // limit ringtone volume to music volume if headset connected
         audio_devices_t mDeviceForStrategy[NUM_STRATEGIES];
         float   mLastVoiceVolume;                                           // last voice volume value sent to audio HAL
@@ -547,10 +1061,20 @@ protected:
         static const uint32_t MAX_EFFECTS_CPU_LOAD = 1000;
         // Maximum memory allocated to audio effects in KB
         static const uint32_t MAX_EFFECTS_MEMORY = 512;
+        // Estimated CPU load in 0.1 MIPS units of calling one effect once per millisecond.
+        // Used to account for the mix period when placing global effects
+        static const uint32_t EFFECT_WAKEUP_CPU_LOAD = 100;
+        // Cost returned by getGlobalEffectsCost() when effects cannot run on an output
+        static const uint32_t EFFECTS_COST_UNSUPPORTED = 0xFFFFFFFF;
         uint32_t mTotalEffectsCpuLoad; // current CPU load used by effects
         uint32_t mTotalEffectsMemory;  // current memory used by effects
         KeyedVector<int, EffectDescriptor *> mEffects;  // list of registered audio effects
         bool    mA2dpSuspended;  // true if A2DP output is suspended
+        audio_io_handle_t mA2dpOutput; // getA2dpOutput() result, valid if mA2dpOutputValid is true
+        bool mA2dpOutputValid;
+        // phone state, forced usage, SCO device or A2DP output changed since last
+        // checkA2dpSuspend()
+        bool mA2dpSuspendCheckNeeded;
         bool mHasA2dp; // true on platforms with support for bluetooth A2DP
         bool mHasUsb; // true on platforms with support for USB audio
         bool mHasRemoteSubmix; // true on platforms with support for remote presentation of a submix
@@ -559,6 +1083,44 @@ protected:
                                               // (must be in mAttachedOutputDevices)
         bool mSpeakerDrcEnabled;// true on devices that use DRC on the DEVICE_CATEGORY_SPEAKER path
                                 // to boost soft sounds, used to adjust volume curves accordingly
+        bool mMediaIdle; // true when music should be played on a deep buffer output
+        AudioPolicyClock mSystemClock; // default clock
+        AudioPolicyClock *mClock;      // clock in use. See setClock()
+
+        uint32_t mNextRoutingEventId;         // tracking ID assigned to the next policy event
+        uint32_t mRoutingEventId;             // ID of the policy event in progress or 0
+        routing_event_type mRoutingEventType; // type of the policy event in progress
+        nsecs_t mRoutingEventStartTime;       // time at which the policy event started
+        int32_t mRoutingEventLatencyMs;       // latency of its last routing command or -1
+        RoutingLatencyStats mRoutingLatency[NUM_ROUTING_EVENT_TYPES];
+        String8 mBootId; // kernel boot ID the state snapshots are tagged with
+        // state snapshot writer. NULL until restoreStateSnapshot() is done
+        android::sp<StateSnapshotThread> mStateSnapshotThread;
+        uint32_t mConnectionTransactionDepth; // nesting level of device connection transactions
+        nsecs_t mConnectionTransactionStartTime; // time at which the transaction began
+        // runs checkConnectionTransactionTimeout(). NULL until the first transaction
+        android::sp<PolicyTimerThread> mConnectionTransactionThread;
+        // outputs listed by checkOutputsForDevice() during the current transaction
+        SortedVector<audio_io_handle_t> mTransactionOutputs;
+        bool mTransactionOutputsChanged; // output device connection changed during transaction
+        bool mTransactionInputsChanged;  // input device connection changed during transaction
+        bool mRecomputing; // true while a policy recompute pass is in progress
+        // runOutputCommands() workers. Empty unless PARALLEL_OUTPUT_COMMANDS_PROPERTY is "1"
+        Vector< android::sp<OutputCommandThread> > mOutputCommandThreads;
+        // runs checkIdleOutputs(). NULL if no output profile has an idle standby time
+        android::sp<PolicyTimerThread> mIdleStandbyThread;
+        // runs checkMediaIdleMode(). NULL if no deep buffer output is open
+        android::sp<PolicyTimerThread> mMediaIdleThread;
+        String8 mConfigFile; // audio_policy.conf file loaded, empty if defaults are used
+        // NULL unless WATCH_CONFIG_PROPERTY is "1"
+        android::sp<ConfigWatcherThread> mConfigWatcherThread;
+        // devices selected for each strategy by the recompute pass in progress
+        audio_devices_t mTargetDeviceForStrategy[NUM_STRATEGIES];
+
+        mutable PolicyLock mRouteLock;  // see LOCK_ROUTE
+        mutable PolicyLock mInputLock;  // see LOCK_INPUT
+        mutable PolicyLock mVolumeLock; // see LOCK_VOLUME
+        mutable PolicyLock mEffectLock; // see LOCK_EFFECT
 
         Vector <HwModule *> mHwModules;
 
@@ -47,6 +47,7 @@
 #define CHANNELS_TAG "channel_masks"
 #define DEVICES_TAG "devices"
 #define FLAGS_TAG "flags"
+#define IDLE_STANDBY_TAG "idle_standby_ms" // time after which an idle direct output is suspended
 
 #define DYNAMIC_VALUE_TAG "dynamic" // special value for "channel_masks", "sampling_rates" and
                                     // "formats" in outputs descriptors indicating that supported